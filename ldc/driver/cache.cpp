@@ -18,32 +18,73 @@
 // changes that trigger recompilation of many files but with little effective
 // changes (in the extreme case, adding a comment in a "globals.d").
 //
-// The current limitation is that hashing and cache look-up are done with
-// whole-module granularity. Future work could attempt to do this for module
-// "fragments".
+// Hashing and cache look-up are primarily done with whole-module granularity.
+// With `-cache-fragments=<N>`, a module whose object file isn't found in the
+// cache is optimized and then split into up to N fragments, each of which is
+// hashed and cached separately. Only the fragments which aren't found in the
+// cache are codegen'd, and all fragment objects are then linked into the
+// final relocatable object file. This saves machine codegen of the unchanged
+// parts of big modules after small changes.
+//
+// With `-cache-frontend`, a module's object file is looked up even before IR
+// generation, by a hash of the module's source, the sources of all modules it
+// (transitively) imports, string-imported files and the cmdline flags. On a
+// hit, both IR generation and IR hashing are skipped. Code depending on
+// `__DATE__`, `__TIME__` or `__TIMESTAMP__` isn't detected as changed.
 //
 // The hash depends on the IR code (obviously), but also on the compiler+LLVM
 // versions and several compile flags (e.g. -O*, -mcpu, and -mattr).
+// By default, the IR is hashed by MD5 over the module's complete bitcode. As
+// this is paid for on every cache hit too, `-cache-hash=xxhash` selects a
+// faster alternative: a 64-bit xxHash of the bitcode written without the
+// symbol table (whose construction is a significant part of the bitcode
+// writer's cost).
+//
+// With `-cache-compress`, cache files are stored compressed, prefixed by a
+// small header (which also records the codegen time for `-cache-stats`), and
+// decompressed upon retrieval. Uncompressed and compressed files can coexist
+// in a cache directory; they are told apart by the header's magic bytes.
+//
+// With `-cache-remote=<url>`, cache files not found in the local cache
+// directory are looked up on a cache server shared by multiple machines (see
+// driver/cache_backend.h), and new cache files are uploaded to it. Fetched
+// files are stored in the local directory first (write-through).
 //
 //===----------------------------------------------------------------------===//
 
 #include "driver/cache.h"
 
 #include "dmd/errors.h"
+#include "dmd/module.h"
 #include "dmd/target.h"
+#include "driver/cache_backend.h"
 #include "driver/cache_pruning.h"
 #include "driver/cl_options.h"
+#include "driver/cl_options_instrumentation.h"
 #include "driver/cl_options_sanitizers.h"
+#include "driver/exe_path.h"
 #include "driver/ldc-version.h"
+#include "driver/timetrace.h"
 #include "gen/logger.h"
 #include "gen/optimizer.h"
 
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Support/Chrono.h"
+#include "llvm/Support/Compression.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 // Include close() declaration.
 #if !defined(_MSC_VER) && !defined(__MINGW32__)
@@ -144,6 +185,35 @@ llvm::cl::opt<unsigned> pruneSizeLimitPercentage(
         "Sets the cache size limit to <perc> percent of the available "
         "space (default: 75%). Implies -cache-prune."),
     llvm::cl::value_desc("perc"), llvm::cl::init(75));
+llvm::cl::opt<bool> pruneInBackground(
+    "cache-prune-background",
+    llvm::cl::desc("Prune the cache in a detached ldc-prune-cache process "
+                   "instead of at the end of compilation. Implies "
+                   "-cache-prune."));
+
+llvm::cl::opt<unsigned> fragmentCount(
+    "cache-fragments",
+    llvm::cl::desc("Split modules not found in the cache into up to <N> "
+                   "fragments after optimization, and cache the object code "
+                   "of each fragment separately (default: 0 = disabled)."),
+    llvm::cl::value_desc("N"), llvm::cl::init(0));
+
+llvm::cl::opt<bool> frontendLookupEnabled(
+    "cache-frontend",
+    llvm::cl::desc("Look up object files in the cache before IR generation, "
+                   "by hashing the source files (skipping IR generation on "
+                   "a hit)."));
+
+enum class HashKind { MD5, XXHash };
+llvm::cl::opt<HashKind> cacheHashKind(
+    "cache-hash", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Set the hash function for cache lookups (default: md5)."),
+    llvm::cl::init(HashKind::MD5),
+    llvm::cl::values(
+        clEnumValN(HashKind::MD5, "md5", "MD5 of the module's bitcode"),
+        clEnumValN(HashKind::XXHash, "xxhash",
+                   "xxHash64 of the module's bitcode without symbol table "
+                   "(faster, non-cryptographic)")));
 
 enum class RetrievalMode { Copy, HardLink, AnyLink, SymLink };
 llvm::cl::opt<RetrievalMode> cacheRecoveryMode(
@@ -161,6 +231,364 @@ llvm::cl::opt<RetrievalMode> cacheRecoveryMode(
         clEnumValN(RetrievalMode::SymLink, "symlink",
                    "Create a symbolic link to the cache file")));
 
+enum class CompressionKind : uint8_t { None, Zlib, Zstd };
+llvm::cl::opt<CompressionKind> cacheCompression(
+    "cache-compress", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Compress the object files added to the cache (default: "
+                   "none). Compressed files are always retrieved by "
+                   "decompressing them into a copy."),
+    llvm::cl::init(CompressionKind::None),
+    llvm::cl::values(
+        clEnumValN(CompressionKind::None, "none", "Don't compress"),
+        clEnumValN(CompressionKind::Zlib, "zlib", "Compress with zlib"),
+        clEnumValN(CompressionKind::Zstd, "zstd",
+                   "Compress with Zstandard (faster, LLVM 16+)")));
+
+llvm::cl::opt<std::string> remoteURL(
+    "cache-remote", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Share the object cache via a remote cache server, using "
+                   "the local cache directory as write-through cache. <url> "
+                   "is http://<host>[:<port>][/<path>] or unix:<socket path> "
+                   "(see ldc-cache-server)."),
+    llvm::cl::value_desc("url"));
+
+llvm::cl::opt<bool> printStats(
+    "cache-stats",
+    llvm::cl::desc("Print statistics about the cache hits and stored object "
+                   "files of this compiler invocation."));
+
+// Per-invocation statistics, printed with `-cache-stats`.
+struct Statistics {
+  unsigned hits = 0;
+  // Lookups not finding an object file in the local or remote cache.
+  unsigned misses = 0;
+  // Hits on entries not recording the time it took to produce them.
+  unsigned hitsWithoutCodegenTime = 0;
+  uint64_t recoveredBytes = 0;
+  std::chrono::microseconds savedCodegenTime{0};
+  unsigned stores = 0;
+  uint64_t storedBytes = 0;
+  uint64_t storedBytesOnDisk = 0;
+  // Files fetched from the remote backend into the local cache directory.
+  unsigned remoteFetches = 0;
+} stats;
+
+// Compressed cache files start with this header, followed by the compressed
+// object file. Neither object nor bitcode files start with the magic bytes.
+// All fields are little-endian.
+struct CompressedFileHeader {
+  static constexpr char magic[4] = {'L', 'D', 'C', 'Z'};
+  static constexpr size_t size = 24;
+  // 4 bytes magic, 1 byte format version, 1 byte CompressionKind, 2 bytes
+  // reserved, 8 bytes uncompressed size, 8 bytes codegen time in microseconds.
+  static constexpr uint8_t version = 1;
+
+  CompressionKind kind = CompressionKind::None;
+  uint64_t uncompressedSize = 0;
+  uint64_t codegenMicroseconds = 0;
+
+  void write(llvm::raw_ostream &os) const {
+    char buffer[size] = {};
+    memcpy(buffer, magic, 4);
+    buffer[4] = version;
+    buffer[5] = static_cast<char>(kind);
+    llvm::support::endian::write64le(buffer + 8, uncompressedSize);
+    llvm::support::endian::write64le(buffer + 16, codegenMicroseconds);
+    os.write(buffer, size);
+  }
+
+  // Returns false if `data` doesn't start with a valid header.
+  bool read(llvm::StringRef data) {
+    if (data.size() < size || memcmp(data.data(), magic, 4) != 0 ||
+        data[4] != version)
+      return false;
+    kind = static_cast<CompressionKind>(data[5]);
+    uncompressedSize = llvm::support::endian::read64le(data.data() + 8);
+    codegenMicroseconds = llvm::support::endian::read64le(data.data() + 16);
+    return kind == CompressionKind::Zlib || kind == CompressionKind::Zstd;
+  }
+};
+constexpr char CompressedFileHeader::magic[4];
+
+bool isCompressionAvailable(CompressionKind kind) {
+  switch (kind) {
+  case CompressionKind::None:
+    return true;
+  case CompressionKind::Zlib:
+#if LDC_LLVM_VER >= 1500
+    return llvm::compression::zlib::isAvailable();
+#else
+    return llvm::zlib::isAvailable();
+#endif
+  case CompressionKind::Zstd:
+#if LDC_LLVM_VER >= 1600
+    return llvm::compression::zstd::isAvailable();
+#else
+    return false;
+#endif
+  }
+  llvm_unreachable("Unknown compression kind");
+}
+
+void compressBuffer(CompressionKind kind, llvm::StringRef input,
+                    llvm::SmallVectorImpl<char> &output) {
+#if LDC_LLVM_VER >= 1500
+  llvm::SmallVector<uint8_t, 0> compressed;
+  if (kind == CompressionKind::Zlib) {
+    llvm::compression::zlib::compress(llvm::arrayRefFromStringRef(input),
+                                      compressed);
+  } else {
+#if LDC_LLVM_VER >= 1600
+    llvm::compression::zstd::compress(llvm::arrayRefFromStringRef(input),
+                                      compressed);
+#endif
+  }
+  output.assign(compressed.begin(), compressed.end());
+#else
+  if (auto err = llvm::zlib::compress(input, output)) {
+    error(Loc(), "Failed to compress object file for the cache: %s",
+          llvm::toString(std::move(err)).c_str());
+    fatal();
+  }
+#endif
+}
+
+// Returns an error message on failure.
+std::string decompressBuffer(CompressionKind kind, llvm::StringRef input,
+                             size_t uncompressedSize,
+                             llvm::SmallVectorImpl<char> &output) {
+  if (!isCompressionAvailable(kind))
+    return "compression algorithm not supported by this LDC build";
+#if LDC_LLVM_VER >= 1500
+  llvm::SmallVector<uint8_t, 0> decompressed;
+  llvm::Error err = llvm::Error::success();
+  if (kind == CompressionKind::Zlib) {
+    err = llvm::compression::zlib::decompress(
+        llvm::arrayRefFromStringRef(input), decompressed, uncompressedSize);
+  } else {
+#if LDC_LLVM_VER >= 1600
+    err = llvm::compression::zstd::decompress(
+        llvm::arrayRefFromStringRef(input), decompressed, uncompressedSize);
+#endif
+  }
+  if (err)
+    return llvm::toString(std::move(err));
+  output.assign(decompressed.begin(), decompressed.end());
+#else
+  if (auto err = llvm::zlib::uncompress(input, output, uncompressedSize))
+    return llvm::toString(std::move(err));
+#endif
+  return "";
+}
+
+// Writes the compressed object file to the (temporary) cache file, unless
+// compression is disabled or doesn't pay off. Returns the size of the file.
+uint64_t writeCompressedFile(llvm::StringRef objectFile,
+                             llvm::StringRef cacheFile,
+                             std::chrono::microseconds codegenTime) {
+  if (cacheCompression == CompressionKind::None)
+    return 0;
+
+  auto buffer = llvm::MemoryBuffer::getFile(objectFile);
+  if (!buffer) {
+    error(Loc(), "Failed to read object file for the cache: %s (%s)",
+          objectFile.str().c_str(), buffer.getError().message().c_str());
+    fatal();
+  }
+  const llvm::StringRef contents = (*buffer)->getBuffer();
+
+  llvm::SmallVector<char, 0> compressed;
+  compressBuffer(cacheCompression, contents, compressed);
+  if (compressed.size() + CompressedFileHeader::size >= contents.size()) {
+    IF_LOG Logger::println("Compression doesn't reduce the size, store as is");
+    return 0;
+  }
+
+  std::error_code errorcode;
+  llvm::raw_fd_ostream os(cacheFile, errorcode, llvm::sys::fs::OF_None);
+  if (!errorcode) {
+    CompressedFileHeader header;
+    header.kind = cacheCompression;
+    header.uncompressedSize = contents.size();
+    header.codegenMicroseconds = codegenTime.count();
+    header.write(os);
+    os.write(compressed.data(), compressed.size());
+    os.close();
+    errorcode = os.error();
+  }
+  if (errorcode) {
+    error(Loc(), "Failed to write compressed object file to cache: %s (%s)",
+          cacheFile.str().c_str(), errorcode.message().c_str());
+    fatal();
+  }
+
+  IF_LOG Logger::println("Compressed object file from %llu to %llu bytes",
+                         static_cast<unsigned long long>(contents.size()),
+                         static_cast<unsigned long long>(
+                             compressed.size() + CompressedFileHeader::size));
+  return compressed.size() + CompressedFileHeader::size;
+}
+
+// Uncompressed cache files have no header, so their codegen time is recorded
+// in a small file next to them (`<cache file>.time`, 8 bytes little-endian
+// microseconds). It is removed by the pruning together with the cache file.
+void getCodegenTimeFileName(llvm::StringRef cacheFile,
+                            llvm::SmallString<128> &timeFile) {
+  timeFile = cacheFile;
+  timeFile += ".time";
+}
+
+// Records the codegen time of the uncompressed cache file. Failures are
+// ignored, the time is only used for the statistics.
+void writeCodegenTimeFile(llvm::StringRef cacheFile,
+                          std::chrono::microseconds codegenTime) {
+  llvm::SmallString<128> timeFile;
+  getCodegenTimeFileName(cacheFile, timeFile);
+  std::error_code errorcode;
+  llvm::raw_fd_ostream os(timeFile, errorcode, llvm::sys::fs::OF_None);
+  if (errorcode)
+    return;
+  char buffer[8];
+  llvm::support::endian::write64le(buffer, codegenTime.count());
+  os.write(buffer, sizeof(buffer));
+  os.close();
+  if (os.has_error()) {
+    os.clear_error();
+    llvm::sys::fs::remove(timeFile);
+  }
+}
+
+// Returns the recorded codegen time of the uncompressed cache file in
+// microseconds, or 0 if not recorded.
+uint64_t readCodegenTimeFile(llvm::StringRef cacheFile) {
+  llvm::SmallString<128> timeFile;
+  getCodegenTimeFileName(cacheFile, timeFile);
+  auto buffer = llvm::MemoryBuffer::getFile(timeFile);
+  if (!buffer || (*buffer)->getBufferSize() != 8)
+    return 0;
+  return llvm::support::endian::read64le((*buffer)->getBufferStart());
+}
+
+// Reads the header of the cache file; returns false if it isn't compressed.
+bool readCompressedFileHeader(llvm::StringRef cacheFile,
+                              CompressedFileHeader &header) {
+  auto fileOrError = llvm::sys::fs::openNativeFileForRead(cacheFile);
+  if (!fileOrError) {
+    llvm::consumeError(fileOrError.takeError());
+    return false;
+  }
+  char buffer[CompressedFileHeader::size];
+  auto bytesRead = llvm::sys::fs::readNativeFile(
+      *fileOrError, llvm::MutableArrayRef<char>(buffer));
+  llvm::sys::fs::closeFile(*fileOrError);
+  if (!bytesRead) {
+    llvm::consumeError(bytesRead.takeError());
+    return false;
+  }
+  return header.read(llvm::StringRef(buffer, *bytesRead));
+}
+
+void decompressCacheFile(llvm::StringRef cacheFile, llvm::StringRef objectFile,
+                         const CompressedFileHeader &header) {
+  IF_LOG Logger::println("Decompress cached object file: %s -> %s",
+                         cacheFile.str().c_str(), objectFile.str().c_str());
+  auto buffer = llvm::MemoryBuffer::getFile(cacheFile);
+  std::string errorMessage;
+  llvm::SmallVector<char, 0> decompressed;
+  if (!buffer) {
+    errorMessage = buffer.getError().message();
+  } else {
+    errorMessage = decompressBuffer(
+        header.kind,
+        (*buffer)->getBuffer().drop_front(CompressedFileHeader::size),
+        header.uncompressedSize, decompressed);
+  }
+
+  std::error_code errorcode;
+  if (errorMessage.empty()) {
+    llvm::raw_fd_ostream os(objectFile, errorcode, llvm::sys::fs::OF_None);
+    if (!errorcode) {
+      os.write(decompressed.data(), decompressed.size());
+      os.close();
+      errorcode = os.error();
+    }
+    if (errorcode)
+      errorMessage = errorcode.message();
+  }
+  if (!errorMessage.empty()) {
+    error(Loc(), "Failed to decompress the cached file: %s -> %s (%s)",
+          cacheFile.str().c_str(), objectFile.str().c_str(),
+          errorMessage.c_str());
+    fatal();
+  }
+}
+
+// Retrieves the uncompressed cache file as `objectFile`, as specified by
+// `-cache-retrieval`.
+void recoverUncompressedFile(llvm::SmallString<128> &cacheFile,
+                             llvm::StringRef objectFile) {
+  switch (cacheRecoveryMode) {
+  case RetrievalMode::Copy: {
+    IF_LOG Logger::println("Copy cached object file: %s -> %s",
+                           cacheFile.c_str(), objectFile.str().c_str());
+    if (auto errorcode =
+            llvm::sys::fs::copy_file(cacheFile.c_str(), objectFile)) {
+      error(Loc(), "Failed to copy the cached file: %s -> %s (errno %d: %s)",
+            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
+            errorcode.message().c_str());
+      fatal();
+    }
+  } break;
+  case RetrievalMode::HardLink: {
+    IF_LOG Logger::println("HardLink output to cached object file: %s -> %s",
+                           objectFile.str().c_str(), cacheFile.c_str());
+    if (auto errorcode =
+            createHardLink(cacheFile.c_str(), objectFile.str().c_str())) {
+      error(Loc(),
+            "Failed to create a hard link to the cached file: %s -> %s (errno "
+            "%d: %s)",
+            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
+            errorcode.message().c_str());
+      fatal();
+    }
+  } break;
+  case RetrievalMode::AnyLink: {
+    IF_LOG Logger::println("Link output to cached object file: %s -> %s",
+                           objectFile.str().c_str(), cacheFile.c_str());
+    if (auto errorcode =
+            llvm::sys::fs::create_link(cacheFile.c_str(), objectFile)) {
+      error(
+          Loc(),
+          "Failed to create a link to the cached file: %s -> %s (errno %d: %s)",
+          cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
+          errorcode.message().c_str());
+      fatal();
+    }
+  } break;
+  case RetrievalMode::SymLink: {
+    IF_LOG Logger::println("SymLink output to cached object file: %s -> %s",
+                           objectFile.str().c_str(), cacheFile.c_str());
+    if (auto errorcode =
+            createSymLink(cacheFile.c_str(), objectFile.str().c_str())) {
+      error(Loc(),
+            "Failed to create a symbolic link to the cached file: %s -> %s "
+            "(errno %d: %s)",
+            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
+            errorcode.message().c_str());
+      fatal();
+    }
+  } break;
+  }
+}
+
+std::string formatBytes(uint64_t bytes) {
+  if (bytes < 10 * 1024)
+    return (llvm::Twine(bytes) + " bytes").str();
+  if (bytes < 10 * 1024 * 1024)
+    return (llvm::Twine(bytes / 1024) + " KiB").str();
+  return (llvm::Twine(bytes / (1024 * 1024)) + " MiB").str();
+}
+
 bool isPruningEnabled() {
   if (pruneEnabled)
     return true;
@@ -169,7 +597,8 @@ bool isPruningEnabled() {
   if ((pruneSizeLimitInBytes.getNumOccurrences() > 0) ||
       (pruneInterval.getNumOccurrences() > 0) ||
       (pruneExpiration.getNumOccurrences() > 0) ||
-      (pruneSizeLimitPercentage.getNumOccurrences() > 0))
+      (pruneSizeLimitPercentage.getNumOccurrences() > 0) ||
+      pruneInBackground)
     return true;
 
   return false;
@@ -180,6 +609,181 @@ llvm::sys::TimePoint<std::chrono::seconds> getTimeNow() {
   return time_point_cast<seconds>(system_clock::now());
 }
 
+// Appends a line to the cache's access log, which is used for pruning without
+// scanning the cache directory (see driver/cache_pruning.d). The log is
+// created by the pruning, so nothing is logged if pruning is never done.
+// `size` is 0 for accesses of existing files.
+void appendToAccessLog(char kind, llvm::StringRef cacheFile, uint64_t size) {
+  llvm::SmallString<128> logFile(opts::cacheDir);
+  llvm::sys::path::append(logFile, "ircache_access.log");
+
+#if LDC_LLVM_VER >= 1200
+  // The pruning replaces the log while holding this lock (see
+  // driver/cache_pruning.d), lines appended meanwhile would be lost.
+  llvm::SmallString<128> lockFile(logFile);
+  lockFile += ".lock";
+  int lockFD;
+  if (llvm::sys::fs::openFileForWrite(lockFile, lockFD,
+                                      llvm::sys::fs::CD_OpenAlways,
+                                      llvm::sys::fs::OF_Append)) {
+    return;
+  }
+  struct LockGuard {
+    int FD;
+    ~LockGuard() {
+      llvm::sys::fs::unlockFile(FD);
+      llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    }
+  } lockGuard{lockFD};
+  if (llvm::sys::fs::lockFile(lockFD))
+    return;
+#endif
+
+  int FD;
+  if (llvm::sys::fs::openFileForWrite(logFile, FD,
+                                      llvm::sys::fs::CD_OpenExisting,
+                                      llvm::sys::fs::OF_Append)) {
+    return;
+  }
+
+  // Lines are written with a single write() each, so that concurrent
+  // compiler invocations don't interleave them.
+  llvm::raw_fd_ostream os(FD, /*shouldClose=*/true);
+  os << kind << ' ' << llvm::sys::toTimeT(getTimeNow()) << ' ' << size << ' '
+     << llvm::sys::path::filename(cacheFile) << '\n';
+  os.close();
+  // A missing log entry is harmless, it's caught by the next directory scan.
+  if (os.has_error())
+    os.clear_error();
+}
+
+std::unique_ptr<cache::Backend> remoteBackend;
+bool remoteBackendInitialized = false;
+
+// Returns the `-cache-remote` backend, or null if none.
+cache::Backend *getRemoteBackend() {
+  if (!remoteBackendInitialized) {
+    remoteBackendInitialized = true;
+    if (!remoteURL.empty()) {
+      std::string errorMessage;
+      remoteBackend = cache::createRemoteBackend(remoteURL, errorMessage);
+      if (!remoteBackend) {
+        error(Loc(), "invalid `-cache-remote` URL `%s`: %s",
+              remoteURL.c_str(), errorMessage.c_str());
+        fatal();
+      }
+    }
+  }
+  return remoteBackend.get();
+}
+
+// The cache server being unavailable isn't an error, but it's not used
+// anymore in this invocation, to avoid running into timeouts repeatedly.
+void disableRemoteBackend(const std::string &errorMessage) {
+  IF_LOG Logger::println("Remote cache error: %s", errorMessage.c_str());
+  if (global.params.v.verbose) {
+    message("cache     remote cache %s unavailable: %s",
+            remoteBackend->describe().c_str(), errorMessage.c_str());
+  }
+  remoteBackend.reset();
+}
+
+void createCacheDirectory() {
+  if (!llvm::sys::fs::exists(opts::cacheDir)) {
+    if (auto errorcode = llvm::sys::fs::create_directories(opts::cacheDir)) {
+      error(Loc(), "Unable to create cache directory: %s (errno %d: %s)",
+            opts::cacheDir.c_str(), errorcode.value(),
+            errorcode.message().c_str());
+      fatal();
+    }
+  }
+}
+
+// Fetches the cache file from the remote backend into the local cache
+// directory (atomically, like cacheObjectFile()).
+bool fetchFromRemote(cache::Backend &remote, llvm::StringRef cacheFile) {
+  createCacheDirectory();
+
+  llvm::SmallString<128> tempFile;
+  if (llvm::sys::fs::createUniqueFile(llvm::Twine(cacheFile) + ".tmp%%%%%%%",
+                                      tempFile)) {
+    return false;
+  }
+
+  std::string errorMessage;
+  if (!remote.fetch(llvm::sys::path::filename(cacheFile), tempFile,
+                    errorMessage)) {
+    llvm::sys::fs::remove(tempFile);
+    if (!errorMessage.empty())
+      disableRemoteBackend(errorMessage);
+    return false;
+  }
+
+  if (llvm::sys::fs::rename(tempFile, cacheFile)) {
+    llvm::sys::fs::remove(tempFile);
+    return false;
+  }
+
+  ++stats.remoteFetches;
+  uint64_t size = 0;
+  llvm::sys::fs::file_size(cacheFile, size);
+  appendToAccessLog('S', cacheFile, size);
+  return true;
+}
+
+// Spawns a detached ldc-prune-cache process; returns false if the tool cannot
+// be found or started.
+bool spawnPruneProcess() {
+  // Skip spawning a process if the pruning interval hasn't passed yet.
+  llvm::SmallString<128> timestampFile(opts::cacheDir);
+  llvm::sys::path::append(timestampFile, "ircache_prune_timestamp");
+  llvm::sys::fs::file_status status;
+  if (pruneInterval && !llvm::sys::fs::status(timestampFile, status) &&
+      status.getLastModificationTime() + std::chrono::seconds(pruneInterval) >
+          getTimeNow()) {
+    return true;
+  }
+
+  auto tool = llvm::sys::findProgramByName(
+      "ldc-prune-cache", {llvm::StringRef(exe_path::getBinDir())});
+  if (!tool) {
+    IF_LOG Logger::println("ldc-prune-cache not found, pruning in-process");
+    return false;
+  }
+
+  const std::string args[] = {
+      ("--interval=" + llvm::Twine(pruneInterval)).str(),
+      ("--expiry=" + llvm::Twine(pruneExpiration)).str(),
+      ("--max-bytes=" + llvm::Twine(pruneSizeLimitInBytes)).str(),
+      ("--max-percentage-of-avail=" + llvm::Twine(pruneSizeLimitPercentage))
+          .str()};
+  const llvm::StringRef argv[] = {*tool,   args[0], args[1],
+                                  args[2], args[3], opts::cacheDir};
+  // Redirect the standard streams to the null device, so that callers waiting
+  // for the compiler's output don't wait for the pruning too.
+  const llvm::StringRef nullDevice;
+#if LDC_LLVM_VER < 1600
+  const llvm::Optional<llvm::StringRef> redirects[] = {nullDevice, nullDevice,
+                                                       nullDevice};
+  auto envVars = llvm::None;
+#else
+  const std::optional<llvm::StringRef> redirects[] = {nullDevice, nullDevice,
+                                                      nullDevice};
+  auto envVars = std::nullopt;
+#endif
+
+  std::string errorMessage;
+  bool executionFailed = false;
+  llvm::sys::ExecuteNoWait(*tool, argv, envVars, redirects, 0, &errorMessage,
+                           &executionFailed);
+  if (executionFailed) {
+    IF_LOG Logger::println("Failed to start ldc-prune-cache: %s",
+                           errorMessage.c_str());
+    return false;
+  }
+  return true;
+}
+
 /// A raw_ostream that creates a hash of what is written to it.
 /// This class does not encounter output errors.
 /// There is no buffering and the hasher can be used at any time.
@@ -276,6 +880,13 @@ void outputIR2ObjRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
       // All  "-cache..." options can be ignored
       if (strncmp(arg + 1, "cache", 5) == 0)
         continue;
+      // The number of codegen threads doesn't influence the output; skip the
+      // value too if it is passed as separate argument ("-j 4").
+      if (arg[1] == 'j' && (!arg[2] || arg[2] == '=')) {
+        if (!arg[2] && ++it == end_it)
+          break;
+        continue;
+      }
       // Ignore "-lib"
       if (arg[1] == 'l' && arg[2] == 'i' && arg[3] == 'b' && !arg[4])
         continue;
@@ -335,12 +946,201 @@ void outputIR2ObjRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
 #endif
 }
 
+// Output to `hash_os` the cmdline flags which are skipped by
+// outputIR2ObjRelevantCmdlineArgs() because their effects are visible in the
+// IR, but which are relevant when hashing the source files instead.
+// The PGO profile is hashed by contents, as its effects are only visible in the
+// IR. Returns false if the profile cannot be read.
+bool outputFrontendRelevantCmdlineArgs(llvm::raw_ostream &hash_os) {
+  for (size_t i = 1; i < opts::allArguments.size(); ++i) {
+    const char *arg = opts::allArguments[i];
+    if (!arg)
+      continue;
+    if (strncmp(arg, "-d-version", 10) == 0 ||
+        strncmp(arg, "-d-debug", 8) == 0 || strcmp(arg, "-unittest") == 0 ||
+        strncmp(arg, "-dip", 4) == 0) {
+      hash_os << arg;
+    }
+  }
+
+  if (opts::isUsingPGOProfile() || opts::pgoMode == opts::PGO_SampleBasedUse) {
+    auto buffer =
+        llvm::MemoryBuffer::getFile(global.params.datafileInstrProf);
+    if (!buffer)
+      return false;
+    llvm::MD5 hasher;
+    hasher.update((*buffer)->getBuffer());
+    llvm::MD5::MD5Result result;
+    hasher.final(result);
+    hash_os << result.digest();
+  }
+  return true;
+}
+
 // Output to `hash_os` all environment flags that influence object code output
 // in ways that are not observable in the pre-LLVM passes IR used for hashing.
 void outputIR2ObjRelevantEnvironmentOpts(llvm::raw_ostream &hash_os) {
   // There are no relevant environment options at the moment.
 }
 
+using GlobalValueClasses = llvm::EquivalenceClasses<const llvm::GlobalValue *>;
+
+// Adds all global values which (transitively via constants) reference `v` to
+// `referencing`.
+void collectReferencingGlobals(
+    const llvm::Value *v,
+    llvm::SmallPtrSetImpl<const llvm::GlobalValue *> &referencing,
+    llvm::SmallPtrSetImpl<const llvm::Value *> &visited) {
+  for (const llvm::User *user : v->users()) {
+    if (!visited.insert(user).second)
+      continue;
+    if (auto instr = llvm::dyn_cast<llvm::Instruction>(user)) {
+      referencing.insert(instr->getFunction());
+    } else if (auto gv = llvm::dyn_cast<llvm::GlobalValue>(user)) {
+      referencing.insert(gv);
+    } else {
+      collectReferencingGlobals(user, referencing, visited);
+    }
+  }
+}
+
+// Groups the defined global values of `m` into classes which must end up in
+// the same fragment.
+void findFragmentClasses(const llvm::Module &m, GlobalValueClasses &classes) {
+  llvm::DenseMap<const llvm::Comdat *, const llvm::GlobalValue *> comdatLeaders;
+
+  auto record = [&](const llvm::GlobalValue &gv) {
+    if (gv.isDeclaration())
+      return;
+    classes.insert(&gv);
+    if (const llvm::Comdat *c = gv.getComdat()) {
+      auto it = comdatLeaders.try_emplace(c, &gv).first;
+      classes.unionSets(it->second, &gv);
+    }
+  };
+  for (const auto &gv : m.global_values())
+    record(gv);
+
+  // Local symbols can't be referenced across object files, and appending
+  // globals (llvm.used, llvm.global_ctors etc.) must only be defined once.
+  // Also keep aliases together with their aliasee.
+  for (const auto &gv : m.global_values()) {
+    if (gv.isDeclaration())
+      continue;
+    const llvm::Constant *indirectTarget = nullptr;
+    if (auto alias = llvm::dyn_cast<llvm::GlobalAlias>(&gv)) {
+      indirectTarget = alias->getAliasee();
+    } else if (auto ifunc = llvm::dyn_cast<llvm::GlobalIFunc>(&gv)) {
+      indirectTarget = ifunc->getResolver();
+    }
+    if (!gv.hasLocalLinkage() && !gv.hasAppendingLinkage() && !indirectTarget)
+      continue;
+
+    llvm::SmallPtrSet<const llvm::GlobalValue *, 8> referencing;
+    llvm::SmallPtrSet<const llvm::Value *, 16> visited;
+    collectReferencingGlobals(&gv, referencing, visited);
+    if (indirectTarget) {
+      if (auto target = llvm::dyn_cast<llvm::GlobalValue>(
+              indirectTarget->stripPointerCasts()))
+        referencing.insert(target);
+    }
+
+    for (const llvm::GlobalValue *other : referencing) {
+      if (!other->isDeclaration())
+        classes.unionSets(&gv, other);
+    }
+  }
+}
+
+// Returns a name for the class of `leader` which doesn't depend on the
+// order of the module's globals: the smallest name of a non-local member
+// (or of any member if all members are local).
+llvm::StringRef getStableClassName(const GlobalValueClasses &classes,
+                                   GlobalValueClasses::iterator leader) {
+  llvm::StringRef name;
+  bool nameIsLocal = true;
+  for (auto it = classes.member_begin(leader); it != classes.member_end();
+       ++it) {
+    const llvm::GlobalValue *gv = *it;
+    const bool isLocal = gv->hasLocalLinkage();
+    if ((nameIsLocal && !isLocal) ||
+        (nameIsLocal == isLocal && (name.empty() || gv->getName() < name))) {
+      name = gv->getName();
+      nameIsLocal = isLocal;
+    }
+  }
+  return name;
+}
+
+// Erases the declarations of unreferenced globals, so that a fragment's hash
+// isn't affected by new or removed globals in other fragments.
+void eraseUnusedDeclarations(llvm::Module &m) {
+  for (auto it = m.begin(); it != m.end();) {
+    llvm::Function &f = *it++;
+    f.removeDeadConstantUsers();
+    if (f.isDeclaration() && f.use_empty())
+      f.eraseFromParent();
+  }
+  for (auto it = m.global_begin(); it != m.global_end();) {
+    llvm::GlobalVariable &gv = *it++;
+    gv.removeDeadConstantUsers();
+    if (gv.isDeclaration() && gv.use_empty())
+      gv.eraseFromParent();
+  }
+}
+
+void addModuleClosure(Module *m, llvm::SmallVectorImpl<Module *> &closure,
+                      llvm::SmallPtrSetImpl<Module *> &visited) {
+  if (!visited.insert(m).second)
+    return;
+  closure.push_back(m);
+  for (Module *imported : m->aimports)
+    addModuleClosure(imported, closure, visited);
+}
+
+// Source hashes are memoized, as the same (druntime/Phobos) modules are
+// imported by most root modules.
+llvm::DenseMap<Module *, llvm::MD5::MD5Result> sourceHashes;
+
+const llvm::MD5::MD5Result &getSourceHash(Module *m) {
+  auto it = sourceHashes.find(m);
+  if (it != sourceHashes.end())
+    return it->second;
+
+  llvm::MD5 hasher;
+  hasher.update(llvm::ArrayRef<uint8_t>(m->src.ptr, m->src.length));
+  llvm::MD5::MD5Result result;
+  hasher.final(result);
+  return sourceHashes[m] = result;
+}
+
+// Outputs the absolute path of a source file, as __FILE_FULL_PATH__ and the
+// debuginfo depend on it.
+void outputAbsolutePath(const char *file, llvm::raw_ostream &hash_os) {
+  llvm::SmallString<128> path(file);
+  llvm::sys::fs::make_absolute(path);
+  hash_os << path;
+}
+
+// Returns false if a string-imported file can't be read.
+bool outputSourceHashes(Module *m, llvm::raw_ostream &hash_os) {
+  outputAbsolutePath(m->srcfile.toChars(), hash_os);
+  hash_os << getSourceHash(m).digest();
+
+  for (const char *file : m->contentImportedFiles) {
+    auto buffer = llvm::MemoryBuffer::getFile(file);
+    if (!buffer)
+      return false;
+    llvm::MD5 hasher;
+    hasher.update((*buffer)->getBuffer());
+    llvm::MD5::MD5Result result;
+    hasher.final(result);
+    outputAbsolutePath(file, hash_os);
+    hash_os << result.digest();
+  }
+  return true;
+}
+
 } // anonymous namespace
 
 namespace cache {
@@ -358,17 +1158,119 @@ void calculateModuleHash(llvm::Module *m, llvm::SmallString<32> &str) {
   outputIR2ObjRelevantCmdlineArgs(hash_os);
   outputIR2ObjRelevantEnvironmentOpts(hash_os);
 
-  llvm::WriteBitcodeToFile(*m, hash_os);
+  {
+    ::TimeTraceScope timeScope("Hash module",
+                               m->getModuleIdentifier().c_str());
+    switch (cacheHashKind) {
+    case HashKind::MD5:
+      llvm::WriteBitcodeToFile(*m, hash_os);
+      break;
+    case HashKind::XXHash: {
+      llvm::SmallVector<char, 0> buffer;
+      {
+        llvm::BitcodeWriter writer(buffer);
+        writer.writeModule(*m);
+        writer.writeStrtab();
+      }
+      // Only the (tiny) remainder is hashed by MD5. The size and the xxHash
+      // are hashed as fixed-width integers, so that the decimal digits of
+      // both can't be shifted between them.
+      char fixed[16];
+      llvm::support::endian::write64le(fixed, buffer.size());
+      llvm::support::endian::write64le(
+          fixed + 8,
+          llvm::xxHash64(llvm::StringRef(buffer.data(), buffer.size())));
+      hash_os << "xxhash" << llvm::StringRef(fixed, sizeof(fixed));
+    } break;
+    }
+  }
   hash_os.resultAsString(str);
   IF_LOG Logger::println("Module's LLVM bitcode hash is: %s", str.c_str());
 }
 
+bool isFrontendLookupEnabled() {
+  return !opts::cacheDir.empty() && frontendLookupEnabled;
+}
+
+bool frontendLookup(Module *m, llvm::ArrayRef<Module *> rootModules,
+                    llvm::StringRef objectFile, llvm::SmallString<32> &hash) {
+  ::TimeTraceScope timeScope("Check frontend object cache",
+                             m->srcfile.toChars());
+  llvm::SmallString<128> cacheDir(opts::cacheDir.c_str());
+  llvm::sys::fs::make_absolute(cacheDir);
+  opts::cacheDir = cacheDir.c_str();
+
+  IF_LOG Logger::println("Look up %s in the frontend cache in %s",
+                         m->srcfile.toChars(), opts::cacheDir.c_str());
+  LOG_SCOPE
+
+  raw_hash_ostream hash_os;
+  hash_os << "frontend";
+  hash_os << ldc::ldc_version << ldc::dmd_version << ldc::llvm_version
+          << ldc::built_with_Dcompiler_version;
+  outputIR2ObjRelevantCmdlineArgs(hash_os);
+  if (!outputFrontendRelevantCmdlineArgs(hash_os)) {
+    IF_LOG Logger::println("Cannot read the PGO profile %s",
+                           global.params.datafileInstrProf);
+    hash.clear();
+    return false;
+  }
+  outputIR2ObjRelevantEnvironmentOpts(hash_os);
+
+  // The working directory ends up in the debuginfo (and relative paths in
+  // __FILE__ etc. are relative to it).
+  llvm::SmallString<128> cwd;
+  if (llvm::sys::fs::current_path(cwd)) {
+    IF_LOG Logger::println("Cannot get the current working directory");
+    hash.clear();
+    return false;
+  }
+  hash_os << cwd;
+
+  // Which root module a template instance is emitted into depends on all
+  // root modules, so include their sources too.
+  llvm::SmallVector<Module *, 64> closure;
+  llvm::SmallPtrSet<Module *, 32> visited;
+  addModuleClosure(m, closure, visited);
+  for (Module *root : rootModules) {
+    if (rootModules.size() > 1)
+      addModuleClosure(root, closure, visited);
+    else
+      outputAbsolutePath(root->srcfile.toChars(), hash_os);
+  }
+
+  // Order the modules independently of the import graph traversal.
+  std::sort(closure.begin() + 1, closure.end(), [](Module *a, Module *b) {
+    return strcmp(a->srcfile.toChars(), b->srcfile.toChars()) < 0;
+  });
+  for (Module *imported : closure) {
+    if (!outputSourceHashes(imported, hash_os)) {
+      IF_LOG Logger::println("Cannot read string imports of %s",
+                             imported->srcfile.toChars());
+      hash.clear();
+      return false;
+    }
+  }
+
+  hash_os.resultAsString(hash);
+  IF_LOG Logger::println("Module's frontend hash is: %s", hash.c_str());
+
+  if (cacheLookup(hash).empty())
+    return false;
+
+  IF_LOG Logger::println("Frontend cache object found!");
+  recoverObjectFile(hash, objectFile);
+  return true;
+}
+
 std::string cacheLookup(llvm::StringRef cacheObjectHash) {
   if (opts::cacheDir.empty())
     return "";
 
-  if (!llvm::sys::fs::exists(opts::cacheDir)) {
+  Backend *remote = getRemoteBackend();
+  if (!remote && !llvm::sys::fs::exists(opts::cacheDir)) {
     IF_LOG Logger::println("Cache directory does not exist, no object found.");
+    ++stats.misses;
     return "";
   }
 
@@ -379,24 +1281,33 @@ std::string cacheLookup(llvm::StringRef cacheObjectHash) {
     return filePath.str().str();
   }
 
+  if (remote && fetchFromRemote(*remote, filePath)) {
+    IF_LOG Logger::println("Cache object found! %s (fetched from %s)",
+                           filePath.c_str(), remote->describe().c_str());
+    return filePath.str().str();
+  }
+
   IF_LOG Logger::println("Cache object not found.");
+  ++stats.misses;
   return "";
 }
 
 void cacheObjectFile(llvm::StringRef objectFile,
-                     llvm::StringRef cacheObjectHash) {
+                     llvm::StringRef cacheObjectHash,
+                     std::chrono::microseconds codegenTime) {
   if (opts::cacheDir.empty())
     return;
 
-  if (!llvm::sys::fs::exists(opts::cacheDir)) {
-    if (auto errorcode = llvm::sys::fs::create_directories(opts::cacheDir)) {
-      error(Loc(), "Unable to create cache directory: %s (errno %d: %s)",
-            opts::cacheDir.c_str(), errorcode.value(),
-            errorcode.message().c_str());
-      fatal();
-    }
+  if (!isCompressionAvailable(cacheCompression)) {
+    warning(Loc(),
+            "`-cache-compress=%s` is not supported by this LDC build, "
+            "storing object files uncompressed",
+            cacheCompression == CompressionKind::Zstd ? "zstd" : "zlib");
+    cacheCompression = CompressionKind::None;
   }
 
+  createCacheDirectory();
+
   // To prevent bad cache files, add files to the cache atomically: first copy
   // to a temporary file and then rename that temp file to the cache entry
   // filename (rename is atomic).
@@ -414,14 +1325,23 @@ void cacheObjectFile(llvm::StringRef objectFile,
     fatal();
   }
 
-  IF_LOG Logger::println("Copy object file to temp file: %s to %s",
-                         objectFile.str().c_str(), tempFile.c_str());
-  if (auto errorcode = llvm::sys::fs::copy_file(objectFile, tempFile.c_str())) {
-    error(Loc(),
-          "Failed to copy object file to cache: %s to %s (errno %d: %s)",
-          objectFile.str().c_str(), tempFile.c_str(), errorcode.value(),
-          errorcode.message().c_str());
-    fatal();
+  uint64_t objectSize = 0;
+  llvm::sys::fs::file_size(objectFile, objectSize);
+  uint64_t sizeOnDisk = writeCompressedFile(objectFile, tempFile, codegenTime);
+  if (!sizeOnDisk) {
+    IF_LOG Logger::println("Copy object file to temp file: %s to %s",
+                           objectFile.str().c_str(), tempFile.c_str());
+    if (auto errorcode =
+            llvm::sys::fs::copy_file(objectFile, tempFile.c_str())) {
+      error(Loc(),
+            "Failed to copy object file to cache: %s to %s (errno %d: %s)",
+            objectFile.str().c_str(), tempFile.c_str(), errorcode.value(),
+            errorcode.message().c_str());
+      fatal();
+    }
+    sizeOnDisk = objectSize;
+    // Written before the cache file becomes visible, so that hits find it.
+    writeCodegenTimeFile(cacheFile, codegenTime);
   }
   IF_LOG Logger::println("Rename temp file to cache file: %s to %s",
                          tempFile.c_str(), cacheFile.c_str());
@@ -433,6 +1353,21 @@ void cacheObjectFile(llvm::StringRef objectFile,
           errorcode.message().c_str());
     fatal();
   }
+
+  ++stats.stores;
+  stats.storedBytes += objectSize;
+  stats.storedBytesOnDisk += sizeOnDisk;
+  appendToAccessLog('S', cacheFile, sizeOnDisk);
+
+  if (Backend *remote = getRemoteBackend()) {
+    IF_LOG Logger::println("Upload cache file to %s",
+                           remote->describe().c_str());
+    std::string errorMessage;
+    if (!remote->store(llvm::sys::path::filename(cacheFile), cacheFile,
+                       errorMessage)) {
+      disableRemoteBackend(errorMessage);
+    }
+  }
 }
 
 void recoverObjectFile(llvm::StringRef cacheObjectHash,
@@ -443,57 +1378,24 @@ void recoverObjectFile(llvm::StringRef cacheObjectHash,
   // Remove the potentially pre-existing output file.
   llvm::sys::fs::remove(objectFile);
 
-  switch (cacheRecoveryMode) {
-  case RetrievalMode::Copy: {
-    IF_LOG Logger::println("Copy cached object file: %s -> %s",
-                           cacheFile.c_str(), objectFile.str().c_str());
-    if (auto errorcode =
-            llvm::sys::fs::copy_file(cacheFile.c_str(), objectFile)) {
-      error(Loc(), "Failed to copy the cached file: %s -> %s (errno %d: %s)",
-            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
-            errorcode.message().c_str());
-      fatal();
-    }
-  } break;
-  case RetrievalMode::HardLink: {
-    IF_LOG Logger::println("HardLink output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (auto errorcode =
-            createHardLink(cacheFile.c_str(), objectFile.str().c_str())) {
-      error(Loc(),
-            "Failed to create a hard link to the cached file: %s -> %s (errno "
-            "%d: %s)",
-            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
-            errorcode.message().c_str());
-      fatal();
-    }
-  } break;
-  case RetrievalMode::AnyLink: {
-    IF_LOG Logger::println("Link output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (auto errorcode =
-            llvm::sys::fs::create_link(cacheFile.c_str(), objectFile)) {
-      error(
-          Loc(),
-          "Failed to create a link to the cached file: %s -> %s (errno %d: %s)",
-          cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
-          errorcode.message().c_str());
-      fatal();
-    }
-  } break;
-  case RetrievalMode::SymLink: {
-    IF_LOG Logger::println("SymLink output to cached object file: %s -> %s",
-                           objectFile.str().c_str(), cacheFile.c_str());
-    if (auto errorcode =
-            createSymLink(cacheFile.c_str(), objectFile.str().c_str())) {
-      error(Loc(),
-            "Failed to create a symbolic link to the cached file: %s -> %s "
-            "(errno %d: %s)",
-            cacheFile.c_str(), objectFile.str().c_str(), errorcode.value(),
-            errorcode.message().c_str());
-      fatal();
-    }
-  } break;
+  ++stats.hits;
+  CompressedFileHeader header;
+  if (readCompressedFileHeader(cacheFile, header)) {
+    decompressCacheFile(cacheFile, objectFile, header);
+    stats.recoveredBytes += header.uncompressedSize;
+    stats.savedCodegenTime +=
+        std::chrono::microseconds(header.codegenMicroseconds);
+    if (!header.codegenMicroseconds)
+      ++stats.hitsWithoutCodegenTime;
+  } else {
+    uint64_t objectSize = 0;
+    llvm::sys::fs::file_size(cacheFile, objectSize);
+    stats.recoveredBytes += objectSize;
+    const uint64_t codegenMicroseconds = readCodegenTimeFile(cacheFile);
+    stats.savedCodegenTime += std::chrono::microseconds(codegenMicroseconds);
+    if (!codegenMicroseconds)
+      ++stats.hitsWithoutCodegenTime;
+    recoverUncompressedFile(cacheFile, objectFile);
   }
 
   // We reset the modification time to "now" such that the pruning algorithm
@@ -519,10 +1421,86 @@ void recoverObjectFile(llvm::StringRef cacheObjectHash,
 
     close(FD);
   }
+
+  appendToAccessLog('A', cacheFile, 0);
+}
+
+unsigned numFragments() { return fragmentCount; }
+
+void splitIntoFragments(
+    const llvm::Module &m,
+    llvm::function_ref<void(std::unique_ptr<llvm::Module>)> callback) {
+  const unsigned n = numFragments();
+  assert(n > 0);
+
+  GlobalValueClasses classes;
+  findFragmentClasses(m, classes);
+
+  llvm::DenseMap<const llvm::GlobalValue *, unsigned> fragmentOf;
+  llvm::SmallVector<bool, 16> isFragmentUsed(n, false);
+  for (auto it = classes.begin(), end = classes.end(); it != end; ++it) {
+    if (!it->isLeader())
+      continue;
+    const unsigned fragment =
+        llvm::xxHash64(getStableClassName(classes, it)) % n;
+    isFragmentUsed[fragment] = true;
+    for (auto member = classes.member_begin(it);
+         member != classes.member_end(); ++member) {
+      fragmentOf[*member] = fragment;
+    }
+  }
+
+  bool isFirstFragment = true;
+  for (unsigned fragment = 0; fragment < n; ++fragment) {
+    if (!isFragmentUsed[fragment])
+      continue;
+
+    llvm::ValueToValueMapTy vmap;
+    auto fragmentModule =
+        llvm::CloneModule(m, vmap, [&](const llvm::GlobalValue *gv) {
+          auto it = fragmentOf.find(gv);
+          return it != fragmentOf.end() && it->second == fragment;
+        });
+
+    // Module-level inline asm must only be emitted once.
+    if (!isFirstFragment)
+      fragmentModule->setModuleInlineAsm("");
+    isFirstFragment = false;
+
+    eraseUnusedDeclarations(*fragmentModule);
+
+    IF_LOG Logger::println("Module fragment %u: %u functions", fragment,
+                           static_cast<unsigned>(fragmentModule->size()));
+    callback(std::move(fragmentModule));
+  }
+}
+
+void printStatistics() {
+  if (opts::cacheDir.empty() || !printStats)
+    return;
+
+  message("cache     %u hits (%s recovered, %.2f s of recorded codegen time "
+          "saved), %u misses, %u stores (%s, %s on disk)",
+          stats.hits, formatBytes(stats.recoveredBytes).c_str(),
+          stats.savedCodegenTime.count() / 1e6, stats.misses, stats.stores,
+          formatBytes(stats.storedBytes).c_str(),
+          formatBytes(stats.storedBytesOnDisk).c_str());
+  if (stats.remoteFetches) {
+    message("cache     %u files fetched from remote cache",
+            stats.remoteFetches);
+  }
+  if (stats.hitsWithoutCodegenTime) {
+    // E.g. entries stored by older compiler versions or fetched from a remote
+    // cache, which doesn't transfer the codegen time of uncompressed files.
+    message("cache     codegen time not recorded for %u hits",
+            stats.hitsWithoutCodegenTime);
+  }
 }
 
 void pruneCache() {
   if (!opts::cacheDir.empty() && isPruningEnabled()) {
+    if (pruneInBackground && spawnPruneProcess())
+      return;
     ::pruneCache(opts::cacheDir.data(), opts::cacheDir.size(), pruneInterval,
                  pruneExpiration, pruneSizeLimitInBytes,
                  pruneSizeLimitPercentage);
@@ -9,8 +9,14 @@
 
 #pragma once
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include <chrono>
+#include <memory>
 #include <string>
 
+class Module;
+
 namespace llvm {
 class Module;
 class StringRef;
@@ -21,11 +27,47 @@ namespace cache {
 
 void calculateModuleHash(llvm::Module *m, llvm::SmallString<32> &str);
 std::string cacheLookup(llvm::StringRef cacheObjectHash);
-void cacheObjectFile(llvm::StringRef objectFile,
-                     llvm::StringRef cacheObjectHash);
+/// Adds the object file to the cache. `codegenTime` is the time it took to
+/// produce the object file, recorded for `-cache-stats` if known.
+void cacheObjectFile(
+    llvm::StringRef objectFile, llvm::StringRef cacheObjectHash,
+    std::chrono::microseconds codegenTime = std::chrono::microseconds::zero());
 void recoverObjectFile(llvm::StringRef cacheObjectHash,
                        llvm::StringRef objectFile);
 
+/// Returns whether object files may be looked up before IR generation, via
+/// a hash of the source files (`-cache-frontend`).
+bool isFrontendLookupEnabled();
+
+/// Looks up the object file of root module `m` by a hash of its source, the
+/// sources of all transitively imported modules, the string-imported files
+/// (with their absolute paths), the working directory and the relevant cmdline
+/// flags, i.e., without having to generate IR. On a hit, the object file is
+/// recovered as `objectFile` and true is returned. Otherwise `hash` is set
+/// (unless hashing failed), for adding the object file to the cache via
+/// cacheObjectFile() once it has been written.
+bool frontendLookup(Module *m, llvm::ArrayRef<Module *> rootModules,
+                    llvm::StringRef objectFile, llvm::SmallString<32> &hash);
+
+/// Returns the number of fragments modules are split into for caching object
+/// code with sub-module granularity (`-cache-fragments`); 0 if disabled.
+unsigned numFragments();
+
+/// Splits the module into up to numFragments() self-contained fragments that
+/// can be codegen'd and cached separately, and invokes `callback` for each.
+/// Each fragment contains the definitions of one or more groups of global
+/// values that must stay together (comdats, local symbols and their users)
+/// plus declarations of the other referenced globals. The assignment of a
+/// group to a fragment only depends on its name, so that unrelated changes to
+/// the module don't affect the hash of a fragment.
+void splitIntoFragments(
+    const llvm::Module &m,
+    llvm::function_ref<void(std::unique_ptr<llvm::Module>)> callback);
+
+/// Prints the cache statistics of this invocation if requested
+/// (`-cache-stats`).
+void printStatistics();
+
 /// Prune the cache to avoid filling up disk space.
 void pruneCache();
 }
@@ -0,0 +1,51 @@
+//===-- driver/cache_backend.h ----------------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Interface for storages of object cache files besides the local cache
+// directory, e.g., a cache server shared by multiple machines.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "llvm/ADT/StringRef.h"
+#include <memory>
+#include <string>
+
+namespace cache {
+
+/// A storage of cache files, keyed by the cache file names. The local cache
+/// directory is used as write-through cache in front of it.
+/// Failures are reported via the return values and the error message, and
+/// are never fatal: the cache is an optimization only.
+class Backend {
+public:
+  virtual ~Backend() = default;
+
+  /// Returns a description of the backend for messages.
+  virtual std::string describe() const = 0;
+
+  /// Copies the cache file `name` to `path`. Returns false if the backend
+  /// doesn't contain the file or on errors (then `errorMessage` is set).
+  virtual bool fetch(llvm::StringRef name, llvm::StringRef path,
+                     std::string &errorMessage) = 0;
+
+  /// Stores the file at `path` as cache file `name`. Returns false on errors.
+  virtual bool store(llvm::StringRef name, llvm::StringRef path,
+                     std::string &errorMessage) = 0;
+};
+
+/// Creates the backend for a `-cache-remote` URL, which is either
+/// `http://<host>[:<port>][/<path>]` or `unix:<socket path>`. Both speak a
+/// subset of HTTP/1.1 (GET and PUT of `<path>/<name>`), like the HTTP storage
+/// backends of ccache or bazel-remote. Returns null and sets `errorMessage`
+/// for invalid or unsupported URLs.
+std::unique_ptr<Backend> createRemoteBackend(llvm::StringRef url,
+                                             std::string &errorMessage);
+} // namespace cache
@@ -0,0 +1,393 @@
+//===-- driver/cache_remote.cpp -------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Remote object cache backend, speaking a minimal subset of HTTP/1.1 over TCP
+// or Unix domain sockets: `GET <path>/<name>` to fetch a cache file (200 or
+// 404) and `PUT <path>/<name>` to store one. Each request uses a new
+// connection (`Connection: close`). Response bodies may be delimited by
+// `Content-Length`, `Transfer-Encoding: chunked` or the end of the
+// connection; other transfer encodings are rejected. See
+// tools/ldc-cache-server.d for a reference server.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/cache_backend.h"
+
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#if LDC_POSIX
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace cache {
+
+#if LDC_POSIX
+
+namespace {
+
+// Timeout for connecting, sending and receiving.
+constexpr int timeoutSeconds = 10;
+
+class HttpBackend : public Backend {
+  std::string url;
+  // Either a Unix domain socket path or host and port.
+  std::string socketPath;
+  std::string host;
+  std::string port;
+  std::string pathPrefix;
+
+  int connectSocket(std::string &errorMessage) const;
+
+  // Sends the request and receives the complete response. Returns the HTTP
+  // status code, or 0 on errors.
+  unsigned request(llvm::StringRef method, llvm::StringRef name,
+                   llvm::StringRef body, std::string &responseBody,
+                   std::string &errorMessage) const;
+
+public:
+  HttpBackend(std::string url, std::string socketPath, std::string host,
+              std::string port, std::string pathPrefix)
+      : url(std::move(url)), socketPath(std::move(socketPath)),
+        host(std::move(host)), port(std::move(port)),
+        pathPrefix(std::move(pathPrefix)) {}
+
+  std::string describe() const override { return url; }
+
+  bool fetch(llvm::StringRef name, llvm::StringRef path,
+             std::string &errorMessage) override;
+  bool store(llvm::StringRef name, llvm::StringRef path,
+             std::string &errorMessage) override;
+};
+
+std::string systemError(const char *what) {
+  return (llvm::Twine(what) + ": " + strerror(errno)).str();
+}
+
+void setTimeouts(int fd) {
+  timeval tv;
+  tv.tv_sec = timeoutSeconds;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+int HttpBackend::connectSocket(std::string &errorMessage) const {
+  if (!socketPath.empty()) {
+    sockaddr_un addr;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+      errorMessage = "socket path too long";
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      errorMessage = systemError("socket");
+      return -1;
+    }
+    setTimeouts(fd);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+      errorMessage = systemError("connect");
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses = nullptr;
+  if (int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses)) {
+    errorMessage = (llvm::Twine("cannot resolve ") + host + ": " +
+                    gai_strerror(err))
+                       .str();
+    return -1;
+  }
+
+  int fd = -1;
+  for (addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    setTimeouts(fd);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    errorMessage = systemError("connect");
+  freeaddrinfo(addresses);
+  return fd;
+}
+
+bool sendAll(int fd, llvm::StringRef data, std::string &errorMessage) {
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  while (!data.empty()) {
+    const ssize_t n = send(fd, data.data(), data.size(), flags);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      errorMessage = systemError("send");
+      return false;
+    }
+    data = data.drop_front(n);
+  }
+  return true;
+}
+
+// Decodes a body with `Transfer-Encoding: chunked`: chunks of
+// `<hex size>[;<extensions>]\r\n<data>\r\n`, terminated by a chunk of size 0
+// and optional trailer headers, which are ignored.
+bool decodeChunked(llvm::StringRef content, std::string &result) {
+  result.clear();
+  while (true) {
+    const size_t lineEnd = content.find("\r\n");
+    if (lineEnd == llvm::StringRef::npos)
+      return false;
+    llvm::StringRef sizeField = content.take_front(lineEnd).split(';').first;
+    uint64_t size = 0;
+    if (sizeField.trim().getAsInteger(16, size))
+      return false;
+    content = content.drop_front(lineEnd + 2);
+    if (size == 0)
+      return true;
+    if (size > content.size() || !content.drop_front(size).startswith("\r\n"))
+      return false;
+    result.append(content.data(), size);
+    content = content.drop_front(size + 2);
+  }
+}
+
+unsigned HttpBackend::request(llvm::StringRef method, llvm::StringRef name,
+                              llvm::StringRef body, std::string &responseBody,
+                              std::string &errorMessage) const {
+  const int fd = connectSocket(errorMessage);
+  if (fd < 0)
+    return 0;
+
+  std::string header;
+  llvm::raw_string_ostream os(header);
+  os << method << ' ' << pathPrefix << '/' << name << " HTTP/1.1\r\n"
+     << "Host: " << (host.empty() ? "localhost" : host) << "\r\n"
+     << "Connection: close\r\n";
+  if (method == "PUT") {
+    os << "Content-Type: application/octet-stream\r\n"
+       << "Content-Length: " << body.size() << "\r\n";
+  }
+  os << "\r\n";
+  os.flush();
+
+  std::string response;
+  bool ok = sendAll(fd, header, errorMessage) &&
+            sendAll(fd, body, errorMessage);
+  if (ok) {
+    char buffer[64 * 1024];
+    while (true) {
+      const ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        errorMessage = systemError("recv");
+        ok = false;
+        break;
+      }
+      if (n == 0)
+        break;
+      response.append(buffer, n);
+    }
+  }
+  close(fd);
+  if (!ok)
+    return 0;
+
+  // Parse `HTTP/1.x <status> <reason>`, the headers and the body.
+  llvm::StringRef rest = response;
+  const size_t headerEnd = rest.find("\r\n\r\n");
+  unsigned status = 0;
+  if (headerEnd == llvm::StringRef::npos || !rest.startswith("HTTP/1.") ||
+      rest.substr(9, 3).getAsInteger(10, status)) {
+    errorMessage = "malformed HTTP response";
+    return 0;
+  }
+
+  llvm::StringRef headers = rest.take_front(headerEnd);
+  llvm::StringRef content = rest.drop_front(headerEnd + 4);
+  llvm::StringRef contentLength, transferEncoding;
+  while (!headers.empty()) {
+    llvm::StringRef line;
+    std::tie(line, headers) = headers.split("\r\n");
+    llvm::StringRef key, value;
+    std::tie(key, value) = line.split(':');
+    const std::string lowerKey = key.trim().lower();
+    if (lowerKey == "content-length")
+      contentLength = value.trim();
+    else if (lowerKey == "transfer-encoding")
+      transferEncoding = value.trim();
+  }
+
+  // A transfer encoding overrides Content-Length.
+  if (!transferEncoding.empty()) {
+    if (transferEncoding.lower() != "chunked") {
+      errorMessage =
+          ("unsupported HTTP transfer encoding `" + transferEncoding + "`")
+              .str();
+      return 0;
+    }
+    if (!decodeChunked(content, responseBody)) {
+      errorMessage = "malformed or truncated chunked HTTP response";
+      return 0;
+    }
+    return status;
+  }
+
+  if (!contentLength.empty()) {
+    size_t length = 0;
+    if (contentLength.getAsInteger(10, length) || length > content.size()) {
+      errorMessage = "truncated HTTP response";
+      return 0;
+    }
+    content = content.take_front(length);
+  }
+
+  responseBody = content.str();
+  return status;
+}
+
+bool HttpBackend::fetch(llvm::StringRef name, llvm::StringRef path,
+                        std::string &errorMessage) {
+  std::string content;
+  const unsigned status = request("GET", name, "", content, errorMessage);
+  if (status == 404 || status == 0)
+    return false;
+  if (status != 200) {
+    errorMessage = ("HTTP status " + llvm::Twine(status)).str();
+    return false;
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::OF_None);
+  if (!ec) {
+    os << content;
+    os.close();
+    ec = os.error();
+  }
+  if (ec) {
+    os.clear_error();
+    errorMessage = ("cannot write " + path + ": " + ec.message()).str();
+    return false;
+  }
+  return true;
+}
+
+bool HttpBackend::store(llvm::StringRef name, llvm::StringRef path,
+                        std::string &errorMessage) {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errorMessage =
+        ("cannot read " + path + ": " + buffer.getError().message()).str();
+    return false;
+  }
+
+  std::string response;
+  const unsigned status =
+      request("PUT", name, (*buffer)->getBuffer(), response, errorMessage);
+  if (status == 0)
+    return false;
+  if (status < 200 || status >= 300) {
+    errorMessage = ("HTTP status " + llvm::Twine(status)).str();
+    return false;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+std::unique_ptr<Backend> createRemoteBackend(llvm::StringRef url,
+                                             std::string &errorMessage) {
+  llvm::StringRef rest = url;
+  if (rest.consume_front("unix:")) {
+    if (rest.empty()) {
+      errorMessage = "missing socket path";
+      return nullptr;
+    }
+    return std::make_unique<HttpBackend>(url.str(), rest.str(), "", "", "");
+  }
+
+  if (!rest.consume_front("http://")) {
+    errorMessage = "expected `http://<host>[:<port>][/<path>]` or "
+                   "`unix:<socket path>`";
+    return nullptr;
+  }
+
+  llvm::StringRef authority, pathPrefix;
+  const size_t slash = rest.find('/');
+  authority = rest.take_front(slash);
+  if (slash != llvm::StringRef::npos)
+    pathPrefix = rest.drop_front(slash).rtrim('/');
+
+  llvm::StringRef host = authority, port = "80";
+  if (host.startswith("[")) { // IPv6 address
+    const size_t bracket = host.find(']');
+    if (bracket == llvm::StringRef::npos) {
+      errorMessage = "invalid IPv6 address";
+      return nullptr;
+    }
+    llvm::StringRef afterHost = host.drop_front(bracket + 1);
+    host = host.slice(1, bracket);
+    if (afterHost.consume_front(":"))
+      port = afterHost;
+  } else if (host.contains(':')) {
+    std::tie(host, port) = host.split(':');
+  }
+
+  unsigned portNumber = 0;
+  if (host.empty() || port.getAsInteger(10, portNumber) || !portNumber ||
+      portNumber > 65535) {
+    errorMessage = "invalid host or port";
+    return nullptr;
+  }
+
+  return std::make_unique<HttpBackend>(url.str(), "", host.str(), port.str(),
+                                       pathPrefix.str());
+}
+
+#else // !LDC_POSIX
+
+std::unique_ptr<Backend> createRemoteBackend(llvm::StringRef url,
+                                             std::string &errorMessage) {
+  errorMessage = "remote caches are only supported on POSIX hosts";
+  return nullptr;
+}
+
+#endif
+
+} // namespace cache
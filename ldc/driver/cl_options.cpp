@@ -347,6 +347,12 @@ cl::opt<std::string>
                       "store cache files"),
              cl::value_desc("cache dir"), cl::ZeroOrMore);
 
+cl::opt<unsigned> codegenThreads(
+    "j",
+    cl::desc("Optimize and emit object files of up to <N> modules in "
+             "parallel (0: one thread per hardware core, default: 1)"),
+    cl::value_desc("N"), cl::init(1), cl::ZeroOrMore);
+
 static StringsAdapter strImpPathStore("J", global.params.fileImppath);
 static cl::list<std::string, StringsAdapter> stringImportPaths(
     "J", cl::desc("Look for string imports also in <directory>"),
@@ -575,6 +581,13 @@ cl::opt<bool>
                   cl::desc("Disable generation of exception stack unwinding "
                            "code, assuming no Exceptions will be thrown"));
 
+cl::opt<bool> fDeriveMemoryAttrs(
+    "fderive-memory-attrs", cl::ZeroOrMore,
+    cl::desc("Derive LLVM memory attributes from D semantics: strongly pure "
+             "nothrow functions only read memory, `scope` pointer parameters "
+             "(with -preview=dip1000) aren't captured, and pointer parameters "
+             "to const/immutable data are read-only"));
+
 cl::opt<bool> fNoModuleInfo("fno-moduleinfo", cl::ZeroOrMore,
                             cl::desc("Disable generation of ModuleInfos"));
 
@@ -585,6 +598,11 @@ cl::opt<bool>
     fSplitStack("fsplit-stack", cl::ZeroOrMore,
                 cl::desc("Use segmented stack (see Clang documentation)"));
 
+cl::opt<bool> interfaceCastCache(
+    "interface-cast-cache", cl::ZeroOrMore,
+    cl::desc("Cache the result of dynamic casts from interfaces per call site "
+             "and thread when optimizing"));
+
 cl::opt<bool, true>
     allinst("allinst", cl::ZeroOrMore, cl::location(global.params.allInst),
             cl::desc("Generate code for all template instantiations"));
@@ -680,6 +698,11 @@ cl::opt<LTOKind> ltoMode(
         clEnumValN(LTO_Thin, "thin",
                    "Parallel importing and codegen (faster than 'full')")));
 
+cl::opt<bool> wholeProgramVTables(
+    "fwhole-program-vtables", cl::ZeroOrMore,
+    cl::desc("Enable whole-program devirtualization of virtual calls with "
+             "LTO, for classes with hidden visibility (requires -flto)"));
+
 cl::opt<std::string>
     saveOptimizationRecord("fsave-optimization-record",
                            cl::value_desc("filename"),
@@ -73,6 +73,7 @@ extern cl::list<std::string> reverts;
 extern cl::opt<std::string> moduleDeps;
 extern cl::opt<std::string> makeDeps;
 extern cl::opt<std::string> cacheDir;
+extern cl::opt<unsigned> codegenThreads;
 extern cl::list<std::string> linkerSwitches;
 extern cl::list<std::string> ccSwitches;
 extern cl::list<std::string> cppSwitches;
@@ -101,9 +102,11 @@ void setDefaultMathOptions(llvm::TargetOptions &targetOptions);
 extern cl::opt<bool> fNoDiscardValueNames;
 extern cl::opt<bool> fNullPointerIsValid;
 extern cl::opt<bool> fNoExceptions;
+extern cl::opt<bool> fDeriveMemoryAttrs;
 extern cl::opt<bool> fNoModuleInfo;
 extern cl::opt<bool> fNoRTTI;
 extern cl::opt<bool> fSplitStack;
+extern cl::opt<bool> interfaceCastCache;
 
 // Arguments to -d-debug
 extern std::vector<std::string> debugArgs;
@@ -135,6 +138,7 @@ enum LTOKind {
 extern cl::opt<LTOKind> ltoMode;
 inline bool isUsingLTO() { return ltoMode != LTO_None; }
 inline bool isUsingThinLTO() { return ltoMode == LTO_Thin; }
+extern cl::opt<bool> wholeProgramVTables;
 
 extern cl::opt<std::string> saveOptimizationRecord;
 
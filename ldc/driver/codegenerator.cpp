@@ -206,9 +206,26 @@ CodeGenerator::CodeGenerator(llvm::LLVMContext &context,
                                 opts::MemorySanitizer)) {
     context_.setDiscardValueNames(true);
   }
+
+  if (opts::codegenThreads != 1) {
+    if (singleObj_) {
+      IF_LOG Logger::println("Ignoring -j for a single object file, see "
+                             "-codegen-partitions");
+    } else if (canWriteModulesInParallel()) {
+      parallelWriter_ =
+          std::make_unique<ParallelModuleWriter>(opts::codegenThreads);
+    } else {
+      IF_LOG Logger::println(
+          "Ignoring -j, parallel codegen is only supported for object files");
+    }
+  }
 }
 
-CodeGenerator::~CodeGenerator() {
+// If compilation is terminated before finish(), the ParallelModuleWriter
+// destructor just waits for the workers, without reporting anything.
+CodeGenerator::~CodeGenerator() = default;
+
+void CodeGenerator::finish() {
   if (singleObj_ && moduleCount_ > 0) {
     // For singleObj builds, the first object file name is the one for the first
     // source file (e.g., `b.o` for `ldc2 a.o b.d c.d`).
@@ -220,6 +237,12 @@ CodeGenerator::~CodeGenerator() {
 
     writeAndFreeLLModule(filename);
   }
+
+  if (parallelWriter_) {
+    // May terminate compilation if writing a module failed.
+    parallelWriter_->waitAll();
+    parallelWriter_.reset();
+  }
 }
 
 void CodeGenerator::prepareLLModule(Module *m) {
@@ -279,6 +302,15 @@ void CodeGenerator::writeAndFreeLLModule(const char *filename) {
   llvm::Metadata *IdentNode[] = {llvm::MDString::get(ir_->context(), Version)};
   IdentMetadata->addOperand(llvm::MDNode::get(ir_->context(), IdentNode));
 
+  // The logger isn't thread-safe, so write modules with enabled logging (e.g.,
+  // due to `pragma(LDC_verbose)`) on the main thread.
+  if (parallelWriter_ && !Logger::enabled()) {
+    parallelWriter_->submit(*ir_, filename);
+    delete ir_;
+    ir_ = nullptr;
+    return;
+  }
+
 #if LDC_LLVM_VER < 1300
   context_.setInlineAsmDiagnosticHandler(inlineAsmDiagnosticHandler, ir_);
 #else
@@ -289,7 +321,7 @@ void CodeGenerator::writeAndFreeLLModule(const char *filename) {
   std::unique_ptr<llvm::ToolOutputFile> diagnosticsOutputFile =
       createAndSetDiagnosticsOutputFile(*ir_, context_, filename);
 
-  writeModule(&ir_->module, filename);
+  writeModule(&ir_->module, filename, ir_);
 
   if (diagnosticsOutputFile)
     diagnosticsOutputFile->keep();
@@ -20,6 +20,9 @@
 #pragma once
 
 #include "gen/irstate.h"
+#include <memory>
+
+class ParallelModuleWriter;
 
 #if LDC_MLIR_ENABLED
 namespace mlir {
@@ -41,6 +44,10 @@ public:
   ~CodeGenerator();
   void emit(Module *m);
 
+  /// Writes the single object file (for singleObj builds) and waits for all
+  /// modules written in parallel. Terminates compilation upon errors.
+  void finish();
+
 #if LDC_MLIR_ENABLED
   void emitMLIR(Module *m);
 #endif
@@ -60,5 +67,7 @@ private:
   int moduleCount_;
   bool const singleObj_;
   IRState *ir_;
+  // Set if object files are written by worker threads (`-j`).
+  std::unique_ptr<ParallelModuleWriter> parallelWriter_;
 };
 }
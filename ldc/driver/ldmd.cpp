@@ -25,6 +25,7 @@
 
 #include "driver/args.h"
 #include "driver/exe_path.h"
+#include "driver/server_protocol.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Path.h"
@@ -42,6 +43,7 @@
 #include <windows.h>
 #else
 #include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 namespace ls = llvm::sys;
@@ -114,6 +116,44 @@ int execute(std::vector<const char *> fullArgs) {
   return rc;
 }
 
+/**
+ * Forwards the compile to the compile server (`ldc2 -server`) listening on
+ * the socket specified by the LDC_SERVER_SOCKET environment variable, if set.
+ * Returns false if the compile has to be run locally, e.g., if the server
+ * isn't running.
+ */
+bool forwardToServer(const std::vector<const char *> &fullArgs,
+                     int &exitStatus) {
+#if LDC_POSIX
+  const std::string socketPath = env::get(server::socketEnvVar);
+  if (socketPath.empty())
+    return false;
+
+  server::Request request;
+  llvm::SmallString<128> cwd;
+  if (ls::fs::current_path(cwd))
+    return false;
+  request.cwd = cwd.str().str();
+  request.args.assign(fullArgs.begin(), fullArgs.end());
+  request.env = server::getEnvironment();
+
+  const int socket = server::connectToSocket(socketPath.c_str());
+  if (socket < 0)
+    return false;
+  const int stdioFds[] = {0, 1, 2};
+  const bool sent = server::sendRequest(socket, request, stdioFds);
+  const bool done = sent && server::receiveExitStatus(socket, exitStatus);
+  close(socket);
+  if (sent && !done) {
+    // The server might have died while compiling; retry locally.
+    warning("lost connection to compile server at %s", socketPath.c_str());
+  }
+  return done;
+#else
+  return false;
+#endif
+}
+
 /**
  * Prints usage information to stdout.
  */
@@ -831,5 +871,9 @@ int cppmain() {
 
   translateArgs(ldmdArguments, fullArgs);
 
+  int exitStatus;
+  if (forwardToServer(fullArgs, exitStatus))
+    return exitStatus;
+
   return execute(std::move(fullArgs));
 }
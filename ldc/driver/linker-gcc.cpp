@@ -161,6 +161,10 @@ void ArgsBuilder::addLTOGoldPluginFlags(bool requirePlugin) {
   // LLVM 16: disable function specializations by default
   addLdFlag("-plugin-opt=-func-specialization-size-threshold=1000000000");
 #endif
+
+  // Report the devirtualized call sites with -v.
+  if (opts::wholeProgramVTables && global.params.v.verbose)
+    addLdFlag("-plugin-opt=-pass-remarks=wholeprogramdevirt");
 }
 
 // Returns an empty string when libLTO.dylib was not specified nor found.
@@ -197,6 +201,10 @@ void ArgsBuilder::addDarwinLTOFlags() {
     addLdFlag("-mllvm", "-func-specialization-size-threshold=1000000000");
 #endif
   }
+
+  // Report the devirtualized call sites with -v.
+  if (opts::wholeProgramVTables && global.params.v.verbose)
+    addLdFlag("-mllvm", "-pass-remarks=wholeprogramdevirt");
 }
 
 /// Adds the required linker flags for LTO builds to args.
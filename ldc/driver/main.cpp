@@ -35,6 +35,7 @@
 #include "driver/ldc-version.h"
 #include "driver/linker.h"
 #include "driver/plugins.h"
+#include "driver/server.h"
 #include "driver/targetmachine.h"
 #include "driver/timetrace.h"
 #include "gen/abi/abi.h"
@@ -552,6 +553,10 @@ void parseCommandLine(Strings &sourceFiles) {
     error(Loc(), "-soname can be used only when building a shared library");
   }
 
+  if (opts::wholeProgramVTables && !opts::isUsingLTO()) {
+    error(Loc(), "-fwhole-program-vtables requires -flto");
+  }
+
   global.params.dihdr.fullOutput = opts::hdrKeepAllBodies;
   global.params.disableRedZone = opts::disableRedZone();
 
@@ -1145,10 +1150,13 @@ int cppmain() {
 
   initializePasses();
 
+  // In compile server mode, this only returns in forked compile processes.
+  server::serveIfRequested(allArguments);
+
   Strings files;
   parseCommandLine(files);
 
-  if (allArguments.size() == 1) {
+  if (allArguments.size() == 1 && !server::isZygote()) {
     cl::PrintHelpMessage(/*Hidden=*/false, /*Categorized=*/true);
     exit(EXIT_FAILURE);
   }
@@ -1241,6 +1249,10 @@ int cppmain() {
 
   loadAllPlugins();
 
+  // A zygote only returns in the compile processes it forks for requests.
+  server::runZygote(files);
+  server::printStartupTimeSaved();
+
   int status;
   {
     TimeTraceScope timeScope("ExecuteCompiler");
@@ -1248,6 +1260,9 @@ int cppmain() {
     status = mars_mainBody(global.params, files, libmodules);
   }
 
+  if (status == EXIT_SUCCESS)
+    server::reportImportedModules();
+
   // try to remove the temp objects dir if created for -cleanup-obj
   if (!tempObjectsDir.empty())
     llvm::sys::fs::remove(tempObjectsDir);
@@ -1262,6 +1277,11 @@ int cppmain() {
 }
 
 void codegenModules(Modules &modules) {
+  // Object files (and their frontend hashes) to be added to the cache once
+  // they have been written.
+  std::vector<std::pair<std::string, llvm::SmallString<32>>>
+      frontendCacheMisses;
+
   // Generate one or more object/IR/bitcode files/dcompute kernels.
   if (global.params.obj && !modules.empty()) {
     TimeTraceScope timeScope("Codegen all modules");
@@ -1275,6 +1295,16 @@ void codegenModules(Modules &modules) {
 #endif
     DComputeCodeGenManager dccg(getGlobalContext());
     std::vector<Module *> computeModules;
+
+    // Object files can be recovered before IR generation if their only
+    // dependencies are the module's source file(s) and the cmdline flags.
+    const bool useFrontendCache =
+        cache::isFrontendLookupEnabled() && !global.params.oneobj &&
+        global.params.output_o && !global.params.output_bc &&
+        !global.params.output_ll && !global.params.output_s &&
+        !global.params.output_mlir && global.params.bitcodeFiles.length == 0;
+    const llvm::ArrayRef<Module *> rootModules(modules.tdata(),
+                                               modules.length);
     // When inlining is enabled, we are calling semantic3 on function
     // declarations, which may _add_ members to the first module in the modules
     // array. These added functions must be codegenned, because these functions
@@ -1293,6 +1323,16 @@ void codegenModules(Modules &modules) {
         message("code      %s", m->toChars());
 
       const auto atCompute = hasComputeAttr(m);
+      if (useFrontendCache && atCompute == DComputeCompileFor::hostOnly) {
+        llvm::SmallString<32> hash;
+        if (cache::frontendLookup(m, rootModules, m->objfile.toChars(),
+                                  hash)) {
+          continue;
+        }
+        if (!hash.empty()) {
+          frontendCacheMisses.emplace_back(m->objfile.toChars(), hash);
+        }
+      }
       if (atCompute == DComputeCompileFor::hostOnly ||
           atCompute == DComputeCompileFor::hostAndDevice) {
         TimeTraceScope timeScope(
@@ -1336,16 +1376,22 @@ void codegenModules(Modules &modules) {
       }
     }
     dccg.writeModules();
+    cg.finish();
 
     // We may have removed all object files, if so don't link.
     if (global.params.objfiles.length == 0)
       global.params.link = false;
   }
 
+  for (const auto &miss : frontendCacheMisses) {
+    cache::cacheObjectFile(miss.first, miss.second);
+  }
+
   {
     TimeTraceScope timeScope("Prune object file cache");
     cache::pruneCache();
   }
+  cache::printStatistics();
 
   freeRuntime();
 }
@@ -0,0 +1,974 @@
+//===-- driver/server.cpp -------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// With `-server=<socket>`, LDC initializes LLVM once and then waits for
+// compile requests from clients (LDMD with LDC_SERVER_SOCKET set), see
+// driver/server_protocol.h. Each request is compiled in a forked process,
+// which inherits the initialized state and continues like a regular LDC
+// invocation, with the working directory, environment, command line and
+// standard streams of the client.
+//
+// Requests differing only in their input files and -of/-od paths, i.e., the
+// per-module compiles of a build, share a zygote: a forked process which has
+// parsed their common command line, created the target machine and
+// initialized the frontend. It forks the compile processes for these requests,
+// which continue with the request's files. After a successful compile, a
+// compile process reports the modules it imported from outside the working
+// directory (druntime, Phobos and other libraries) to the zygote, which then
+// imports them itself, so that they are resident (parsed and semantically
+// analyzed) for subsequent requests.
+//
+// Before each request, the zygote checks the files of its resident modules
+// for changes - their size and modification time, then a hash of their
+// contents. If any has changed, it exits and the server starts a new one.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/server.h"
+
+#include "dmd/errors.h"
+#include "dmd/compiler.h"
+#include "dmd/identifier.h"
+#include "dmd/module.h"
+#include "driver/args.h"
+#include "driver/cl_helpers.h"
+#include "driver/cl_options.h"
+#include "driver/server_protocol.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+
+#if LDC_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// in dmd/main.d
+void initializeFrontend(Param &params);
+bool preloadImports(const Strings &moduleNames);
+
+namespace cl = llvm::cl;
+
+static cl::opt<std::string> serverSocket(
+    "server", cl::ZeroOrMore, cl::value_desc("socket path"),
+    cl::desc("Run as compile server listening on the given Unix domain "
+             "socket, for LDMD with LDC_SERVER_SOCKET set"));
+
+static cl::opt<unsigned> serverIdleTimeout(
+    "server-idle-timeout", cl::ZeroOrMore, cl::value_desc("seconds"),
+    cl::desc("Exit the compile server after <seconds> without requests "
+             "(default: 0 = never)"),
+    cl::init(0));
+
+static cl::opt<bool>
+    serverDetach("server-detach", cl::ZeroOrMore,
+                 cl::desc("Run the compile server in the background once it "
+                          "is listening"));
+
+namespace server {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using std::chrono::microseconds;
+
+// Initialized before druntime and LLVM, so that their initialization counts
+// towards the startup time saved.
+const Clock::time_point processStartTime = Clock::now();
+
+enum class Role {
+  Standalone,    // a regular compiler invocation
+  Server,        // the server process
+  DirectCompile, // a compile process forked by the server
+  Zygote,        // a zygote, forked by the server
+  ZygoteCompile, // a compile process forked by a zygote
+};
+Role role = Role::Standalone;
+
+// The time the server and the zygote spent on their initialization, including
+// the zygote's preloading of imports.
+microseconds serverStartupTime;
+microseconds zygoteStartupTime;
+Clock::time_point zygoteStartTime;
+
+// Number of modules resident in the zygote.
+unsigned numResidentModules = 0;
+
+// In compile processes forked by a zygote: the pipe to report the imported
+// modules to, and the number of modules loaded before forking.
+int reportFd = -1;
+d_size_t numModulesAtFork = 0;
+
+/// The parts of a request's command line which aren't part of its zygote's
+/// command line.
+struct RequestInputs {
+  std::vector<std::string> files;
+  std::string objectFile; // -of
+  std::string objectDir;  // -od
+};
+
+// Returns whether `arg` is an option taking the next argument as its value.
+bool takesSeparateValue(llvm::StringRef arg) {
+  if (!arg.consume_front("-"))
+    return false;
+  arg.consume_front("-");
+  if (arg.contains('='))
+    return false;
+  const auto &options = cl::getRegisteredOptions();
+  const auto it = options.find(arg);
+  return it != options.end() &&
+         it->second->getValueExpectedFlag() == cl::ValueRequired;
+}
+
+// -of extensions LDC infers the output type from, which therefore need to be
+// known when parsing the command line.
+bool isOutputTypeExtension(llvm::StringRef path) {
+  const auto ext = llvm::sys::path::extension(path);
+  return ext == ".ll" || ext == ".bc" || ext == ".s" || ext == ".mlir";
+}
+
+// Splits a request's command line into the command line of its zygote and the
+// request's inputs. Returns false if the request cannot use a zygote.
+bool splitCommandLine(const std::vector<std::string> &args,
+                      std::vector<std::string> &zygoteArgs,
+                      RequestInputs &inputs) {
+  zygoteArgs.push_back(args[0]);
+  for (size_t i = 1; i < args.size(); ++i) {
+    const llvm::StringRef arg = args[i];
+    // -run consumes the remaining arguments; response files and stdin depend
+    // on the request's context.
+    if (args::isRunArg(args[i].c_str()) || arg.startswith("@") || arg == "-")
+      return false;
+
+    llvm::StringRef option = arg;
+    if (!option.consume_front("-")) {
+      inputs.files.push_back(arg.str());
+      continue;
+    }
+    option.consume_front("-");
+
+    const bool isObjectFile = option.startswith("of");
+    if (isObjectFile || option.startswith("od")) {
+      llvm::StringRef value = option.drop_front(2);
+      const bool isSeparate = value.empty();
+      if (isSeparate) {
+        if (i + 1 == args.size())
+          return false;
+        value = args[i + 1];
+      } else {
+        value.consume_front("=");
+      }
+      if (isObjectFile && isOutputTypeExtension(value)) {
+        zygoteArgs.push_back(arg.str());
+        if (isSeparate)
+          zygoteArgs.push_back(args[++i]);
+        continue;
+      }
+      (isObjectFile ? inputs.objectFile : inputs.objectDir) = value.str();
+      if (isSeparate)
+        ++i;
+      continue;
+    }
+
+    zygoteArgs.push_back(arg.str());
+    if (takesSeparateValue(arg) && i + 1 < args.size())
+      zygoteArgs.push_back(args[++i]);
+  }
+  return !inputs.files.empty();
+}
+
+#if LDC_POSIX
+
+// Replies of zygotes to requests.
+enum Reply : char {
+  Accepted = 'A',   // a compile process has been forked for the request
+  Stale = 'S',      // resident modules have changed, the zygote exits
+  DirectOnly = 'D', // preloading has failed, the zygote exits
+  DirectOnce = 'F', // the request compiles a resident module
+};
+
+// Self-pipe for SIGCHLD, to wait for exiting children via poll().
+int signalPipe[2] = {-1, -1};
+
+extern "C" void onChildExit(int) {
+  const int savedErrno = errno;
+  const char c = 0;
+  (void)!write(signalPipe[1], &c, 1);
+  errno = savedErrno;
+}
+
+void closeFd(int &fd) {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+void closeFds(llvm::ArrayRef<int> fds) {
+  for (int fd : fds)
+    close(fd);
+}
+
+void setCloseOnExec(int fd) { fcntl(fd, F_SETFD, FD_CLOEXEC); }
+
+void installChildHandler() {
+  closeFd(signalPipe[0]);
+  closeFd(signalPipe[1]);
+  if (pipe(signalPipe) != 0) {
+    error(Loc(), "cannot create pipe: %s", strerror(errno));
+    fatal();
+  }
+  for (int fd : signalPipe) {
+    setCloseOnExec(fd);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &onChildExit;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &action, nullptr);
+}
+
+void drainSignalPipe() {
+  char buffer[64];
+  while (read(signalPipe[0], buffer, sizeof(buffer)) > 0) {
+  }
+}
+
+int exitStatusOf(int waitStatus) {
+  if (WIFEXITED(waitStatus))
+    return WEXITSTATUS(waitStatus);
+  if (WIFSIGNALED(waitStatus))
+    return 128 + WTERMSIG(waitStatus);
+  return EXIT_FAILURE;
+}
+
+void redirectStdioToNull() {
+  const int nullFd = open("/dev/null", O_RDWR);
+  if (nullFd < 0)
+    return;
+  for (int fd = 0; fd < 3; ++fd)
+    dup2(nullFd, fd);
+  if (nullFd > 2)
+    close(nullFd);
+}
+
+// In a process forked for a request, after releasing the resources of the
+// parent: takes on the context of the request.
+void enterRequestProcess(const Request &request, llvm::ArrayRef<int> stdioFds,
+                         const std::vector<std::string> &args) {
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  closeFd(signalPipe[0]);
+  closeFd(signalPipe[1]);
+
+  for (int fd = 0; fd < 3; ++fd)
+    dup2(stdioFds[fd], fd);
+  for (int fd : stdioFds.take_front(3)) {
+    if (fd > 2)
+      close(fd);
+  }
+
+  setEnvironment(request.env);
+
+  opts::allArguments.clear();
+  for (const auto &arg : args)
+    opts::allArguments.push_back(strdup(arg.c_str()));
+
+  if (chdir(request.cwd.c_str()) != 0) {
+    error(Loc(), "cannot change to directory `%s`: %s", request.cwd.c_str(),
+          strerror(errno));
+    fatal();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Server
+
+struct Zygote {
+  pid_t pid;
+  int controlFd; // socket to send requests over
+};
+
+int listenFd = -1;
+// In a zygote: the socket the server sends requests over.
+int controlFd = -1;
+// By zygote key, see zygoteKey().
+std::map<std::string, Zygote> zygotes;
+// Keys whose zygote has rejected its command line.
+std::set<std::string> directOnlyKeys;
+// Compile processes forked by the server, with their client connection.
+std::map<pid_t, int> directCompiles;
+
+std::string zygoteKey(const Request &request,
+                      const std::vector<std::string> &zygoteArgs) {
+  std::string key = request.cwd;
+  key += '\0';
+  for (const auto &var : request.env) {
+    key += var;
+    key += '\0';
+  }
+  key += '\0';
+  for (const auto &arg : zygoteArgs) {
+    key += arg;
+    key += '\0';
+  }
+  return key;
+}
+
+void releaseServerResources(int client) {
+  closeFd(listenFd);
+  close(client);
+  for (auto &entry : zygotes)
+    close(entry.second.controlFd);
+  zygotes.clear();
+  for (auto &entry : directCompiles)
+    close(entry.second);
+  directCompiles.clear();
+}
+
+int listenOn(const std::string &path) {
+  sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    error(Loc(), "socket path `%s` is too long", path.c_str());
+    fatal();
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    error(Loc(), "cannot create socket: %s", strerror(errno));
+    fatal();
+  }
+  setCloseOnExec(fd);
+
+  unlink(path.c_str()); // stale socket
+  // Clients can make the server compile (and run the linker) as its user.
+  const mode_t oldMask = umask(0077);
+  const bool ok =
+      bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 &&
+      listen(fd, 64) == 0;
+  umask(oldMask);
+  if (!ok) {
+    error(Loc(), "cannot listen on `%s`: %s", path.c_str(), strerror(errno));
+    fatal();
+  }
+  return fd;
+}
+
+void reapServerChildren() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    const auto it = directCompiles.find(pid);
+    if (it != directCompiles.end()) {
+      sendExitStatus(it->second, exitStatusOf(status));
+      close(it->second);
+      directCompiles.erase(it);
+      continue;
+    }
+    for (auto z = zygotes.begin(); z != zygotes.end(); ++z) {
+      if (z->second.pid == pid) {
+        close(z->second.controlFd);
+        zygotes.erase(z);
+        break;
+      }
+    }
+  }
+}
+
+// Forks a compile process for the request. Returns true in the child.
+bool startDirectCompile(const Request &request, llvm::ArrayRef<int> stdioFds,
+                        int client) {
+  fflush(nullptr);
+  const pid_t pid = fork();
+  if (pid == 0) {
+    releaseServerResources(client);
+    enterRequestProcess(request, stdioFds, request.args);
+    role = Role::DirectCompile;
+    return true;
+  }
+
+  closeFds(stdioFds);
+  if (pid < 0) {
+    sendExitStatus(client, EXIT_FAILURE);
+    close(client);
+  } else {
+    directCompiles[pid] = client;
+  }
+  return false;
+}
+
+// Handles a client connection. Returns true in forked processes.
+bool handleClient(int client) {
+  Request request;
+  llvm::SmallVector<int, 4> stdioFds;
+  if (!receiveRequest(client, request, stdioFds) || stdioFds.size() != 3) {
+    closeFds(stdioFds);
+    close(client);
+    return false;
+  }
+
+  std::vector<std::string> zygoteArgs;
+  RequestInputs inputs;
+  if (!splitCommandLine(request.args, zygoteArgs, inputs))
+    return startDirectCompile(request, stdioFds, client);
+
+  const std::string key = zygoteKey(request, zygoteArgs);
+  if (directOnlyKeys.count(key))
+    return startDirectCompile(request, stdioFds, client);
+
+  // A stale zygote is replaced once.
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    auto it = zygotes.find(key);
+    const bool isNew = it == zygotes.end();
+    if (isNew) {
+      int sockets[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+        break;
+      fflush(nullptr);
+      const pid_t pid = fork();
+      if (pid == 0) {
+        close(sockets[0]);
+        releaseServerResources(client);
+        // The zygote reports errors in the command line to this first client.
+        enterRequestProcess(request, stdioFds, zygoteArgs);
+        role = Role::Zygote;
+        zygoteStartTime = Clock::now();
+        controlFd = sockets[1];
+        return true;
+      }
+      close(sockets[1]);
+      if (pid < 0) {
+        close(sockets[0]);
+        break;
+      }
+      setCloseOnExec(sockets[0]);
+      it = zygotes.emplace(key, Zygote{pid, sockets[0]}).first;
+    }
+
+    Zygote zygote = it->second;
+    stdioFds.push_back(client);
+    const bool sent = sendRequest(zygote.controlFd, request, stdioFds);
+    stdioFds.pop_back();
+    char reply = 0;
+    if (sent) {
+      while (recv(zygote.controlFd, &reply, 1, 0) < 0 && errno == EINTR) {
+      }
+    }
+
+    if (reply == Accepted) {
+      closeFds(stdioFds);
+      close(client);
+      return false;
+    }
+    if (reply == DirectOnce)
+      break;
+
+    // The zygote exits after the other replies, or has died.
+    close(zygote.controlFd);
+    zygotes.erase(it);
+    int status = 0;
+    waitpid(zygote.pid, &status, 0);
+
+    if (reply == DirectOnly) {
+      directOnlyKeys.insert(key);
+      break;
+    }
+    if (reply == 0 && isNew) {
+      // It has failed to initialize, after reporting errors to the client.
+      sendExitStatus(client, exitStatusOf(status));
+      closeFds(stdioFds);
+      close(client);
+      return false;
+    }
+  }
+
+  return startDirectCompile(request, stdioFds, client);
+}
+
+// Returns true in forked processes, false when the server shuts down.
+bool runServer() {
+  signal(SIGPIPE, SIG_IGN);
+  listenFd = listenOn(serverSocket);
+  installChildHandler();
+
+  if (serverDetach) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      error(Loc(), "cannot fork: %s", strerror(errno));
+      fatal();
+    }
+    if (pid > 0)
+      exit(EXIT_SUCCESS);
+    setsid();
+    redirectStdioToNull();
+  }
+
+  role = Role::Server;
+  serverStartupTime =
+      std::chrono::duration_cast<microseconds>(Clock::now() - processStartTime);
+
+  auto lastRequestTime = Clock::now();
+  while (true) {
+    int timeoutMs = -1;
+    if (serverIdleTimeout && directCompiles.empty()) {
+      const auto remaining = std::chrono::seconds(serverIdleTimeout) -
+                             (Clock::now() - lastRequestTime);
+      if (remaining <= Clock::duration::zero())
+        break;
+      timeoutMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      remaining)
+                      .count() +
+                  1;
+    }
+
+    pollfd fds[2] = {{listenFd, POLLIN, 0}, {signalPipe[0], POLLIN, 0}};
+    const int n = poll(fds, 2, timeoutMs);
+    if (n < 0 && errno != EINTR) {
+      error(Loc(), "poll failed: %s", strerror(errno));
+      break;
+    }
+    if (n <= 0)
+      continue;
+
+    if (fds[1].revents & POLLIN) {
+      drainSignalPipe();
+      reapServerChildren();
+    }
+    if (fds[0].revents & POLLIN) {
+      const int client = accept(listenFd, nullptr, nullptr);
+      if (client < 0)
+        continue;
+      setCloseOnExec(client);
+      lastRequestTime = Clock::now();
+      if (handleClient(client))
+        return true;
+    }
+  }
+
+  unlink(serverSocket.c_str());
+  // Zygotes exit once their control socket is closed.
+  for (auto &entry : zygotes)
+    close(entry.second.controlFd);
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Zygote
+
+/// A file the resident modules depend on.
+struct ResidentFile {
+  std::string path; // absolute
+  uint64_t size;
+  llvm::sys::TimePoint<> modificationTime;
+  uint64_t hash;
+};
+
+std::vector<ResidentFile> residentFiles;
+std::set<std::string> residentModuleNames;
+d_size_t numTrackedModules = 0;
+
+// Modules imported by finished compiles, to be preloaded.
+std::set<std::string> pendingModuleNames;
+bool canPreload = false;
+bool preloadFailed = false;
+
+/// A compile process forked by the zygote.
+struct ZygoteCompile {
+  int reportFd; // read end
+  int client;
+  std::string report;
+};
+std::map<pid_t, ZygoteCompile> zygoteCompiles;
+
+void releaseZygoteResources() {
+  closeFd(controlFd);
+  for (auto &entry : zygoteCompiles) {
+    closeFd(entry.second.reportFd);
+    close(entry.second.client);
+  }
+  zygoteCompiles.clear();
+}
+
+bool isPreloadModule(Module *m) {
+  return llvm::StringRef(m->ident->toChars()).startswith("__ldc_server_preload");
+}
+
+void trackFile(const char *path, llvm::StringRef contents) {
+  llvm::SmallString<128> absolutePath(path);
+  llvm::sys::fs::make_absolute(absolutePath);
+  llvm::sys::fs::file_status status;
+  if (llvm::sys::fs::status(absolutePath, status))
+    return;
+  residentFiles.push_back({absolutePath.str().str(), status.getSize(),
+                           status.getLastModificationTime(),
+                           llvm::xxHash64(contents)});
+}
+
+// Starts tracking the files of modules loaded since the last call.
+void trackNewModules() {
+  for (d_size_t i = numTrackedModules; i < Module::amodules.length; ++i) {
+    Module *m = Module::amodules[i];
+    if (isPreloadModule(m))
+      continue;
+    ++numResidentModules;
+    residentModuleNames.insert(m->toPrettyChars());
+    trackFile(m->srcfile.toChars(),
+              {reinterpret_cast<const char *>(m->src.ptr), m->src.length});
+    for (const char *file : m->contentImportedFiles) {
+      if (auto buffer = llvm::MemoryBuffer::getFile(file))
+        trackFile(file, (*buffer)->getBuffer());
+    }
+  }
+  numTrackedModules = Module::amodules.length;
+}
+
+bool hasChangedResidentFiles() {
+  for (auto &file : residentFiles) {
+    llvm::sys::fs::file_status status;
+    if (llvm::sys::fs::status(file.path, status))
+      return true;
+    if (status.getSize() == file.size &&
+        status.getLastModificationTime() == file.modificationTime) {
+      continue;
+    }
+    auto buffer = llvm::MemoryBuffer::getFile(file.path);
+    if (!buffer || llvm::xxHash64((*buffer)->getBuffer()) != file.hash)
+      return true;
+    file.size = status.getSize();
+    file.modificationTime = status.getLastModificationTime();
+  }
+  return false;
+}
+
+bool isResidentFile(const std::string &path) {
+  llvm::SmallString<128> absolutePath(path);
+  llvm::sys::fs::make_absolute(absolutePath);
+  for (const auto &file : residentFiles) {
+    if (file.path == absolutePath.str())
+      return true;
+  }
+  return false;
+}
+
+void preloadModules(const std::set<std::string> &names) {
+  const auto start = Clock::now();
+  Strings moduleNames;
+  for (const auto &name : names) {
+    if (!residentModuleNames.count(name))
+      moduleNames.push(strdup(name.c_str()));
+  }
+  if (!preloadImports(moduleNames)) {
+    // The frontend state is unusable.
+    preloadFailed = true;
+    return;
+  }
+  trackNewModules();
+  zygoteStartupTime +=
+      std::chrono::duration_cast<microseconds>(Clock::now() - start);
+}
+
+void reapZygoteCompiles() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    const auto it = zygoteCompiles.find(pid);
+    if (it == zygoteCompiles.end())
+      continue;
+    ZygoteCompile &compile = it->second;
+
+    // Read the rest of the report.
+    char buffer[4096];
+    ssize_t n;
+    while (compile.reportFd >= 0 &&
+           (n = read(compile.reportFd, buffer, sizeof(buffer))) != 0) {
+      if (n > 0)
+        compile.report.append(buffer, n);
+      else if (errno != EINTR)
+        break;
+    }
+    closeFd(compile.reportFd);
+
+    const int exitStatus = exitStatusOf(status);
+    sendExitStatus(compile.client, exitStatus);
+    close(compile.client);
+
+    if (exitStatus == EXIT_SUCCESS) {
+      llvm::StringRef report = compile.report;
+      while (!report.empty()) {
+        llvm::StringRef name;
+        std::tie(name, report) = report.split('\n');
+        if (!name.empty() && !residentModuleNames.count(name.str()))
+          pendingModuleNames.insert(name.str());
+      }
+    }
+    zygoteCompiles.erase(it);
+  }
+}
+
+// Handles a request forwarded by the server. Returns true in the forked
+// compile process.
+bool handleZygoteRequest(const Request &request, llvm::ArrayRef<int> fds,
+                         Strings &files) {
+  std::vector<std::string> zygoteArgs;
+  RequestInputs inputs;
+  splitCommandLine(request.args, zygoteArgs, inputs);
+
+  Reply reply = Accepted;
+  if (preloadFailed) {
+    reply = DirectOnly;
+  } else if (hasChangedResidentFiles()) {
+    reply = Stale;
+  } else {
+    for (const auto &file : inputs.files) {
+      if (isResidentFile(file))
+        reply = DirectOnce;
+    }
+  }
+
+  int pipeFds[2];
+  if (reply == Accepted && pipe(pipeFds) != 0)
+    reply = DirectOnce;
+
+  pid_t pid = -1;
+  if (reply == Accepted) {
+    fflush(nullptr);
+    pid = fork();
+    if (pid == 0) {
+      close(pipeFds[0]);
+      releaseZygoteResources();
+      close(fds[3]);
+      enterRequestProcess(request, fds, request.args);
+      role = Role::ZygoteCompile;
+      reportFd = pipeFds[1];
+      setCloseOnExec(reportFd);
+      numModulesAtFork = Module::amodules.length;
+
+      files.setDim(0);
+      for (const auto &file : inputs.files)
+        files.push(strdup(file.c_str()));
+      if (!inputs.objectFile.empty())
+        global.params.objname = opts::dupPathString(inputs.objectFile);
+      if (!inputs.objectDir.empty())
+        global.params.objdir = opts::dupPathString(inputs.objectDir);
+      return true;
+    }
+    close(pipeFds[1]);
+    if (pid < 0) {
+      close(pipeFds[0]);
+      reply = DirectOnce;
+    } else {
+      setCloseOnExec(pipeFds[0]);
+      fcntl(pipeFds[0], F_SETFL, O_NONBLOCK);
+      zygoteCompiles[pid] = {pipeFds[0], fds[3], {}};
+    }
+  }
+
+  const char replyChar = reply;
+  send(controlFd, &replyChar, 1, 0);
+  closeFds(fds.take_front(3));
+  if (reply != Accepted)
+    close(fds[3]);
+  if (reply == Stale || reply == DirectOnly)
+    exit(EXIT_SUCCESS);
+  return false;
+}
+
+#endif // LDC_POSIX
+
+} // anonymous namespace
+
+void serveIfRequested(llvm::SmallVectorImpl<const char *> &args) {
+  const auto isServerOption = [](llvm::StringRef arg) {
+    return arg.startswith("-server") || arg.startswith("--server");
+  };
+  if (std::none_of(args.begin() + 1, args.end(), isServerOption))
+    return;
+  if (!std::all_of(args.begin() + 1, args.end(), isServerOption)) {
+    error(Loc(), "`-server` cannot be combined with other options, which are "
+                 "passed with each request");
+    fatal();
+  }
+
+  cl::ParseCommandLineOptions(args.size(), args.data(),
+                              "LDC - the LLVM D compiler, compile server\n");
+  if (serverSocket.empty())
+    return;
+
+#if LDC_POSIX
+  if (runServer()) {
+    // Continue with the request's command line in a forked process.
+    cl::ResetAllOptionOccurrences();
+    return;
+  }
+  exit(EXIT_SUCCESS);
+#else
+  error(Loc(), "`-server` is only supported on POSIX hosts");
+  fatal();
+#endif
+}
+
+bool isZygote() { return role == Role::Zygote; }
+
+void runZygote(Strings &files) {
+#if LDC_POSIX
+  if (role != Role::Zygote)
+    return;
+
+  // Imports don't end up in the -deps/-makedeps/-X output if preloaded, and
+  // with -allinst or -i, the compile processes need to see all instantiations
+  // of their imports' templates.
+  canPreload = !includeImports && !global.params.allInst &&
+               !global.params.moduleDeps.doOutput &&
+               !global.params.makeDeps.doOutput &&
+               !global.params.json.doOutput;
+
+  initializeFrontend(global.params);
+  if (global.errors)
+    fatal();
+  if (canPreload) {
+    // Loads `object`, imported by every module.
+    preloadModules({});
+  }
+  zygoteStartupTime +=
+      std::chrono::duration_cast<microseconds>(Clock::now() - zygoteStartTime);
+
+  // Release the standard streams of the request the zygote was created for.
+  fflush(nullptr);
+  redirectStdioToNull();
+  installChildHandler();
+
+  while (true) {
+    std::vector<pollfd> fds;
+    fds.push_back({controlFd, POLLIN, 0});
+    fds.push_back({signalPipe[0], POLLIN, 0});
+    for (const auto &entry : zygoteCompiles) {
+      if (entry.second.reportFd >= 0)
+        fds.push_back({entry.second.reportFd, POLLIN, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP)))
+        continue;
+      for (auto &entry : zygoteCompiles) {
+        ZygoteCompile &compile = entry.second;
+        if (compile.reportFd != fds[i].fd)
+          continue;
+        char buffer[4096];
+        const ssize_t n = read(compile.reportFd, buffer, sizeof(buffer));
+        if (n > 0)
+          compile.report.append(buffer, n);
+        else if (n == 0)
+          closeFd(compile.reportFd);
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      drainSignalPipe();
+      reapZygoteCompiles();
+      if (canPreload && !preloadFailed && !pendingModuleNames.empty()) {
+        preloadModules(pendingModuleNames);
+        pendingModuleNames.clear();
+      }
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP)) {
+      Request request;
+      llvm::SmallVector<int, 4> requestFds;
+      if (!receiveRequest(controlFd, request, requestFds) ||
+          requestFds.size() != 4) {
+        // The server has shut down.
+        exit(EXIT_SUCCESS);
+      }
+      if (handleZygoteRequest(request, requestFds, files))
+        return;
+    }
+  }
+#endif
+}
+
+void printStartupTimeSaved() {
+  if (!global.params.v.verbose)
+    return;
+  const microseconds saved =
+      role == Role::DirectCompile   ? serverStartupTime
+      : role == Role::ZygoteCompile ? serverStartupTime + zygoteStartupTime
+                                    : microseconds::zero();
+  if (role == Role::ZygoteCompile) {
+    message("server    %.1f ms of startup time saved, %u resident modules",
+            saved.count() / 1000.0, numResidentModules);
+  } else if (role == Role::DirectCompile) {
+    message("server    %.1f ms of startup time saved", saved.count() / 1000.0);
+  }
+}
+
+void reportImportedModules() {
+#if LDC_POSIX
+  if (reportFd < 0)
+    return;
+
+  llvm::SmallString<128> cwd;
+  llvm::sys::fs::current_path(cwd);
+  cwd += llvm::sys::path::get_separator();
+
+  std::string report;
+  for (d_size_t i = numModulesAtFork; i < Module::amodules.length; ++i) {
+    Module *m = Module::amodules[i];
+    if (m->isRoot() ||
+        (m->filetype != FileType::d && m->filetype != FileType::dhdr)) {
+      continue;
+    }
+    llvm::SmallString<128> path(m->srcfile.toChars());
+    llvm::sys::fs::make_absolute(path);
+    if (llvm::StringRef(path).startswith(cwd))
+      continue;
+    report += m->toPrettyChars();
+    report += '\n';
+  }
+
+  llvm::StringRef data = report;
+  while (!data.empty()) {
+    const ssize_t n = write(reportFd, data.data(), data.size());
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    data = data.drop_front(n);
+  }
+  closeFd(reportFd);
+#endif
+}
+
+} // namespace server
@@ -0,0 +1,47 @@
+//===-- driver/server.h -----------------------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compile server mode (`-server=<socket>`), amortizing the startup cost of
+// the compiler over many compiles.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "dmd/globals.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace server {
+
+/// Runs the compile server if requested on the command line (`-server=...`).
+/// Only returns (in a forked process) if not, or if the process is to
+/// continue as compiler, with `opts::allArguments` replaced by the command
+/// line to compile with.
+void serveIfRequested(llvm::SmallVectorImpl<const char *> &args);
+
+/// Returns whether the current process is a zygote, whose command line lacks
+/// the input files.
+bool isZygote();
+
+/// In a zygote process (a compiler process prepared for a specific command
+/// line), initializes the frontend and forks off compile processes for
+/// requests with that command line. Only returns in these, with `files` and
+/// the output paths set to the request's.
+/// Does nothing in other processes.
+void runZygote(Strings &files);
+
+/// Prints the startup time saved by the server for this request with `-v`.
+void printStartupTimeSaved();
+
+/// Called after successful compiles: reports the imported modules to the
+/// zygote this process has been forked from, which then preloads them for
+/// subsequent requests.
+void reportImportedModules();
+
+} // namespace server
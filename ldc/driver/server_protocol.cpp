@@ -0,0 +1,273 @@
+//===-- driver/server_protocol.cpp ----------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A request is sent as a 4-byte magic, a 32-bit payload size and the payload:
+// the working directory, the number of arguments, the arguments, the number of
+// environment variables and the variables, with all strings null-terminated
+// and all integers in native byte order (both ends are on the same machine).
+// The file descriptors are attached to the header via SCM_RIGHTS.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/server_protocol.h"
+
+#if LDC_POSIX
+
+#include "llvm/ADT/StringRef.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#if __APPLE__
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
+
+namespace server {
+
+namespace {
+
+constexpr char magic[4] = {'L', 'D', 'C', '1'};
+constexpr size_t headerSize = sizeof(magic) + sizeof(uint32_t);
+// Sanity limit for the payload size.
+constexpr uint32_t maxPayloadSize = 64 * 1024 * 1024;
+constexpr size_t maxFds = 4;
+
+#ifdef MSG_NOSIGNAL
+constexpr int sendFlags = MSG_NOSIGNAL;
+#else
+constexpr int sendFlags = 0;
+#endif
+
+bool sendAll(int socket, const char *data, size_t size) {
+  while (size) {
+    const ssize_t n = send(socket, data, size, sendFlags);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool receiveAll(int socket, char *data, size_t size) {
+  while (size) {
+    const ssize_t n = recv(socket, data, size, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+void appendU32(std::string &buffer, uint32_t value) {
+  buffer.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void appendString(std::string &buffer, const std::string &str) {
+  buffer.append(str.c_str(), str.size() + 1);
+}
+
+void appendStrings(std::string &buffer, const std::vector<std::string> &strs) {
+  appendU32(buffer, strs.size());
+  for (const auto &str : strs)
+    appendString(buffer, str);
+}
+
+bool readU32(llvm::StringRef &data, uint32_t &value) {
+  if (data.size() < sizeof(value))
+    return false;
+  memcpy(&value, data.data(), sizeof(value));
+  data = data.drop_front(sizeof(value));
+  return true;
+}
+
+bool readString(llvm::StringRef &data, std::string &str) {
+  const size_t end = data.find('\0');
+  if (end == llvm::StringRef::npos)
+    return false;
+  str = data.take_front(end).str();
+  data = data.drop_front(end + 1);
+  return true;
+}
+
+bool readStrings(llvm::StringRef &data, std::vector<std::string> &strs) {
+  uint32_t count;
+  if (!readU32(data, count) || count > data.size())
+    return false;
+  strs.resize(count);
+  for (auto &str : strs) {
+    if (!readString(data, str))
+      return false;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+std::vector<std::string> getEnvironment() {
+  std::vector<std::string> env;
+  for (char **var = environ; *var; ++var)
+    env.push_back(*var);
+  return env;
+}
+
+void setEnvironment(const std::vector<std::string> &env) {
+  // Leaked, the strings become part of the environment.
+  auto vars = new char *[env.size() + 1];
+  for (size_t i = 0; i < env.size(); ++i)
+    vars[i] = strdup(env[i].c_str());
+  vars[env.size()] = nullptr;
+  environ = vars;
+}
+
+int connectToSocket(const char *path) {
+  sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+  if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool sendRequest(int socket, const Request &request, llvm::ArrayRef<int> fds) {
+  std::string payload;
+  appendString(payload, request.cwd);
+  appendStrings(payload, request.args);
+  appendStrings(payload, request.env);
+  if (payload.size() > maxPayloadSize || fds.size() > maxFds)
+    return false;
+
+  char header[headerSize];
+  memcpy(header, magic, sizeof(magic));
+  const uint32_t payloadSize = payload.size();
+  memcpy(header + sizeof(magic), &payloadSize, sizeof(payloadSize));
+
+  iovec iov;
+  iov.iov_base = header;
+  iov.iov_len = headerSize;
+  alignas(cmsghdr) char control[CMSG_SPACE(maxFds * sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    const size_t fdsSize = fds.size() * sizeof(int);
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fdsSize);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdsSize);
+    memcpy(CMSG_DATA(cmsg), fds.data(), fdsSize);
+  }
+
+  ssize_t n;
+  do {
+    n = sendmsg(socket, &msg, sendFlags);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+
+  // The file descriptors have been sent with the first byte.
+  return sendAll(socket, header + n, headerSize - n) &&
+         sendAll(socket, payload.data(), payload.size());
+}
+
+bool receiveRequest(int socket, Request &request,
+                    llvm::SmallVectorImpl<int> &fds) {
+  char header[headerSize];
+  iovec iov;
+  iov.iov_base = header;
+  iov.iov_len = headerSize;
+  alignas(cmsghdr) char control[CMSG_SPACE(maxFds * sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n;
+  do {
+    n = recvmsg(socket, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      const size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int *received = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+      fds.append(received, received + count);
+    }
+  }
+
+  uint32_t payloadSize;
+  if ((msg.msg_flags & MSG_CTRUNC) ||
+      !receiveAll(socket, header + n, headerSize - n) ||
+      memcmp(header, magic, sizeof(magic)) != 0) {
+    return false;
+  }
+  memcpy(&payloadSize, header + sizeof(magic), sizeof(payloadSize));
+  if (payloadSize > maxPayloadSize)
+    return false;
+
+  std::string payload(payloadSize, '\0');
+  if (!receiveAll(socket, &payload[0], payloadSize))
+    return false;
+
+  llvm::StringRef data = payload;
+  return readString(data, request.cwd) && readStrings(data, request.args) &&
+         readStrings(data, request.env) && !request.args.empty() &&
+         data.empty();
+}
+
+bool sendExitStatus(int socket, int exitStatus) {
+  const int32_t status = exitStatus;
+  return sendAll(socket, reinterpret_cast<const char *>(&status),
+                 sizeof(status));
+}
+
+bool receiveExitStatus(int socket, int &exitStatus) {
+  int32_t status;
+  if (!receiveAll(socket, reinterpret_cast<char *>(&status), sizeof(status)))
+    return false;
+  exitStatus = status;
+  return true;
+}
+
+} // namespace server
+
+#endif // LDC_POSIX
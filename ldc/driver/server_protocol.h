@@ -0,0 +1,68 @@
+//===-- driver/server_protocol.h --------------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Wire protocol between LDC's compile server (`ldc2 -server`) and its clients
+// (LDMD), shared by both executables.
+//
+// A client sends a request - its working directory, command line and
+// environment - together with its stdin, stdout and stderr file descriptors
+// over a Unix domain socket. The compiler process started for the request
+// writes to these directly; once it has finished, the server replies with its
+// exit status.
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include <string>
+#include <vector>
+
+namespace server {
+
+/// Environment variable holding the socket path of the compile server LDMD
+/// forwards its compiles to.
+constexpr const char *socketEnvVar = "LDC_SERVER_SOCKET";
+
+/// A compile request.
+struct Request {
+  std::string cwd;
+  /// The command line, including the program name.
+  std::vector<std::string> args;
+  /// `NAME=value` pairs.
+  std::vector<std::string> env;
+};
+
+#if LDC_POSIX
+
+/// Returns the environment of the current process.
+std::vector<std::string> getEnvironment();
+
+/// Replaces the environment of the current process.
+void setEnvironment(const std::vector<std::string> &env);
+
+/// Connects to the Unix domain socket at `path`. Returns -1 on errors.
+int connectToSocket(const char *path);
+
+/// Sends the request with the given file descriptors attached.
+bool sendRequest(int socket, const Request &request, llvm::ArrayRef<int> fds);
+
+/// Receives a request and the attached file descriptors (at most 4), which
+/// the caller takes ownership of. Returns false on errors or if the peer has
+/// closed the connection.
+bool receiveRequest(int socket, Request &request,
+                    llvm::SmallVectorImpl<int> &fds);
+
+bool sendExitStatus(int socket, int exitStatus);
+bool receiveExitStatus(int socket, int &exitStatus);
+
+#endif // LDC_POSIX
+
+} // namespace server
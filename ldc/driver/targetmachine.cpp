@@ -659,6 +659,13 @@ createTargetMachine(const std::string targetTriple, const std::string arch,
                                      codeGenOptLevel);
 }
 
+llvm::TargetMachine *cloneTargetMachine(const llvm::TargetMachine &tm) {
+  return tm.getTarget().createTargetMachine(
+      tm.getTargetTriple().str(), tm.getTargetCPU(),
+      tm.getTargetFeatureString(), tm.Options, tm.getRelocationModel(),
+      tm.getCodeModel(), tm.getOptLevel());
+}
+
 ComputeBackend::Type getComputeTargetType(llvm::Module* m) {
   llvm::Triple::ArchType a = llvm::Triple(m->getTargetTriple()).getArch();
   if (a == llvm::Triple::spir || a == llvm::Triple::spir64)
@@ -69,6 +69,13 @@ createTargetMachine(std::string targetTriple, std::string arch, std::string cpu,
                     llvm::CodeGenOpt::Level codeGenOptLevel,
                     bool noLinkerStripDead);
 
+/**
+ * Creates a new TargetMachine with the same target, CPU, features and options
+ * as the given one. LLVM target machines must not be shared across threads
+ * running codegen concurrently, so each codegen worker uses its own clone.
+ */
+llvm::TargetMachine *cloneTargetMachine(const llvm::TargetMachine &tm);
+
 /**
  * Returns the Mips ABI which is used for code generation.
  *
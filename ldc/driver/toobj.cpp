@@ -10,6 +10,8 @@
 #include "driver/toobj.h"
 
 #include "dmd/errors.h"
+#include "dmd/root/rmem.h"
+#include "dmd/target.h"
 #include "driver/cl_options.h"
 #include "driver/cache.h"
 #include "driver/targetmachine.h"
@@ -23,7 +25,10 @@
 #include "llvm/IR/Verifier.h"
 #include "llvm/Analysis/ModuleSummaryAnalysis.h"
 #include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
@@ -36,12 +41,14 @@
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/CodeGen/TargetSubtargetInfo.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
 #include "llvm/IR/Module.h"
 #ifdef LDC_LLVM_SUPPORTED_TARGET_SPIRV
 #if LDC_LLVM_VER < 1600
 #include "LLVMSPIRVLib/LLVMSPIRVLib.h"
 #endif
 #endif
+#include <chrono>
 #include <cstddef>
 #include <fstream>
 
@@ -61,6 +68,20 @@ bool getDisableIntegratedAS();
 #define NoIntegratedAssembler llvm::codegen::getDisableIntegratedAS()
 #endif
 
+static llvm::cl::opt<unsigned> codegenPartitions(
+    "codegen-partitions", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("Split optimized modules into <N> partitions for machine "
+                   "code generation in parallel threads, e.g., for -singleobj "
+                   "(0: one per hardware core, default: 1)"),
+    llvm::cl::value_desc("N"), llvm::cl::init(1));
+
+static llvm::cl::opt<bool> separatePartitionObjects(
+    "separate-partition-objects", llvm::cl::ZeroOrMore,
+    llvm::cl::desc("With -codegen-partitions, emit a separate object file per "
+                   "partition (<object>.part<i><ext>) instead of merging them "
+                   "into one relocatable object file (the only option for "
+                   "targets other than ELF and Mach-O)"));
+
 namespace {
 
 // The dllimport relocation pass on Windows is *not* an optimization pass.
@@ -74,6 +95,37 @@ void runDLLImportRelocationPass(llvm::TargetMachine &Target, llvm::Module &m) {
 }
 
 // based on llc code, University of Illinois Open Source License
+void runCodegenPasses(llvm::TargetMachine &Target, llvm::Module &m,
+                      llvm::raw_pwrite_stream &out, CodeGenFileType fileType) {
+  using namespace llvm;
+
+  // The DataLayout is already set at the module (in module.cpp,
+  // method Module::genLLVMModule())
+  // FIXME: Introduce new command line switch default-data-layout to
+  // override the module data layout
+
+  // Create a PassManager to hold and optimize the collection of passes we are
+  // about to build.
+  legacy::PassManager Passes;
+
+  // Add internal analysis passes from the target machine.
+  Passes.add(
+      createTargetTransformInfoWrapperPass(Target.getTargetIRAnalysis()));
+
+  // Add an appropriate TargetLibraryInfo pass for the module's triple.
+  auto tlii = createTLII(m);
+  Passes.add(new llvm::TargetLibraryInfoWrapperPass(*tlii));
+
+  if (Target.addPassesToEmitFile(Passes,
+                                 out,     // Output file
+                                 nullptr, // DWO output file
+                                 fileType, codeGenOptLevel())) {
+    llvm_unreachable("no support for asm output");
+  }
+
+  Passes.run(m);
+}
+
 void codegenModule(llvm::TargetMachine &Target, llvm::Module &m,
                    const char *filename,
                    CodeGenFileType fileType) {
@@ -104,35 +156,11 @@ void codegenModule(llvm::TargetMachine &Target, llvm::Module &m,
     fatal();
   }
 
-  // The DataLayout is already set at the module (in module.cpp,
-  // method Module::genLLVMModule())
-  // FIXME: Introduce new command line switch default-data-layout to
-  // override the module data layout
-
-  // Create a PassManager to hold and optimize the collection of passes we are
-  // about to build.
-  legacy::PassManager Passes;
-
-  // Add internal analysis passes from the target machine.
-  Passes.add(
-      createTargetTransformInfoWrapperPass(Target.getTargetIRAnalysis()));
-
-  // Add an appropriate TargetLibraryInfo pass for the module's triple.
-  auto tlii = createTLII(m);
-  Passes.add(new llvm::TargetLibraryInfoWrapperPass(*tlii));
-
-  if (Target.addPassesToEmitFile(
-          Passes,
-          out.os(), // Output file
-          nullptr,  // DWO output file
-          // Always generate assembly for ptx as it is an assembly format
-          // The PTX backend fails if we pass anything else.
-          (cb == ComputeBackend::NVPTX) ? CGFT_AssemblyFile : fileType,
-          codeGenOptLevel())) {
-    llvm_unreachable("no support for asm output");
-  }
-
-  Passes.run(m);
+  // Always generate assembly for ptx as it is an assembly format
+  // The PTX backend fails if we pass anything else.
+  runCodegenPasses(Target, m, out.os(),
+                   cb == ComputeBackend::NVPTX ? CGFT_AssemblyFile
+                                               : fileType);
 
   // Terminate upon errors during the LLVM passes.
   if (global.errors || global.warnings) {
@@ -292,6 +320,99 @@ void writeObjectFile(llvm::Module *m, const char *filename) {
                 CGFT_ObjectFile);
 }
 
+// Links the given object files into a single relocatable object file.
+void linkRelocatable(const std::vector<std::string> &objpaths,
+                     const std::string &objpath) {
+  std::vector<std::string> args;
+  args.push_back("-r");
+  args.push_back("-nostdlib");
+  args.insert(args.end(), objpaths.begin(), objpaths.end());
+  args.push_back("-o");
+  args.push_back(objpath);
+
+  appendTargetArgsForGcc(args);
+
+  int R = executeToolAndWait(Loc(), getGcc(), args, global.params.v.verbose);
+  if (R) {
+    error(Loc(), "Error while merging object files into '%s'.",
+          objpath.c_str());
+    fatal();
+  }
+}
+
+// Merging object files relies on the linker's relocatable output.
+bool canLinkRelocatable() {
+  const auto &triple = *global.params.targetTriple;
+  return triple.isOSBinFormatELF() || triple.isOSBinFormatMachO();
+}
+
+bool canCacheFragments() {
+  return cache::numFragments() > 0 && canLinkRelocatable();
+}
+
+// Writes the object file for the optimized module `m` by splitting it into
+// fragments, recovering the cached fragment objects and only codegen'ing the
+// others (which are added to the cache).
+void writeObjectFileViaFragmentCache(llvm::Module *m, const char *filename) {
+  std::vector<std::string> fragmentObjects;
+  unsigned numHits = 0;
+  {
+    ::TimeTraceScope timeScope("Codegen module fragments", filename);
+    cache::splitIntoFragments(*m, [&](std::unique_ptr<llvm::Module> fragment) {
+      llvm::SmallString<32> hash;
+      cache::calculateModuleHash(fragment.get(), hash);
+      // The fragment objects are retrieved like whole-module ones (e.g., as
+      // hard links or decompressed copies) and removed after linking.
+      llvm::SmallString<128> tempFile;
+      if (auto ec = llvm::sys::fs::createTemporaryFile(
+              "ldc-fragment",
+              llvm::StringRef(target.obj_ext.ptr, target.obj_ext.length),
+              tempFile)) {
+        error(Loc(), "could not create temporary file: %s",
+              ec.message().c_str());
+        fatal();
+      }
+      if (!cache::cacheLookup(hash).empty()) {
+        ++numHits;
+        cache::recoverObjectFile(hash, tempFile);
+      } else {
+        const auto start = std::chrono::steady_clock::now();
+        codegenModule(*gTargetMachine, *fragment, tempFile.c_str(),
+                      CGFT_ObjectFile);
+        cache::cacheObjectFile(
+            tempFile, hash,
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start));
+      }
+      fragmentObjects.push_back(tempFile.str().str());
+    });
+  }
+
+  const unsigned numFragments = fragmentObjects.size();
+  IF_LOG Logger::println("%u of %u module fragments found in cache", numHits,
+                         numFragments);
+  if (global.params.v.verbose) {
+    message("fragments %s (%u of %u cached)", filename, numHits,
+            numFragments);
+  }
+
+  ::TimeTraceScope timeScope("Link module fragments", filename);
+  llvm::sys::fs::remove(filename);
+  if (numFragments == 1) {
+    if (auto ec = llvm::sys::fs::copy_file(fragmentObjects[0], filename)) {
+      error(Loc(), "cannot write file '%s': %s", filename,
+            ec.message().c_str());
+      fatal();
+    }
+  } else {
+    linkRelocatable(fragmentObjects, filename);
+  }
+
+  for (const auto &fragmentObject : fragmentObjects) {
+    llvm::sys::fs::remove(fragmentObject);
+  }
+}
+
 bool shouldAssembleExternally() {
   // There is no integrated assembler on AIX because XCOFF is not supported.
   // Starting with LLVM 3.5 the integrated assembler can be used with MinGW.
@@ -303,6 +424,55 @@ bool shouldAssembleExternally() {
 bool shouldOutputObjectFile() {
   return global.params.output_o && !shouldAssembleExternally();
 }
+
+// Computes the cache hash of `m` and, if the cache contains a matching object
+// file, recovers it as `filename` and returns true.
+bool recoverFromCache(llvm::Module *m, const char *filename,
+                      llvm::SmallString<32> &moduleHash) {
+  ::TimeTraceScope timeScope("Check object cache", filename);
+  llvm::SmallString<128> cacheDir(opts::cacheDir.c_str());
+  llvm::sys::fs::make_absolute(cacheDir);
+  opts::cacheDir = cacheDir.c_str();
+
+  IF_LOG Logger::println("Use IR-to-Object cache in %s",
+                         opts::cacheDir.c_str());
+  LOG_SCOPE
+
+  cache::calculateModuleHash(m, moduleHash);
+  std::string cacheFile = cache::cacheLookup(moduleHash);
+  if (cacheFile.empty())
+    return false;
+
+  cache::recoverObjectFile(moduleHash, filename);
+  return true;
+}
+
+// Returns the number of partitions for the machine codegen of `m`'s object
+// file (1 if it isn't to be partitioned), and whether the partition objects
+// are to be merged.
+unsigned getNumCodegenPartitions(llvm::Module &m, bool useIR2ObjCache,
+                                 bool &mergePartitions) {
+  if (codegenPartitions == 1 ||
+      getComputeTargetType(&m) != ComputeBackend::None) {
+    return 1;
+  }
+
+  // Cached and temporary (-cleanup-obj) object files must be single files.
+  const bool needsSingleObject =
+      useIR2ObjCache || global.params.cleanupObjectFiles;
+  mergePartitions = canLinkRelocatable() &&
+                    (needsSingleObject || !separatePartitionObjects);
+  if (needsSingleObject && !mergePartitions)
+    return 1;
+
+  return codegenPartitions == 0
+             ? llvm::heavyweight_hardware_concurrency().compute_thread_count()
+             : codegenPartitions;
+}
+
+void writeObjectFileViaPartitions(llvm::Module &m, const char *filename,
+                                  unsigned numPartitions, bool merge,
+                                  const IRState *irs);
 } // end of anonymous namespace
 
 std::string replaceExtensionWith(const DArray<const char> &ext,
@@ -322,33 +492,30 @@ std::string replaceExtensionWith(const DArray<const char> &ext,
   return {buffer.data(), buffer.size()};
 }
 
-void writeModule(llvm::Module *m, const char *filename) {
+void writeModule(llvm::Module *m, const char *filename, const IRState *irs) {
   const bool doLTO = opts::isUsingLTO();
   const bool outputObj = shouldOutputObjectFile();
   const bool assembleExternally = shouldAssembleExternally();
 
-  // Use cached object code if possible.
-  // TODO: combine LDC's cache and LTO (the advantage is skipping the IR
-  // optimization).
-  const bool useIR2ObjCache = !opts::cacheDir.empty() && outputObj && !doLTO;
+  // With LTO, the object file is the optimized bitcode (incl. the ThinLTO
+  // summary), unless bitcode output was requested separately.
+  const bool emitBitcodeAsObjectFile =
+      doLTO && outputObj && !global.params.output_bc;
+
+  // Use cached object code if possible. With LTO, the cached 'object' is the
+  // optimized bitcode, so that only the IR optimization is skipped on a hit.
+  // As `-flto` is part of the hash, both kinds of entries can't be confused.
+  const bool useIR2ObjCache = !opts::cacheDir.empty() && outputObj &&
+                              (!doLTO || emitBitcodeAsObjectFile);
   llvm::SmallString<32> moduleHash;
-  if (useIR2ObjCache) {
-    ::TimeTraceScope timeScope("Check object cache", filename);
-    llvm::SmallString<128> cacheDir(opts::cacheDir.c_str());
-    llvm::sys::fs::make_absolute(cacheDir);
-    opts::cacheDir = cacheDir.c_str();
-
-    IF_LOG Logger::println("Use IR-to-Object cache in %s",
-                           opts::cacheDir.c_str());
-    LOG_SCOPE
-
-    cache::calculateModuleHash(m, moduleHash);
-    std::string cacheFile = cache::cacheLookup(moduleHash);
-    if (!cacheFile.empty()) {
-      cache::recoverObjectFile(moduleHash, filename);
-      return;
-    }
+  if (useIR2ObjCache && recoverFromCache(m, filename, moduleHash)) {
+    return;
   }
+  const auto codegenStart = std::chrono::steady_clock::now();
+  const auto codegenTime = [codegenStart] {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - codegenStart);
+  };
 
   // run LLVM optimization passes
   {
@@ -384,8 +551,6 @@ void writeModule(llvm::Module *m, const char *filename) {
   }
 
   // write LLVM bitcode
-  const bool emitBitcodeAsObjectFile =
-      doLTO && outputObj && !global.params.output_bc;
   if (global.params.output_bc || emitBitcodeAsObjectFile) {
     std::string bcpath = emitBitcodeAsObjectFile
                              ? filename
@@ -425,6 +590,10 @@ void writeModule(llvm::Module *m, const char *filename) {
     }
 
     bos.keep();
+
+    if (emitBitcodeAsObjectFile && useIR2ObjCache) {
+      cache::cacheObjectFile(bcpath, moduleHash, codegenTime());
+    }
   }
 
   // write LLVM IR
@@ -484,9 +653,346 @@ void writeModule(llvm::Module *m, const char *filename) {
   }
 
   if (writeObj) {
-    writeObjectFile(m, filename);
+    bool mergePartitions = false;
+    const unsigned numPartitions =
+        getNumCodegenPartitions(*m, useIR2ObjCache, mergePartitions);
+    if (useIR2ObjCache && canCacheFragments()) {
+      writeObjectFileViaFragmentCache(m, filename);
+    } else if (numPartitions > 1) {
+      writeObjectFileViaPartitions(*m, filename, numPartitions,
+                                   mergePartitions, irs);
+    } else {
+      writeObjectFile(m, filename);
+    }
     if (useIR2ObjCache) {
-      cache::cacheObjectFile(filename, moduleHash);
+      cache::cacheObjectFile(filename, moduleHash, codegenTime());
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool canWriteModulesInParallel() {
+  // Restricted to the common case of object files as only output, which
+  // doesn't need the frontend after IR generation.
+  return shouldOutputObjectFile() && !global.params.output_bc &&
+         !global.params.output_ll && !global.params.output_s &&
+         !global.params.output_mlir && !opts::isUsingLTO() &&
+         opts::saveOptimizationRecord.getNumOccurrences() == 0 &&
+         (opts::cacheDir.empty() || !canCacheFragments());
+}
+
+struct ParallelModuleWriter::Job {
+  std::string filename;
+  // The serialized module, freed as soon as a worker has parsed it.
+  llvm::SmallVector<char, 0> bitcode;
+  // Non-empty if the object file is to be added to the cache.
+  llvm::SmallString<32> cacheHash;
+  // Time taken by the worker, recorded in the cache.
+  std::chrono::microseconds codegenTime{0};
+  // `filename(line)` strings for the `srcloc` cookies of inline asm.
+  std::vector<std::string> inlineAsmLocs;
+  // Private clone of the global target machine.
+  std::unique_ptr<llvm::TargetMachine> target;
+  // False for the partitions of an already optimized module.
+  bool optimize = true;
+
+  // Diagnostics are buffered by the worker and reported by waitAll().
+  std::string diagnostics;
+  unsigned numErrors = 0;
+  unsigned numWarnings = 0;
+
+  void addError(const llvm::Twine &msg) {
+    diagnostics += ("error: " + msg + "\n").str();
+    ++numErrors;
+  }
+
+  bool failed() const {
+    return numErrors ||
+           (numWarnings && global.params.warnings == DIAGNOSTICerror);
+  }
+
+  void run(bool discardValueNames);
+};
+
+namespace {
+// Buffers LLVM diagnostics of a worker's LLVMContext in its job.
+struct BufferingDiagnosticHandler : public llvm::DiagnosticHandler {
+  ParallelModuleWriter::Job &job;
+  BufferingDiagnosticHandler(ParallelModuleWriter::Job &job) : job(job) {}
+
+  // return false to defer to LLVMContext::diagnose() (for remarks only)
+  bool handleDiagnostics(const llvm::DiagnosticInfo &DI) override {
+    const auto severity = DI.getSeverity();
+    if (severity == llvm::DS_Remark)
+      return false;
+
+    if (severity == llvm::DS_Error) {
+      ++job.numErrors;
+    } else if (severity == llvm::DS_Warning) {
+      ++job.numWarnings;
+    }
+
+    llvm::raw_string_ostream os(job.diagnostics);
+#if LDC_LLVM_VER >= 1300
+    if (DI.getKind() == llvm::DK_SrcMgr) {
+      // Replace the `<inline asm>` dummy filename by the D source location,
+      // analogous to the InlineAsmDiagnosticHandler for serial codegen.
+      const auto &DISM = llvm::cast<llvm::DiagnosticInfoSrcMgr>(DI);
+      const llvm::SMDiagnostic &d = DISM.getSMDiag();
+      const unsigned cookie = DISM.getLocCookie();
+      if (cookie && cookie <= job.inlineAsmLocs.size()) {
+        llvm::SMDiagnostic d2(*d.getSourceMgr(), d.getLoc(),
+                              job.inlineAsmLocs[cookie - 1], d.getLineNo(),
+                              d.getColumnNo(), d.getKind(), d.getMessage(),
+                              d.getLineContents(), d.getRanges(),
+                              d.getFixIts());
+        d2.print(nullptr, os, /*ShowColors=*/false);
+      } else {
+        d.print(nullptr, os, /*ShowColors=*/false);
+      }
+      return true;
+    }
+#endif
+
+    llvm::DiagnosticPrinterRawOStream printer(os);
+    os << llvm::LLVMContext::getDiagnosticMessagePrefix(severity) << ": ";
+    DI.print(printer);
+    os << '\n';
+    return true;
+  }
+};
+} // anonymous namespace
+
+void ParallelModuleWriter::Job::run(bool discardValueNames) {
+  const auto start = std::chrono::steady_clock::now();
+  llvm::LLVMContext context;
+  context.setDiscardValueNames(discardValueNames);
+  context.setDiagnosticHandler(
+      std::make_unique<BufferingDiagnosticHandler>(*this));
+
+  auto moduleOrError = llvm::parseBitcodeFile(
+      llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()),
+                            filename),
+      context);
+  if (!moduleOrError) {
+    addError("cannot read back module for codegen: " +
+             llvm::toString(moduleOrError.takeError()));
+    return;
+  }
+  bitcode = {};
+  llvm::Module &m = **moduleOrError;
+
+  if (optimize) {
+    std::string verifyErrors;
+    ldc_optimize_module(&m, *target, verifyErrors);
+    if (!verifyErrors.empty()) {
+      addError(verifyErrors);
+      return;
+    }
+
+    if (global.params.dllimport != DLLImport::none) {
+      runDLLImportRelocationPass(*target, m);
+    }
+  }
+
+  if (failed())
+    return;
+
+  const auto directory = llvm::sys::path::parent_path(filename);
+  if (!directory.empty()) {
+    if (auto ec = llvm::sys::fs::create_directories(directory)) {
+      addError("failed to create output directory: " + directory + "\n" +
+               ec.message());
+      return;
+    }
+  }
+
+  std::error_code errinfo;
+  llvm::ToolOutputFile out(filename, errinfo, llvm::sys::fs::OF_None);
+  if (errinfo) {
+    addError("cannot write file '" + filename + "': " + errinfo.message());
+    return;
+  }
+
+  runCodegenPasses(*target, m, out.os(), CGFT_ObjectFile);
+
+  // Don't keep the object file upon errors during the LLVM passes.
+  if (!failed())
+    out.keep();
+
+  codegenTime = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+}
+
+namespace {
+void collectInlineAsmLocs(const IRState &irs,
+                          std::vector<std::string> &inlineAsmLocs) {
+  for (unsigned cookie = 1; cookie <= irs.numInlineAsmSrcLocs(); ++cookie) {
+    inlineAsmLocs.push_back(
+        irs.getInlineAsmSrcLoc(cookie).toChars(/*showColumns*/ false));
+  }
+}
+
+// Prints the buffered diagnostics of finished jobs in the given order and
+// adds their errors to the global counts. Returns whether any job failed.
+bool reportDiagnostics(
+    llvm::ArrayRef<std::unique_ptr<ParallelModuleWriter::Job>> jobs) {
+  bool anyFailed = false;
+  for (const auto &job : jobs) {
+    if (!job->diagnostics.empty()) {
+      llvm::errs() << job->diagnostics;
+    }
+    if (job->failed()) {
+      global.errors += job->numErrors;
+      if (global.params.warnings == DIAGNOSTICerror)
+        global.warnings += job->numWarnings;
+      anyFailed = true;
     }
   }
+  return anyFailed;
+}
+
+// Splits the optimized module `m` into partitions à la llvm::SplitModule (but
+// keeping local symbols together with their users, so that no symbols need to
+// be externalized), and emits their object files in parallel threads. These
+// are either linked into `filename` or added to the object files to be
+// linked, the first one being `filename` itself.
+void writeObjectFileViaPartitions(llvm::Module &m, const char *filename,
+                                  unsigned numPartitions, bool merge,
+                                  const IRState *irs) {
+  using Job = ParallelModuleWriter::Job;
+  const llvm::StringRef objExt(target.obj_ext.ptr, target.obj_ext.length);
+  std::vector<std::unique_ptr<Job>> jobs;
+
+  {
+    ::TimeTraceScope timeScope("Split module for parallel codegen", filename);
+    llvm::SplitModule(
+        m, numPartitions,
+        [&](std::unique_ptr<llvm::Module> partition) {
+          auto job = std::make_unique<Job>();
+          job->optimize = false;
+          if (merge) {
+            llvm::SmallString<128> tempFile;
+            if (auto ec = llvm::sys::fs::createTemporaryFile("ldc-partition",
+                                                             objExt, tempFile)) {
+              error(Loc(), "could not create temporary file: %s",
+                    ec.message().c_str());
+              fatal();
+            }
+            job->filename = tempFile.str().str();
+          } else if (jobs.empty()) {
+            job->filename = filename;
+          } else {
+            llvm::SmallString<128> path(filename);
+            llvm::sys::path::replace_extension(
+                path, "part" + llvm::Twine(jobs.size()) + "." + objExt);
+            job->filename = path.str().str();
+          }
+          if (irs) {
+            collectInlineAsmLocs(*irs, job->inlineAsmLocs);
+          }
+          job->target.reset(cloneTargetMachine(*gTargetMachine));
+
+          IF_LOG Logger::println("Module partition %u: %u functions",
+                                 static_cast<unsigned>(jobs.size()),
+                                 static_cast<unsigned>(partition->size()));
+          llvm::raw_svector_ostream os(job->bitcode);
+          llvm::WriteBitcodeToFile(*partition, os,
+                                   /*ShouldPreserveUseListOrder=*/true);
+          jobs.push_back(std::move(job));
+        },
+        /*PreserveLocals=*/true);
+  }
+
+  {
+    ::TimeTraceScope timeScope("Codegen module partitions", filename);
+    llvm::ThreadPool pool(llvm::hardware_concurrency(numPartitions));
+    const bool discardValueNames = m.getContext().shouldDiscardValueNames();
+    for (const auto &job : jobs) {
+      Job *jobPtr = job.get();
+      pool.async([jobPtr, discardValueNames] { jobPtr->run(discardValueNames); });
+    }
+    pool.wait();
+  }
+
+  if (reportDiagnostics(jobs)) {
+    Logger::println("Aborting because of errors/warnings during LLVM passes");
+    fatal();
+  }
+
+  if (merge) {
+    ::TimeTraceScope timeScope("Link module partitions", filename);
+    std::vector<std::string> partitionObjects;
+    for (const auto &job : jobs) {
+      partitionObjects.push_back(job->filename);
+    }
+    llvm::sys::fs::remove(filename);
+    linkRelocatable(partitionObjects, filename);
+    for (const auto &partitionObject : partitionObjects) {
+      llvm::sys::fs::remove(partitionObject);
+    }
+  } else {
+    for (size_t i = 1; i < jobs.size(); ++i) {
+      global.params.objfiles.push(mem.xstrdup(jobs[i]->filename.c_str()));
+    }
+  }
+}
+} // anonymous namespace
+
+ParallelModuleWriter::ParallelModuleWriter(unsigned numThreads)
+    : pool(numThreads == 0 ? llvm::heavyweight_hardware_concurrency()
+                           : llvm::hardware_concurrency(numThreads)) {}
+
+ParallelModuleWriter::~ParallelModuleWriter() { pool.wait(); }
+
+void ParallelModuleWriter::submit(IRState &irs, const char *filename) {
+  llvm::Module &m = irs.module;
+
+  auto job = std::make_unique<Job>();
+  job->filename = filename;
+
+  if (!opts::cacheDir.empty()) {
+    if (recoverFromCache(&m, filename, job->cacheHash))
+      return;
+  }
+
+  ::TimeTraceScope timeScope("Serialize module for parallel codegen",
+                             filename);
+
+  collectInlineAsmLocs(irs, job->inlineAsmLocs);
+  job->target.reset(cloneTargetMachine(*gTargetMachine));
+
+  {
+    llvm::raw_svector_ostream os(job->bitcode);
+    // Preserve the use-list order so that the generated code is identical to
+    // serial codegen.
+    llvm::WriteBitcodeToFile(m, os, /*ShouldPreserveUseListOrder=*/true);
+  }
+
+  Job *jobPtr = job.get();
+  const bool discardValueNames = m.getContext().shouldDiscardValueNames();
+  jobs.push_back(std::move(job));
+  pool.async([jobPtr, discardValueNames] { jobPtr->run(discardValueNames); });
+}
+
+void ParallelModuleWriter::waitAll() {
+  {
+    ::TimeTraceScope timeScope("Wait for parallel codegen");
+    pool.wait();
+  }
+
+  // Report in submission order, independent from the threads' scheduling.
+  const bool anyFailed = reportDiagnostics(jobs);
+  for (const auto &job : jobs) {
+    if (!job->failed() && !job->cacheHash.empty()) {
+      cache::cacheObjectFile(job->filename, job->cacheHash, job->codegenTime);
+    }
+  }
+  jobs.clear();
+
+  if (anyFailed) {
+    Logger::println("Aborting because of errors/warnings during LLVM passes");
+    fatal();
+  }
 }
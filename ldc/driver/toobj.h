@@ -12,14 +12,52 @@
 //===----------------------------------------------------------------------===//
 
 #pragma once
+#include <memory>
 #include <string>
+#include <vector>
 #include "dmd/root/dcompat.h"
+#include "llvm/Support/ThreadPool.h"
+
+struct IRState;
 
 namespace llvm {
 class Module;
 }
 
-void writeModule(llvm::Module *m, const char *filename);
+/// Optimizes `m` and writes the requested output files. `irs` (optional) is
+/// used for the source locations of inline asm diagnostics.
+void writeModule(llvm::Module *m, const char *filename,
+                 const IRState *irs = nullptr);
+
+/// Returns whether the chosen outputs allow offloading writeModule() to a
+/// ParallelModuleWriter.
+bool canWriteModulesInParallel();
+
+/// Optimizes and emits finished LLVM modules as object files on a pool of
+/// worker threads (`-j`), while IR generation continues on the main thread.
+/// Each module is handed over as bitcode and parsed into a separate
+/// LLVMContext. Diagnostics are buffered per module and reported in
+/// submission order, so that the output doesn't depend on thread scheduling.
+class ParallelModuleWriter {
+public:
+  /// A `numThreads` of 0 means one thread per hardware core.
+  explicit ParallelModuleWriter(unsigned numThreads);
+  ~ParallelModuleWriter();
+
+  /// Like writeModule(), but asynchronous. The module is serialized before
+  /// returning and can be freed by the caller.
+  void submit(IRState &irs, const char *filename);
+
+  /// Waits for all submitted modules, reports their diagnostics and adds the
+  /// objects to the cache. Terminates compilation upon errors.
+  void waitAll();
+
+  struct Job;
+
+private:
+  llvm::ThreadPool pool;
+  std::vector<std::unique_ptr<Job>> jobs;
+};
 
 std::string replaceExtensionWith(const DArray<const char> &ext,
                                  const char *filename);
@@ -19,10 +19,12 @@
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
 #include "gen/logger.h"
+#include "gen/optimizer.h"
 #include "gen/runtime.h"
 #include "gen/tollvm.h"
 #include "ir/irfunction.h"
 #include "ir/irmodule.h"
+#include "llvm/IR/IRBuilder.h"
 
 // returns the keytype typeinfo
 static LLConstant *to_keyti(const Loc &loc, DValue *aa, LLType *targetType) {
@@ -35,6 +37,321 @@ static LLConstant *to_keyti(const Loc &loc, DValue *aa, LLType *targetType) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// When optimizing, lookups with keys of integral types (incl. enums and bool)
+// and arrays of these don't call into druntime, but probe the hash table
+// directly, with the hashing and key comparison specialized for the key type
+// (matching the key TypeInfo's getHash() and equals()).
+// This depends on the AA implementation in druntime's rt/aaA.d:
+//
+//   struct Impl {
+//     Bucket[] buckets; uint used; uint deleted; TypeInfo_Struct entryTI;
+//     uint firstUsed; uint keysz; uint valsz; uint valoff; ...
+//   }
+//   struct Bucket { size_t hash; void* entry; }
+//
+// with the key at offset 0 of an entry, and the value at offset valoff.
+
+namespace {
+// Signed integral keys are sign-extended for hashing, like druntime's hashOf().
+enum class AAKeyKind {
+  unsupported,
+  integral,
+  signedIntegral,
+  integralArray
+};
+
+// Returns the kind of the key type and its (element) size in bytes.
+AAKeyKind getAAKeyKind(Type *keyType, unsigned &size) {
+  Type *t = keyType->toBasetype();
+  if (t->ty == TY::Tarray) {
+    Type *elemType = t->nextOf()->toBasetype();
+    if (!elemType->isintegral() || elemType->ty == TY::Tvector)
+      return AAKeyKind::unsupported;
+    size = elemType->size();
+    return size <= 8 ? AAKeyKind::integralArray : AAKeyKind::unsupported;
+  }
+  if (!t->isintegral() || t->ty == TY::Tvector)
+    return AAKeyKind::unsupported;
+  size = t->size();
+  if (size > 8)
+    return AAKeyKind::unsupported;
+  return t->isunsigned() ? AAKeyKind::integral : AAKeyKind::signedIntegral;
+}
+
+llvm::Value *rotl32(llvm::IRBuilder<> &b, llvm::Value *v, unsigned n) {
+  return b.CreateOr(b.CreateShl(v, n), b.CreateLShr(v, 32 - n));
+}
+
+// Emits druntime's bytesHash() (32-bit MurmurHash3 with seed 0) of the
+// `nbytes` bytes at `ptr`.
+llvm::Value *emitBytesHash(llvm::IRBuilder<> &b, llvm::Value *ptr,
+                           llvm::Value *nbytes) {
+  llvm::Function *fn = b.GetInsertBlock()->getParent();
+  auto &ctx = fn->getContext();
+  LLType *i8Ty = LLType::getInt8Ty(ctx);
+  LLType *i32Ty = LLType::getInt32Ty(ctx);
+  LLType *sizeTy = nbytes->getType();
+  const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593, c3 = 0xe6546b64;
+
+  auto mixK1 = [&](llvm::Value *k1) {
+    k1 = b.CreateMul(k1, b.getInt32(c1));
+    k1 = rotl32(b, k1, 15);
+    return b.CreateMul(k1, b.getInt32(c2));
+  };
+
+  // body: 4-byte blocks
+  llvm::BasicBlock *entryBB = b.GetInsertBlock();
+  auto blocksBB = llvm::BasicBlock::Create(ctx, "hash.blocks", fn);
+  auto blockBB = llvm::BasicBlock::Create(ctx, "hash.block", fn);
+  auto tailBB = llvm::BasicBlock::Create(ctx, "hash.tail", fn);
+  auto tail2BB = llvm::BasicBlock::Create(ctx, "hash.tail2", fn);
+  auto tail3BB = llvm::BasicBlock::Create(ctx, "hash.tail3", fn);
+  auto tailMixBB = llvm::BasicBlock::Create(ctx, "hash.tailmix", fn);
+  auto finBB = llvm::BasicBlock::Create(ctx, "hash.fin", fn);
+
+  ptr = b.CreateBitCast(ptr, getPtrToType(i8Ty));
+  llvm::Value *end = b.CreateGEP(
+      i8Ty, ptr, b.CreateAnd(nbytes, llvm::ConstantInt::get(sizeTy, ~3ULL)));
+  b.CreateBr(blocksBB);
+
+  b.SetInsertPoint(blocksBB);
+  llvm::PHINode *data = b.CreatePHI(ptr->getType(), 2);
+  llvm::PHINode *h1 = b.CreatePHI(i32Ty, 2);
+  data->addIncoming(ptr, entryBB);
+  h1->addIncoming(b.getInt32(0), entryBB);
+  b.CreateCondBr(b.CreateICmpEQ(data, end), tailBB, blockBB);
+
+  b.SetInsertPoint(blockBB);
+  // druntime reads the blocks as native-endian integers
+  llvm::Value *k1 = b.CreateAlignedLoad(
+      i32Ty, b.CreateBitCast(data, getPtrToType(i32Ty)), llvm::MaybeAlign(1));
+  llvm::Value *h = b.CreateXor(h1, mixK1(k1));
+  h = rotl32(b, h, 13);
+  h = b.CreateAdd(b.CreateMul(h, b.getInt32(5)), b.getInt32(c3));
+  data->addIncoming(b.CreateGEP(i8Ty, data, b.getInt32(4)), blockBB);
+  h1->addIncoming(h, blockBB);
+  b.CreateBr(blocksBB);
+
+  // tail: the remaining 1-3 bytes
+  auto loadByte = [&](unsigned i, unsigned shift) {
+    llvm::Value *byte = b.CreateLoad(i8Ty, b.CreateGEP(i8Ty, data, b.getInt32(i)));
+    return b.CreateShl(b.CreateZExt(byte, i32Ty), shift);
+  };
+  b.SetInsertPoint(tailBB);
+  llvm::Value *rem = b.CreateTrunc(
+      b.CreateAnd(nbytes, llvm::ConstantInt::get(sizeTy, 3)), i32Ty);
+  auto tail1BB = llvm::BasicBlock::Create(ctx, "hash.tail1", fn, tail2BB);
+  b.CreateCondBr(b.CreateICmpEQ(rem, b.getInt32(0)), finBB, tail1BB);
+
+  b.SetInsertPoint(tail1BB);
+  llvm::Value *t1 = loadByte(0, 0);
+  b.CreateCondBr(b.CreateICmpUGE(rem, b.getInt32(2)), tail2BB, tailMixBB);
+
+  b.SetInsertPoint(tail2BB);
+  llvm::Value *t2 = b.CreateOr(t1, loadByte(1, 8));
+  b.CreateCondBr(b.CreateICmpEQ(rem, b.getInt32(3)), tail3BB, tailMixBB);
+
+  b.SetInsertPoint(tail3BB);
+  llvm::Value *t3 = b.CreateOr(t2, loadByte(2, 16));
+  b.CreateBr(tailMixBB);
+
+  b.SetInsertPoint(tailMixBB);
+  llvm::PHINode *tk1 = b.CreatePHI(i32Ty, 3);
+  tk1->addIncoming(t1, tail1BB);
+  tk1->addIncoming(t2, tail2BB);
+  tk1->addIncoming(t3, tail3BB);
+  llvm::Value *tailH = b.CreateXor(h1, mixK1(tk1));
+  b.CreateBr(finBB);
+
+  // finalization
+  b.SetInsertPoint(finBB);
+  llvm::PHINode *fh = b.CreatePHI(i32Ty, 2);
+  fh->addIncoming(h1, tailBB);
+  fh->addIncoming(tailH, tailMixBB);
+  h = b.CreateXor(fh, b.CreateTrunc(nbytes, i32Ty));
+  h = b.CreateMul(b.CreateXor(h, b.CreateLShr(h, 16)), b.getInt32(0x85ebca6b));
+  h = b.CreateMul(b.CreateXor(h, b.CreateLShr(h, 13)), b.getInt32(0xc2b2ae35));
+  h = b.CreateXor(h, b.CreateLShr(h, 16));
+  return b.CreateZExt(h, sizeTy);
+}
+
+// Returns a module-internal function `void* (void* impl, const void* pkey)`
+// returning a pointer to the value for the key, or null if not present.
+llvm::Function *getAALookupFunction(AAKeyKind kind, unsigned size) {
+  const char *prefix = kind == AAKeyKind::integral         ? "ldc.aa.lookup.u"
+                       : kind == AAKeyKind::signedIntegral ? "ldc.aa.lookup.i"
+                                                           : "ldc.aa.lookup.ai";
+  const std::string name = prefix + std::to_string(size * 8);
+  if (auto fn = gIR->module.getFunction(name))
+    return fn;
+
+  auto &ctx = gIR->context();
+  LLType *voidPtrTy = getVoidPtrType();
+  LLType *i8Ty = LLType::getInt8Ty(ctx);
+  LLType *i32Ty = LLType::getInt32Ty(ctx);
+  LLIntegerType *sizeTy = DtoSize_t();
+  const unsigned sizeBits = sizeTy->getBitWidth();
+  // Bucket, and D slices
+  LLStructType *pairTy = LLStructType::get(ctx, {sizeTy, voidPtrTy});
+  LLStructType *implTy = LLStructType::get(
+      ctx, {sizeTy, voidPtrTy, i32Ty, i32Ty, voidPtrTy, i32Ty, i32Ty, i32Ty,
+            i32Ty});
+  const unsigned bucketsLengthIdx = 0, bucketsPtrIdx = 1, valoffIdx = 8;
+
+  auto fnTy = LLFunctionType::get(voidPtrTy, {voidPtrTy, voidPtrTy}, false);
+  auto fn = llvm::Function::Create(fnTy, llvm::GlobalValue::InternalLinkage,
+                                   name, &gIR->module);
+  fn->setDoesNotThrow();
+  fn->setOnlyReadsMemory();
+
+  auto entryBB = llvm::BasicBlock::Create(ctx, "entry", fn);
+  auto hashBB = llvm::BasicBlock::Create(ctx, "hash", fn);
+  llvm::IRBuilder<> b(entryBB);
+
+  llvm::Value *impl = b.CreateBitCast(fn->getArg(0), getPtrToType(implTy));
+  llvm::Value *pkey = fn->getArg(1);
+  auto notFoundBB = llvm::BasicBlock::Create(ctx, "notfound", fn);
+  b.CreateCondBr(b.CreateIsNull(impl), notFoundBB, hashBB);
+
+  // hash the key
+  b.SetInsertPoint(hashBB);
+  llvm::Value *keyVal = nullptr, *keyLength = nullptr, *keyPtr = nullptr,
+              *keyBytes = nullptr, *hash;
+  LLType *keyTy = LLType::getIntNTy(ctx, size * 8);
+  const bool isIntegral = kind != AAKeyKind::integralArray;
+  if (isIntegral) {
+    keyVal = b.CreateLoad(keyTy, b.CreateBitCast(pkey, getPtrToType(keyTy)));
+    if (size * 8 <= sizeBits) {
+      hash = kind == AAKeyKind::signedIntegral ? b.CreateSExt(keyVal, sizeTy)
+                                               : b.CreateZExt(keyVal, sizeTy);
+    } else {
+      hash = b.CreateTrunc(b.CreateXor(keyVal, b.CreateLShr(keyVal, sizeBits)),
+                           sizeTy);
+    }
+  } else {
+    llvm::Value *slice = b.CreateBitCast(pkey, getPtrToType(pairTy));
+    keyLength = b.CreateLoad(sizeTy, b.CreateStructGEP(pairTy, slice, 0));
+    keyPtr = b.CreateLoad(voidPtrTy, b.CreateStructGEP(pairTy, slice, 1));
+    keyBytes = b.CreateMul(keyLength, llvm::ConstantInt::get(sizeTy, size));
+    hash = emitBytesHash(b, keyPtr, keyBytes);
+  }
+
+  // mix(), and mark as filled bucket (highest bit set)
+  hash = b.CreateXor(hash, b.CreateLShr(hash, 13));
+  hash = b.CreateMul(hash, llvm::ConstantInt::get(sizeTy, 0x5bd1e995));
+  hash = b.CreateXor(hash, b.CreateLShr(hash, 15));
+  hash = b.CreateOr(hash, llvm::ConstantInt::get(
+                              sizeTy, llvm::APInt::getSignMask(sizeBits)));
+
+  llvm::Value *numBuckets = b.CreateLoad(
+      sizeTy, b.CreateStructGEP(implTy, impl, bucketsLengthIdx));
+  llvm::Value *buckets =
+      b.CreateBitCast(b.CreateLoad(voidPtrTy, b.CreateStructGEP(
+                                                  implTy, impl, bucketsPtrIdx)),
+                      getPtrToType(pairTy));
+  llvm::Value *mask = b.CreateSub(numBuckets, llvm::ConstantInt::get(sizeTy, 1));
+  llvm::Value *firstIndex = b.CreateAnd(hash, mask);
+  llvm::BasicBlock *hashEndBB = b.GetInsertBlock();
+
+  // probe the buckets
+  auto probeBB = llvm::BasicBlock::Create(ctx, "probe", fn, notFoundBB);
+  auto compareBB = llvm::BasicBlock::Create(ctx, "compare", fn, notFoundBB);
+  auto checkEmptyBB = llvm::BasicBlock::Create(ctx, "checkempty", fn, notFoundBB);
+  auto nextBB = llvm::BasicBlock::Create(ctx, "next", fn, notFoundBB);
+  auto foundBB = llvm::BasicBlock::Create(ctx, "found", fn, notFoundBB);
+  b.CreateBr(probeBB);
+
+  b.SetInsertPoint(probeBB);
+  llvm::PHINode *index = b.CreatePHI(sizeTy, 2, "i");
+  llvm::PHINode *step = b.CreatePHI(sizeTy, 2, "j");
+  index->addIncoming(firstIndex, hashEndBB);
+  step->addIncoming(llvm::ConstantInt::get(sizeTy, 1), hashEndBB);
+  llvm::Value *bucket = b.CreateGEP(pairTy, buckets, index);
+  llvm::Value *bucketHash =
+      b.CreateLoad(sizeTy, b.CreateStructGEP(pairTy, bucket, 0));
+  b.CreateCondBr(b.CreateICmpEQ(bucketHash, hash), compareBB, checkEmptyBB);
+
+  // compare the keys
+  b.SetInsertPoint(compareBB);
+  llvm::Value *entry =
+      b.CreateLoad(voidPtrTy, b.CreateStructGEP(pairTy, bucket, 1));
+  if (isIntegral) {
+    llvm::Value *entryKey =
+        b.CreateLoad(keyTy, b.CreateBitCast(entry, getPtrToType(keyTy)));
+    b.CreateCondBr(b.CreateICmpEQ(entryKey, keyVal), foundBB, checkEmptyBB);
+  } else {
+    auto compareDataBB =
+        llvm::BasicBlock::Create(ctx, "comparedata", fn, checkEmptyBB);
+    auto memcmpBB = llvm::BasicBlock::Create(ctx, "memcmp", fn, checkEmptyBB);
+    llvm::Value *entrySlice = b.CreateBitCast(entry, getPtrToType(pairTy));
+    llvm::Value *entryLength =
+        b.CreateLoad(sizeTy, b.CreateStructGEP(pairTy, entrySlice, 0));
+    b.CreateCondBr(b.CreateICmpEQ(entryLength, keyLength), compareDataBB,
+                   checkEmptyBB);
+
+    b.SetInsertPoint(compareDataBB);
+    b.CreateCondBr(b.CreateIsNull(keyBytes), foundBB, memcmpBB);
+
+    b.SetInsertPoint(memcmpBB);
+    llvm::Value *entryPtr =
+        b.CreateLoad(voidPtrTy, b.CreateStructGEP(pairTy, entrySlice, 1));
+    auto memcmpFn = gIR->module.getOrInsertFunction(
+        "memcmp", LLFunctionType::get(i32Ty, {voidPtrTy, voidPtrTy, sizeTy},
+                                      false));
+    llvm::Value *cmp = b.CreateCall(memcmpFn, {keyPtr, entryPtr, keyBytes});
+    b.CreateCondBr(b.CreateIsNull(cmp), foundBB, checkEmptyBB);
+  }
+
+  // stop at the first empty bucket
+  b.SetInsertPoint(checkEmptyBB);
+  b.CreateCondBr(b.CreateIsNull(bucketHash), notFoundBB, nextBB);
+
+  // quadratic probing
+  b.SetInsertPoint(nextBB);
+  index->addIncoming(b.CreateAnd(b.CreateAdd(index, step), mask), nextBB);
+  step->addIncoming(b.CreateAdd(step, llvm::ConstantInt::get(sizeTy, 1)),
+                    nextBB);
+  b.CreateBr(probeBB);
+
+  b.SetInsertPoint(foundBB);
+  llvm::Value *valoff = b.CreateZExt(
+      b.CreateLoad(i32Ty, b.CreateStructGEP(implTy, impl, valoffIdx)), sizeTy);
+  b.CreateRet(b.CreateGEP(i8Ty, entry, valoff));
+
+  b.SetInsertPoint(notFoundBB);
+  b.CreateRet(LLConstant::getNullValue(voidPtrTy));
+
+  return fn;
+}
+
+// Emits a specialized lookup if supported for the AA's key type, returning
+// the pointer to the value or null. Returns nullptr if not supported.
+// `aaval` is the AA itself, or a pointer to it if `isLValue`.
+LLValue *emitSpecializedAALookup(DValue *aa, LLValue *aaval, bool isLValue,
+                                 LLValue *pkey) {
+  if (!isOptimizationEnabled())
+    return nullptr;
+
+  auto aatype = static_cast<TypeAArray *>(aa->type->toBasetype());
+  unsigned size = 0;
+  const AAKeyKind kind = getAAKeyKind(aatype->index, size);
+  if (kind == AAKeyKind::unsupported)
+    return nullptr;
+
+  LLValue *impl = aaval;
+  if (isLValue) {
+    impl = DtoLoad(getVoidPtrType(),
+                   DtoBitCast(aaval, getPtrToType(getVoidPtrType())));
+  }
+  llvm::Function *fn = getAALookupFunction(kind, size);
+  return gIR->ir->CreateCall(fn, {DtoBitCast(impl, getVoidPtrType()),
+                                  DtoBitCast(pkey, getVoidPtrType())},
+                             "aa.lookup");
+}
+} // anonymous namespace
+
+////////////////////////////////////////////////////////////////////////////////
+
 DLValue *DtoAAIndex(const Loc &loc, Type *type, DValue *aa, DValue *key,
                     bool lvalue) {
   // D2:
@@ -57,15 +374,40 @@ DLValue *DtoAAIndex(const Loc &loc, Type *type, DValue *aa, DValue *key,
   LLValue *pkey = makeLValue(loc, key);
   pkey = DtoBitCast(pkey, funcTy->getParamType(lvalue ? 3 : 2));
 
+  // try the specialized lookup first
+  LLValue *found = emitSpecializedAALookup(aa, aaval, lvalue, pkey);
+
   // call runtime
   LLValue *ret;
   if (lvalue) {
+    // only needed for inserting the key if not found
+    llvm::BasicBlock *insertbb = nullptr, *endbb = nullptr, *foundbb = nullptr;
+    if (found) {
+      insertbb = gIR->insertBB("aa.insert");
+      endbb = gIR->insertBBAfter(insertbb, "aa.indexend");
+      foundbb = gIR->scopebb();
+      gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(found), insertbb, endbb);
+      gIR->ir->SetInsertPoint(insertbb);
+    }
+
     LLValue *rawAATI =
         DtoTypeInfoOf(loc, aa->type->unSharedOf()->mutableOf(), /*base=*/false);
     LLValue *castedAATI = DtoBitCast(rawAATI, funcTy->getParamType(1));
     LLValue *valsize = DtoConstSize_t(getTypeAllocSize(DtoType(type)));
     ret = gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
                                   "aa.index");
+
+    if (found) {
+      insertbb = gIR->scopebb();
+      gIR->ir->CreateBr(endbb);
+      gIR->ir->SetInsertPoint(endbb);
+      llvm::PHINode *phi = gIR->ir->CreatePHI(ret->getType(), 2, "aa.index");
+      phi->addIncoming(DtoBitCast(found, ret->getType()), foundbb);
+      phi->addIncoming(ret, insertbb);
+      ret = phi;
+    }
+  } else if (found) {
+    ret = found;
   } else {
     LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
     ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index");
@@ -85,7 +427,7 @@ DLValue *DtoAAIndex(const Loc &loc, Type *type, DValue *aa, DValue *key,
 
     LLValue *nullaa = LLConstant::getNullValue(ret->getType());
     LLValue *cond = gIR->ir->CreateICmpNE(nullaa, ret, "aaboundscheck");
-    gIR->ir->CreateCondBr(cond, okbb, failbb);
+    DtoCondBrToFailure(cond, okbb, failbb);
 
     // set up failbb to call the array bounds error runtime function
     gIR->ir->SetInsertPoint(failbb);
@@ -122,15 +464,16 @@ DValue *DtoAAIn(const Loc &loc, Type *type, DValue *aa, DValue *key) {
   }
   aaval = DtoBitCast(aaval, funcTy->getParamType(0));
 
-  // keyti param
-  LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
-
   // pkey param
   LLValue *pkey = makeLValue(loc, key);
   pkey = DtoBitCast(pkey, getVoidPtrType());
 
-  // call runtime
-  LLValue *ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.in");
+  // call runtime, unless the lookup can be specialized
+  LLValue *ret = emitSpecializedAALookup(aa, aaval, false, pkey);
+  if (!ret) {
+    LLValue *keyti = to_keyti(loc, aa, funcTy->getParamType(1));
+    ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.in");
+  }
 
   // cast return value
   LLType *targettype = DtoType(type);
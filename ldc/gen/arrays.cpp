@@ -1165,7 +1165,7 @@ void DtoIndexBoundsCheck(const Loc &loc, DValue *arr, DValue *index) {
 
   llvm::BasicBlock *okbb = gIR->insertBB("bounds.ok");
   llvm::BasicBlock *failbb = gIR->insertBBAfter(okbb, "bounds.fail");
-  gIR->ir->CreateCondBr(cond, okbb, failbb);
+  DtoCondBrToFailure(cond, okbb, failbb);
 
   // set up failbb to call the array bounds error runtime function
   gIR->ir->SetInsertPoint(failbb);
@@ -1196,8 +1196,7 @@ static void emitRangeErrorImpl(IRState *irs, const Loc &loc,
     args.push_back(DtoModuleFileName(module, loc));
     args.push_back(DtoConstUint(loc.linnum()));
     args.insert(args.end(), extraArgs.begin(), extraArgs.end());
-    irs->CreateCallOrInvoke(fn, args);
-    irs->ir->CreateUnreachable();
+    DtoCallFailureFunction(fn, args, 0);
     break;
   }
   default:
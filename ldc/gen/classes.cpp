@@ -16,7 +16,9 @@
 #include "dmd/identifier.h"
 #include "dmd/init.h"
 #include "dmd/mtype.h"
+#include "dmd/module.h"
 #include "dmd/target.h"
+#include "driver/cl_options.h"
 #include "gen/arrays.h"
 #include "gen/dvalue.h"
 #include "gen/functions.h"
@@ -24,6 +26,7 @@
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
 #include "gen/logger.h"
+#include "gen/mangling.h"
 #include "gen/nested.h"
 #include "gen/optimizer.h"
 #include "gen/runtime.h"
@@ -33,6 +36,7 @@
 #include "ir/irdsymbol.h"
 #include "ir/irfunction.h"
 #include "ir/irtypeclass.h"
+#include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -351,6 +355,101 @@ static void resolveObjectAndClassInfoClasses() {
   DtoResolveClass(Type::typeinfoclass);
 }
 
+// Returns the ClassInfo member field with the given name.
+static VarDeclaration *getClassInfoField(const char *name) {
+  for (auto vd : Type::typeinfoclass->fields) {
+    if (strcmp(vd->ident->toChars(), name) == 0)
+      return vd;
+  }
+  llvm_unreachable("Unknown ClassInfo field");
+}
+
+// Loads the ClassInfo pointer from the first vtbl slot of a D class object.
+static LLValue *loadClassInfo(LLValue *obj) {
+  LLType *classInfoPtrTy = DtoType(getClassInfoType());
+  LLValue *vtbl = DtoLoad(getPtrToType(classInfoPtrTy),
+                          DtoBitCast(obj, getPtrToType(getPtrToType(
+                                              classInfoPtrTy))),
+                          ".vtbl");
+  return DtoLoad(classInfoPtrTy, vtbl, ".classinfo");
+}
+
+/// Emits the dynamic cast of a non-null D class object to a D class inline,
+/// matching druntime's `_d_isbaseof2()`: the object's ClassInfo and its base
+/// chain are compared against the target ClassInfo, by identity first and then
+/// by name (ClassInfos may be duplicated across binaries). For final target
+/// classes, only the object's own ClassInfo needs to be checked.
+static LLValue *emitInlineDynamicCast(LLValue *obj, ClassDeclaration *target) {
+  LLType *objTy = obj->getType();
+  LLValue *null = LLConstant::getNullValue(objTy);
+  LLValue *targetInfo = DtoBitCast(getIrAggr(target)->getClassInfoSymbol(),
+                                   DtoType(getClassInfoType()));
+  const bool isFinal = (target->storage_class & STCfinal) != 0;
+  VarDeclaration *nameField = getClassInfoField("name");
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *loadbb = gIR->insertBB("cast.load");
+  llvm::BasicBlock *comparebb = gIR->insertBBAfter(loadbb, "cast.compare");
+  llvm::BasicBlock *namebb = gIR->insertBBAfter(comparebb, "cast.name");
+  llvm::BasicBlock *memcmpbb = gIR->insertBBAfter(namebb, "cast.memcmp");
+  llvm::BasicBlock *basebb =
+      isFinal ? nullptr : gIR->insertBBAfter(memcmpbb, "cast.base");
+  llvm::BasicBlock *endbb =
+      gIR->insertBBAfter(isFinal ? memcmpbb : basebb, "cast.end");
+  llvm::BasicBlock *mismatchbb = isFinal ? endbb : basebb;
+
+  gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(obj), endbb, loadbb);
+
+  gIR->ir->SetInsertPoint(loadbb);
+  LLValue *objInfo = loadClassInfo(obj);
+  gIR->ir->CreateBr(comparebb);
+
+  gIR->ir->SetInsertPoint(comparebb);
+  llvm::PHINode *info = gIR->ir->CreatePHI(objInfo->getType(), 2);
+  info->addIncoming(objInfo, loadbb);
+  gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(info, targetInfo), endbb,
+                        namebb);
+
+  gIR->ir->SetInsertPoint(namebb);
+  DLValue *name = DtoIndexAggregate(info, Type::typeinfoclass, nameField);
+  DLValue *targetName =
+      DtoIndexAggregate(targetInfo, Type::typeinfoclass, nameField);
+  LLValue *length = DtoArrayLen(name);
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpEQ(length, DtoArrayLen(targetName)), memcmpbb,
+      mismatchbb);
+
+  gIR->ir->SetInsertPoint(memcmpbb);
+  LLValue *cmp = DtoMemCmp(DtoArrayPtr(name), DtoArrayPtr(targetName), length);
+  LLValue *isEqual = gIR->ir->CreateIsNull(cmp);
+  LLValue *memcmpResult = obj;
+  if (isFinal) {
+    memcmpResult = gIR->ir->CreateSelect(isEqual, obj, null);
+    gIR->ir->CreateBr(endbb);
+  } else {
+    gIR->ir->CreateCondBr(isEqual, endbb, basebb);
+  }
+
+  if (!isFinal) {
+    gIR->ir->SetInsertPoint(basebb);
+    LLValue *base = DtoLoad(
+        info->getType(),
+        DtoLVal(DtoIndexAggregate(info, Type::typeinfoclass,
+                                  getClassInfoField("base"))),
+        ".base");
+    info->addIncoming(base, basebb);
+    gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(base), endbb, comparebb);
+  }
+
+  gIR->ir->SetInsertPoint(endbb);
+  llvm::PHINode *ret = gIR->ir->CreatePHI(objTy, 4, ".cast");
+  ret->addIncoming(null, entrybb);
+  ret->addIncoming(obj, comparebb);
+  ret->addIncoming(memcmpResult, memcmpbb);
+  ret->addIncoming(null, isFinal ? namebb : basebb);
+  return ret;
+}
+
 DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *_to) {
   // call:
   // Object _d_dynamic_cast(Object o, ClassInfo c)
@@ -377,8 +476,15 @@ DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *_to) {
   cinfo = DtoBitCast(cinfo, funcTy->getParamType(1));
   assert(funcTy->getParamType(1) == cinfo->getType());
 
-  // call it
-  LLValue *ret = gIR->CreateCallOrInvoke(func, obj, cinfo);
+  // check inline for D class targets when optimizing, call it otherwise
+  LLValue *ret;
+  if (isOptimizationEnabled() && to->sym->classKind == ClassKind::d &&
+      !to->sym->isInterfaceDeclaration()) {
+    Logger::println("inline dynamic cast");
+    ret = emitInlineDynamicCast(obj, to->sym);
+  } else {
+    ret = gIR->CreateCallOrInvoke(func, obj, cinfo);
+  }
 
   // cast return value
   ret = DtoBitCast(ret, DtoType(_to));
@@ -388,6 +494,69 @@ DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *_to) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/// Emits a `_d_interface_cast()` call on a miss of a per-call-site,
+/// thread-local cache. The cache is keyed by the interface's vtbl pointer,
+/// which identifies the object's class, and stores the offset from the
+/// interface pointer to the result (1 for null results, as real offsets are
+/// pointer-aligned).
+static LLValue *emitCachedInterfaceCast(llvm::Function *func, LLValue *ptr,
+                                        LLValue *cinfo) {
+  static unsigned numCaches = 0;
+
+  LLType *voidPtrTy = getVoidPtrType();
+  LLStructType *cacheTy = LLStructType::get(gIR->context(),
+                                            {voidPtrTy, DtoSize_t()});
+  auto cache = defineGlobal(
+      Loc(), gIR->module,
+      "ldc.interface_cast_cache." + std::to_string(numCaches++),
+      LLConstant::getNullValue(cacheTy), LLGlobalValue::InternalLinkage,
+      /*isConstant=*/false, /*isThreadLocal=*/true);
+  LLValue *cachedKeyPtr = DtoGEP(cacheTy, cache, 0u, 0);
+  LLValue *cachedOffsetPtr = DtoGEP(cacheTy, cache, 0u, 1);
+  LLConstant *nullOffset = DtoConstSize_t(1);
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *lookupbb = gIR->insertBB("cast.lookup");
+  llvm::BasicBlock *hitbb = gIR->insertBBAfter(lookupbb, "cast.hit");
+  llvm::BasicBlock *missbb = gIR->insertBBAfter(hitbb, "cast.miss");
+  llvm::BasicBlock *endbb = gIR->insertBBAfter(missbb, "cast.end");
+
+  gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(ptr), endbb, lookupbb);
+
+  gIR->ir->SetInsertPoint(lookupbb);
+  LLValue *key =
+      DtoLoad(voidPtrTy, DtoBitCast(ptr, getPtrToType(voidPtrTy)), ".vtbl");
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpEQ(key, DtoLoad(voidPtrTy, cachedKeyPtr)), hitbb,
+      missbb);
+
+  gIR->ir->SetInsertPoint(hitbb);
+  LLValue *offset = DtoLoad(DtoSize_t(), cachedOffsetPtr);
+  LLValue *hit = gIR->ir->CreateSelect(
+      gIR->ir->CreateICmpEQ(offset, nullOffset),
+      LLConstant::getNullValue(voidPtrTy),
+      DtoGEP1(LLType::getInt8Ty(gIR->context()), ptr, offset));
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(missbb);
+  LLValue *miss = gIR->CreateCallOrInvoke(func, ptr, cinfo);
+  LLValue *missOffset = gIR->ir->CreateSelect(
+      gIR->ir->CreateIsNull(miss), nullOffset,
+      gIR->ir->CreateSub(gIR->ir->CreatePtrToInt(miss, DtoSize_t()),
+                         gIR->ir->CreatePtrToInt(ptr, DtoSize_t())));
+  DtoStore(key, cachedKeyPtr);
+  DtoStore(missOffset, cachedOffsetPtr);
+  missbb = gIR->scopebb();
+  gIR->ir->CreateBr(endbb);
+
+  gIR->ir->SetInsertPoint(endbb);
+  llvm::PHINode *ret = gIR->ir->CreatePHI(voidPtrTy, 3, ".cast");
+  ret->addIncoming(LLConstant::getNullValue(voidPtrTy), entrybb);
+  ret->addIncoming(hit, hitbb);
+  ret->addIncoming(miss, missbb);
+  return ret;
+}
+
 DValue *DtoDynamicCastInterface(const Loc &loc, DValue *val, Type *_to) {
   // call:
   // Object _d_interface_cast(void* p, ClassInfo c)
@@ -411,8 +580,16 @@ DValue *DtoDynamicCastInterface(const Loc &loc, DValue *val, Type *_to) {
   // this could happen in user code as well :/
   cinfo = DtoBitCast(cinfo, funcTy->getParamType(1));
 
-  // call it
-  LLValue *ret = gIR->CreateCallOrInvoke(func, ptr, cinfo);
+  // call it, through a per-call-site cache if enabled
+  TypeClass *from = static_cast<TypeClass *>(val->type->toBasetype());
+  LLValue *ret;
+  if (opts::interfaceCastCache && isOptimizationEnabled() &&
+      from->sym->classKind == ClassKind::d && !from->sym->isCOMinterface()) {
+    Logger::println("cached interface cast");
+    ret = emitCachedInterfaceCast(func, ptr, cinfo);
+  } else {
+    ret = gIR->CreateCallOrInvoke(func, ptr, cinfo);
+  }
 
   // cast return value
   ret = DtoBitCast(ret, DtoType(_to));
@@ -422,6 +599,24 @@ DValue *DtoDynamicCastInterface(const Loc &loc, DValue *val, Type *_to) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+bool hasHiddenLTOVisibility(ClassDeclaration *cd) {
+  if (!opts::wholeProgramVTables || cd->classKind != ClassKind::d ||
+      cd->isExport() ||
+      opts::symbolVisibility != opts::SymbolVisibility::hidden) {
+    return false;
+  }
+  // Classes of other modules (e.g., druntime's) may have subclasses in
+  // binaries not part of the LTO unit.
+  Module *m = cd->getModule();
+  return m && m->isRoot();
+}
+
+llvm::MDString *getVtblTypeId(ClassDeclaration *cd) {
+  return llvm::MDString::get(gIR->context(), getIRMangledAggregateName(cd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 LLValue *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl) {
   // sanity checks
   assert(fdecl->isVirtual());
@@ -445,6 +640,14 @@ LLValue *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl) {
   funcval = DtoGEP(irtc->getMemoryLLType(), funcval, 0u, 0);
   // load vtbl ptr
   funcval = DtoLoad(vtblType->getPointerTo(), funcval);
+  // tell LTO the vtbl is one of the static type's for devirtualization
+  if (opts::wholeProgramVTables && hasHiddenLTOVisibility(tc->sym)) {
+    LLValue *typeTest = gIR->ir->CreateCall(
+        GET_INTRINSIC_DECL(type_test),
+        {DtoBitCast(funcval, getVoidPtrType()),
+         llvm::MetadataAsValue::get(gIR->context(), getVtblTypeId(tc->sym))});
+    gIR->ir->CreateCall(GET_INTRINSIC_DECL(assume), typeTest);
+  }
   // index vtbl
   const std::string name = fdecl->toChars();
   const auto vtblname = name + "@vtbl";
@@ -22,6 +22,9 @@ class DValue;
 class FuncDeclaration;
 class NewExp;
 class TypeClass;
+namespace llvm {
+class MDString;
+}
 
 /// Resolves the llvm type for a class declaration
 void DtoResolveClass(ClassDeclaration *cd);
@@ -38,3 +41,14 @@ DValue *DtoDynamicCastObject(const Loc &loc, DValue *val, Type *to);
 DValue *DtoDynamicCastInterface(const Loc &loc, DValue *val, Type *to);
 
 llvm::Value *DtoVirtualFunctionPointer(DValue *inst, FuncDeclaration *fdecl);
+
+/// Returns whether virtual calls via references of the given class or
+/// interface type may be devirtualized by LTO (`-fwhole-program-vtables`),
+/// i.e., whether all classes deriving from it are assumed to be part of the
+/// LTO unit. That's the case for non-exported classes with hidden visibility
+/// (`-fvisibility=hidden`) in the modules being compiled.
+bool hasHiddenLTOVisibility(ClassDeclaration *cd);
+
+/// Returns the identifier of the given class or interface type in LLVM type
+/// metadata for vtables and type tests.
+llvm::MDString *getVtblTypeId(ClassDeclaration *cd);
@@ -685,9 +685,13 @@ void generateCtorBody(IRState *irs, const Types &types, llvm::Function *func,
   auto elemIndex = llvm::ConstantInt::get(irs->context(), APInt(32, 1));
   auto modListHeadPtr = declareModListHead(irs->module, types);
   llvm::Value *gepVals[] = {zero64, elemIndex};
-  auto elemNextPtr = builder.CreateGEP(modListElem, gepVals);
-  auto prevHeadVal = builder.CreateLoad(builder.CreateBitOrPointerCast(
-      modListHeadPtr, types.modListElemType->getPointerTo()->getPointerTo()));
+  auto elemNextPtr =
+      builder.CreateGEP(types.modListElemType, modListElem, gepVals);
+  auto prevHeadVal = builder.CreateLoad(
+      types.modListElemType->getPointerTo(),
+      builder.CreateBitOrPointerCast(
+          modListHeadPtr,
+          types.modListElemType->getPointerTo()->getPointerTo()));
   auto voidPtr = builder.CreateBitOrPointerCast(
       modListElem, llvm::IntegerType::getInt8PtrTy(irs->context()));
   builder.CreateStore(voidPtr, modListHeadPtr);
@@ -761,7 +765,9 @@ void createThunkFunc(llvm::Module &module, const llvm::Function *src,
   auto bb = llvm::BasicBlock::Create(module.getContext(), "", dst);
   llvm::IRBuilder<> builder(module.getContext());
   builder.SetInsertPoint(bb);
-  auto thunkPtr = builder.CreateLoad(thunkVar);
+  // The thunk variable may be updated concurrently by an asynchronous compile.
+  auto thunkPtr = builder.CreateLoad(thunkVar->getValueType(), thunkVar);
+  thunkPtr->setAtomic(llvm::AtomicOrdering::Monotonic);
   llvm::SmallVector<llvm::Value *, 6> args;
   for (auto &arg : dst->args()) {
     args.push_back(&arg);
@@ -835,10 +841,12 @@ void defineDynamicCompiledFunction(IRState *irs, IrFunction *func) {
     auto srcFunc = func->getLLVMFunc();
     auto it = irs->dynamicCompiledFunctions.find(srcFunc);
     assert(irs->dynamicCompiledFunctions.end() != it);
+    // Until the function has been compiled at runtime, its statically
+    // compiled version is called.
     auto thunkVarType = srcFunc->getFunctionType()->getPointerTo();
     auto thunkVar = new llvm::GlobalVariable(
         irs->module, thunkVarType, false, llvm::GlobalValue::PrivateLinkage,
-        llvm::ConstantPointerNull::get(thunkVarType),
+        llvm::ConstantExpr::getBitCast(srcFunc, thunkVarType),
         ".rtcompile_thunkvar_" + srcFunc->getName());
     auto dstFunc = it->second.thunkFunc;
     createThunkFunc(irs->module, srcFunc, dstFunc, thunkVar);
@@ -43,6 +43,7 @@
 #include "gen/mangling.h"
 #include "gen/nested.h"
 #include "gen/optimizer.h"
+#include "gen/passes/metadata.h"
 #include "gen/pgo_ASTbased.h"
 #include "gen/pragma.h"
 #include "gen/runtime.h"
@@ -64,6 +65,81 @@ bool isAnyMainFunction(FuncDeclaration *fd) {
   return fd->isMain() || fd->isCMain();
 }
 
+namespace {
+
+/// Returns whether a value of the given type may refer to mutable memory.
+/// Conservative for aggregates, which are only checked for pointers.
+bool hasMutableIndirections(Type *t) {
+  t = t->toBasetype();
+  if (t->isConst() || t->isImmutable())
+    return false;
+  switch (t->ty) {
+  case TY::Tsarray:
+    return hasMutableIndirections(t->nextOf());
+  case TY::Tpointer:
+  case TY::Tarray: {
+    Type *next = t->nextOf();
+    return !next->isConst() && !next->isImmutable();
+  }
+  default:
+    return hasPointers(t);
+  }
+}
+
+/// With -fderive-memory-attrs, adds the attributes implied by D's transitive
+/// const/immutable and `scope` to a parameter passed as LLVM pointer.
+void addDerivedMemoryAttrs(Parameter *param, IrFuncTyArg &arg) {
+  if (arg.rewrite || !arg.ltype->isPointerTy() || arg.isByVal())
+    return;
+
+  Type *pointee;
+  if (param->storageClass & (STCref | STCout)) {
+    pointee = param->type;
+  } else {
+    Type *t = param->type->toBasetype();
+    if (t->ty != TY::Tpointer)
+      return;
+    pointee = t->nextOf();
+    // `scope` is only checked by the frontend with DIP1000.
+    if ((param->storageClass & (STCscope | STCreturn)) == STCscope &&
+        global.params.useDIP1000 == FeatureState::enabled) {
+      arg.attrs.addAttribute(LLAttribute::NoCapture);
+    }
+  }
+
+  if (pointee->isImmutable()) {
+    // Nobody writes to immutable data, so no other pointer can modify it
+    // during the call either.
+    arg.attrs.addAttribute(LLAttribute::NoAlias);
+    arg.attrs.addAttribute(LLAttribute::ReadOnly);
+  } else if (pointee->isConst() || pointee->isWild()) {
+    arg.attrs.addAttribute(LLAttribute::ReadOnly);
+  }
+}
+
+/// Returns whether the function doesn't write to any memory its caller can
+/// observe: strongly pure (only const parameters) and nothrow functions
+/// returning no mutable indirections (which might be fresh GC allocations,
+/// distinguishable by identity). Void functions are excluded, as they can only
+/// be called for their side effects.
+bool onlyReadsMemory(FuncDeclaration *fdecl, TypeFunction *f) {
+  // `debug` statements may violate purity.
+  if (!opts::debugArgs.empty() || fdecl->isNaked() || DtoIsIntrinsic(fdecl) ||
+      f->parameterList.varargs != VARARGnone || !f->isnothrow() ||
+      fdecl->isPure() != PURE::const_) {
+    return false;
+  }
+
+  Type *rt = f->next->toBasetype();
+  if (rt->ty == TY::Tvoid || rt->ty == TY::Tnoreturn)
+    return false;
+  if (f->isref())
+    return rt->isConst() || rt->isImmutable();
+  return !hasMutableIndirections(rt);
+}
+
+} // anonymous namespace
+
 llvm::FunctionType *DtoFunctionType(Type *type, IrFuncTy &irFty, Type *thistype,
                                     Type *nesttype, FuncDeclaration *fd) {
   IF_LOG Logger::println("DtoFunctionType(%s)", type->toChars());
@@ -239,6 +315,13 @@ llvm::FunctionType *DtoFunctionType(Type *type, IrFuncTy &irFty, Type *thistype,
         // Add sext/zext as needed.
         DtoAddExtendAttr(loweredDType, attrs);
       }
+
+      // Let the Closure2Stack pass know that the context of a `scope`
+      // delegate doesn't escape.
+      if ((arg->storageClass & (STCscope | STCreturn)) == STCscope &&
+          loweredDType->toBasetype()->ty == TY::Tdelegate) {
+        attrs.addAttribute(SCOPE_DELEGATE_ATTR);
+      }
     }
 
     newIrFty.args.push_back(new IrFuncTyArg(loweredDType, passPointer, std::move(attrs)));
@@ -249,6 +332,16 @@ llvm::FunctionType *DtoFunctionType(Type *type, IrFuncTy &irFty, Type *thistype,
   // let the ABI rewrite the types as necessary
   abi->rewriteFunctionType(newIrFty);
 
+  if (opts::fDeriveMemoryAttrs) {
+    for (auto arg : newIrFty.args) {
+      if (arg->parametersIdx < numExplicitDArgs) {
+        addDerivedMemoryAttrs(
+            Parameter::getNth(f->parameterList.parameters, arg->parametersIdx),
+            *arg);
+      }
+    }
+  }
+
   // Now we can modify irFty safely.
   irFty = std::move(newIrFty);
 
@@ -482,32 +575,6 @@ void applyParamAttrsToLLFunc(TypeFunction *f, IrFuncTy &irFty,
   func->setAttributes(newAttrs);
 }
 
-/// Applies TargetMachine options as function attributes in the IR (options for
-/// which attributes exist).
-/// This is e.g. needed for LTO: it tells the linker/LTO-codegen what settings
-/// to use.
-/// It is also needed because "unsafe-fp-math" is not properly reset in LLVM
-/// between function definitions, i.e. if a function does not define a value for
-/// "unsafe-fp-math" it will be compiled using the value of the previous
-/// function. Therefore, each function must explicitly define the value (clang
-/// does the same). See https://llvm.org/bugs/show_bug.cgi?id=23172
-void applyTargetMachineAttributes(llvm::Function &func,
-                                  const llvm::TargetMachine &target) {
-  const auto dcompute = gIR->dcomputetarget;
-
-  // TODO: (correctly) apply these for NVPTX (but not for SPIRV).
-  if (dcompute && dcompute->target == DComputeTarget::ID::OpenCL)
-    return;
-  const auto cpu = dcompute ? "" : target.getTargetCPU();
-  const auto features = dcompute ? "" : target.getTargetFeatureString();
-
-  opts::setFunctionAttributes(cpu, features, func);
-  if (opts::fFastMath) // -ffast-math[=true] overrides -enable-unsafe-fp-math
-    func.addFnAttr("unsafe-fp-math", "true");
-  if (!func.hasFnAttribute("frame-pointer")) // not explicitly set by user
-    func.addFnAttr("frame-pointer", isOptimizationEnabled() ? "none" : "all");
-}
-
 void applyXRayAttributes(FuncDeclaration &fdecl, llvm::Function &func) {
   if (!opts::fXRayInstrument)
     return;
@@ -551,6 +618,34 @@ void onlyOneMainCheck(FuncDeclaration *fd) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/// Applies TargetMachine options as function attributes in the IR (options for
+/// which attributes exist).
+/// This is e.g. needed for LTO: it tells the linker/LTO-codegen what settings
+/// to use.
+/// It is also needed because "unsafe-fp-math" is not properly reset in LLVM
+/// between function definitions, i.e. if a function does not define a value for
+/// "unsafe-fp-math" it will be compiled using the value of the previous
+/// function. Therefore, each function must explicitly define the value (clang
+/// does the same). See https://llvm.org/bugs/show_bug.cgi?id=23172
+void applyTargetMachineAttributes(llvm::Function &func,
+                                  const llvm::TargetMachine &target) {
+  const auto dcompute = gIR->dcomputetarget;
+
+  // TODO: (correctly) apply these for NVPTX (but not for SPIRV).
+  if (dcompute && dcompute->target == DComputeTarget::ID::OpenCL)
+    return;
+  const auto cpu = dcompute ? "" : target.getTargetCPU();
+  const auto features = dcompute ? "" : target.getTargetFeatureString();
+
+  opts::setFunctionAttributes(cpu, features, func);
+  if (opts::fFastMath) // -ffast-math[=true] overrides -enable-unsafe-fp-math
+    func.addFnAttr("unsafe-fp-math", "true");
+  if (!func.hasFnAttribute("frame-pointer")) // not explicitly set by user
+    func.addFnAttr("frame-pointer", isOptimizationEnabled() ? "none" : "all");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void DtoDeclareFunction(FuncDeclaration *fdecl, const bool willDefine) {
   DtoResolveFunction(fdecl, /*willDeclare=*/true);
 
@@ -676,6 +771,9 @@ void DtoDeclareFunction(FuncDeclaration *fdecl, const bool willDefine) {
   if (f->next->toBasetype()->ty == TY::Tnoreturn) {
     func->addFnAttr(LLAttribute::NoReturn);
   }
+  if (opts::fDeriveMemoryAttrs && onlyReadsMemory(fdecl, f)) {
+    func->setOnlyReadsMemory();
+  }
 #if LDC_LLVM_VER >= 1300
   if (opts::fWarnStackSize.getNumOccurrences() > 0 &&
       opts::fWarnStackSize < UINT_MAX) {
@@ -24,7 +24,9 @@ struct Loc;
 class Parameter;
 class Type;
 namespace llvm {
+class Function;
 class FunctionType;
+class TargetMachine;
 }
 
 // Returns true if the function is a D/C main, eligible for implicit `return 0`
@@ -47,3 +49,8 @@ void emitABIReturnAsmStmt(IRAsmBlock *asmblock, const Loc &loc,
 DValue *DtoArgument(Parameter *fnarg, Expression *argexp);
 
 llvm::CallingConv::ID getCallingConvention(FuncDeclaration *fdecl);
+
+/// Sets the target CPU/features and codegen attributes (frame pointer, FP
+/// math) for a function defined by the compiler.
+void applyTargetMachineAttributes(llvm::Function &func,
+                                  const llvm::TargetMachine &target);
@@ -223,6 +223,13 @@ public:
   /// Whether to emit array bounds checking in the current function.
   bool emitArrayBoundsChecks();
 
+  // Cold stubs calling runtime failure functions (see
+  // DtoCallFailureFunction()), keyed by the runtime function and the file
+  // name argument bound by the stub.
+  llvm::DenseMap<std::pair<llvm::Function *, llvm::Constant *>,
+                 llvm::Function *>
+      failureStubs;
+
   // Sets the initializer for a global LL variable.
   // If the types don't match, this entails creating a new helper global
   // matching the initializer type and replacing all existing uses of globalVar
@@ -273,6 +280,7 @@ public:
                                       llvm::ArrayRef<llvm::Type *> indirectTypes);
   void addInlineAsmSrcLoc(const Loc &loc, llvm::CallInst *inlineAsmCall);
   const Loc &getInlineAsmSrcLoc(unsigned srcLocCookie) const;
+  unsigned numInlineAsmSrcLocs() const { return inlineAsmLocs.length; }
 
   // MS C++ compatible type descriptors
   llvm::DenseMap<size_t, llvm::StructType *> TypeDescriptorTypeMap;
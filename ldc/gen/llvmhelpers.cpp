@@ -30,6 +30,8 @@
 #include "gen/logger.h"
 #include "gen/nested.h"
 #include "gen/mangling.h"
+#include "gen/optimizer.h"
+#include "gen/passes/metadata.h"
 #include "gen/pragma.h"
 #include "gen/runtime.h"
 #include "gen/tollvm.h"
@@ -40,6 +42,7 @@
 #include "ir/irmodule.h"
 #include "ir/irtypeaggr.h"
 #include "ir/irtypeclass.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/MC/MCAsmInfo.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ManagedStatic.h"
@@ -272,11 +275,8 @@ void DtoAssert(Module *M, const Loc &loc, DValue *msg) {
   // line param
   args.push_back(DtoConstUint(loc.linnum()));
 
-  // call
-  gIR->CreateCallOrInvoke(fn, args);
-
-  // after assert is always unreachable
-  gIR->ir->CreateUnreachable();
+  // call; after assert is always unreachable
+  DtoCallFailureFunction(fn, args, msg ? 1 : 0);
 }
 
 void DtoCAssert(Module *M, const Loc &loc, LLValue *msg) {
@@ -342,6 +342,96 @@ void DtoThrow(const Loc &loc, DValue *e) {
   gIR->ir->SetInsertPoint(bb);
 }
 
+/******************************************************************************
+ * FAILURE PATH HELPERS
+ ******************************************************************************/
+
+void DtoCondBrToFailure(LLValue *okCond, llvm::BasicBlock *okbb,
+                        llvm::BasicBlock *failbb) {
+  // Same weights as clang uses for __builtin_expect. LLVM already considers
+  // blocks ending in unreachable as cold, but explicit weights survive
+  // merging the failure blocks and are consistent across all checks.
+  constexpr uint32_t likelyWeight = 2000;
+  constexpr uint32_t unlikelyWeight = 1;
+
+  auto br = gIR->ir->CreateCondBr(okCond, okbb, failbb);
+  br->setMetadata(llvm::LLVMContext::MD_prof,
+                  llvm::MDBuilder(gIR->context())
+                      .createBranchWeights(likelyWeight, unlikelyWeight));
+}
+
+static llvm::Function *getFailureStub(llvm::Function *fn, LLConstant *file,
+                                      unsigned fileArgIndex) {
+  llvm::Function *&stub = gIR->failureStubs[{fn, file}];
+  if (stub)
+    return stub;
+
+  llvm::FunctionType *fnType = fn->getFunctionType();
+  LLSmallVector<LLType *, 4> paramTypes;
+  for (unsigned i = 0; i < fnType->getNumParams(); ++i) {
+    if (i != fileArgIndex)
+      paramTypes.push_back(fnType->getParamType(i));
+  }
+
+  IF_LOG Logger::println("Creating cold stub for %s",
+                         fn->getName().str().c_str());
+
+  stub = llvm::Function::Create(
+      llvm::FunctionType::get(fnType->getReturnType(), paramTypes, false),
+      llvm::GlobalValue::InternalLinkage, COLD_STUB_PREFIX + fn->getName(),
+      &gIR->module);
+  stub->setCallingConv(fn->getCallingConv());
+  stub->addFnAttr(LLAttribute::Cold);
+  stub->addFnAttr(LLAttribute::NoInline);
+  stub->addFnAttr(LLAttribute::NoReturn);
+  stub->addFnAttr(LLAttribute::OptimizeForSize);
+  if (fn->doesNotThrow()) {
+    stub->setDoesNotThrow();
+  } else if (gABI->needsUnwindTables()) {
+#if LDC_LLVM_VER >= 1500
+    stub->setUWTableKind(llvm::UWTableKind::Default);
+#else
+    stub->addFnAttr(LLAttribute::UWTable);
+#endif
+  }
+  applyTargetMachineAttributes(*stub, *gTargetMachine);
+  // Emitted to .text.unlikely (ELF), away from the hot code.
+  stub->setSectionPrefix("unlikely");
+
+  LLSmallVector<LLValue *, 5> args;
+  auto stubArg = stub->arg_begin();
+  for (unsigned i = 0; i < fnType->getNumParams(); ++i)
+    args.push_back(i == fileArgIndex ? static_cast<LLValue *>(file)
+                                       : &*stubArg++);
+
+  llvm::IRBuilder<> builder(
+      llvm::BasicBlock::Create(gIR->context(), "", stub));
+  auto call = builder.CreateCall(fn, args);
+  call->setCallingConv(fn->getCallingConv());
+  call->setAttributes(fn->getAttributes());
+  builder.CreateUnreachable();
+
+  return stub;
+}
+
+void DtoCallFailureFunction(llvm::Function *fn, llvm::ArrayRef<LLValue *> args,
+                            unsigned fileArgIndex) {
+  auto file = llvm::dyn_cast<LLConstant>(args[fileArgIndex]);
+  if (!file || !isOptimizationEnabled()) {
+    gIR->CreateCallOrInvoke(fn, args);
+    gIR->ir->CreateUnreachable();
+    return;
+  }
+
+  LLSmallVector<LLValue *, 4> stubArgs;
+  for (unsigned i = 0; i < args.size(); ++i) {
+    if (i != fileArgIndex)
+      stubArgs.push_back(args[i]);
+  }
+  gIR->CreateCallOrInvoke(getFailureStub(fn, file, fileArgIndex), stubArgs);
+  gIR->ir->CreateUnreachable();
+}
+
 /******************************************************************************
  * MODULE FILE NAME
  ******************************************************************************/
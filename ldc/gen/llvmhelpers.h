@@ -61,6 +61,20 @@ LLValue *DtoAllocaDump(LLValue *val, LLType *asType, int alignment = 0,
 void DtoAssert(Module *M, const Loc &loc, DValue *msg);
 void DtoCAssert(Module *M, const Loc &loc, LLValue *msg);
 
+/// Terminates the current basic block with a branch to `okbb` if `okCond`
+/// holds and to the runtime failure path `failbb` otherwise. The failure path
+/// is weighted as practically never taken.
+void DtoCondBrToFailure(LLValue *okCond, llvm::BasicBlock *okbb,
+                        llvm::BasicBlock *failbb);
+
+/// Calls the noreturn runtime failure function `fn` (`_d_assert`,
+/// `_d_arraybounds` etc.) and terminates the current basic block.
+/// `args[fileArgIndex]` is the constant file name; when optimizing, it is bound
+/// by a cold stub shared by all calls in the module with that file name, which
+/// keeps the call sites in hot code small.
+void DtoCallFailureFunction(llvm::Function *fn, llvm::ArrayRef<LLValue *> args,
+                            unsigned fileArgIndex);
+
 void DtoThrow(const Loc &loc, DValue *e);
 
 // returns module file name
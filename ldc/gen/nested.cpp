@@ -17,6 +17,7 @@
 #include "gen/irstate.h"
 #include "gen/llvmhelpers.h"
 #include "gen/logger.h"
+#include "gen/passes/metadata.h"
 #include "gen/runtime.h"
 #include "gen/tollvm.h"
 #include "ir/irfunction.h"
@@ -502,8 +503,15 @@ void DtoCreateNestedContext(FuncGenState &funcGen) {
       auto size = getTypeAllocSize(frameType);
       if (frameAlignment > 16) // GC guarantees an alignment of 16
         size += frameAlignment - 16;
-      LLValue *mem =
+      llvm::Instruction *call =
           gIR->CreateCallOrInvoke(fn, DtoConstSize_t(size), ".gc_frame");
+      // Tag the allocation for the Closure2Stack pass.
+      llvm::Metadata *closureInfo[] = {
+          llvm::MDString::get(gIR->context(), fd->loc.toChars()),
+          llvm::MDString::get(gIR->context(), fd->toPrettyChars())};
+      call->setMetadata(CLOSURE_MD_KIND,
+                        llvm::MDNode::get(gIR->context(), closureInfo));
+      LLValue *mem = call;
       if (frameAlignment <= 16) {
         frame = DtoBitCast(mem, frameType->getPointerTo(), ".frame");
       } else {
@@ -11,6 +11,8 @@
 
 #include "dmd/errors.h"
 #include "gen/logger.h"
+#include "gen/passes/BoundsCheckElimination.h"
+#include "gen/passes/Closure2Stack.h"
 #include "gen/passes/GarbageCollect2Stack.h"
 #include "gen/passes/StripExternals.h"
 #include "gen/passes/SimplifyDRuntimeCalls.h"
@@ -56,6 +58,7 @@
 #include "llvm/Transforms/Scalar/Reassociate.h"
 #endif
 #include "llvm/Transforms/Instrumentation/SanitizerCoverage.h"
+#include <mutex>
 
 extern llvm::TargetMachine *gTargetMachine;
 using namespace llvm;
@@ -98,6 +101,15 @@ static cl::opt<bool> disableGCToStack(
     "disable-gc2stack", cl::ZeroOrMore,
     cl::desc("Disable promotion of GC allocations to stack memory"));
 
+static cl::opt<bool> disableClosureToStack(
+    "disable-closure2stack", cl::ZeroOrMore,
+    cl::desc("Disable promotion of non-escaping closures to stack memory"));
+
+static cl::opt<bool> disableBoundsCheckElim(
+    "disable-boundscheck-elim", cl::ZeroOrMore,
+    cl::desc("Disable hoisting array bounds checks out of loops and merging "
+             "adjacent ones"));
+
 static cl::opt<cl::boolOrDefault, false, opts::FlagParser<cl::boolOrDefault>>
     enableInlining(
         "inlining", cl::ZeroOrMore,
@@ -166,6 +178,20 @@ std::unique_ptr<TargetLibraryInfoImpl> createTLII(llvm::Module &M) {
   return std::unique_ptr<TargetLibraryInfoImpl>(tlii);
 }
 
+// Lists the closures allocated on the stack by the Closure2Stack pass with
+// `-vgc`.
+static void reportClosureOnStack(llvm::StringRef loc,
+                                 llvm::StringRef funcName) {
+  if (!global.params.v.gc)
+    return;
+  // Modules may be optimized in parallel (-j).
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  message("%.*s: vgc: closure of `%.*s` allocated on the stack",
+          static_cast<int>(loc.size()), loc.data(),
+          static_cast<int>(funcName.size()), funcName.data());
+}
+
 #if LDC_LLVM_VER < 1500
 static inline void legacyAddPass(PassManagerBase &pm, Pass *pass) {
   pm.add(pass);
@@ -197,6 +223,20 @@ static void legacyAddGarbageCollect2StackPass(const PassManagerBuilder &builder,
   }
 }
 
+static void legacyAddBoundsCheckEliminationPass(
+    const PassManagerBuilder &builder, PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    legacyAddPass(pm, createBoundsCheckElimination());
+  }
+}
+
+static void legacyAddClosure2StackPass(const PassManagerBuilder &builder,
+                                       PassManagerBase &pm) {
+  if (builder.OptLevel >= 2 && builder.SizeLevel == 0) {
+    legacyAddPass(pm, createClosure2StackPass(reportClosureOnStack));
+  }
+}
+
 static void legacyAddAddressSanitizerPasses(const PassManagerBuilder &Builder,
                                             PassManagerBase &PM) {
   PM.add(createAddressSanitizerFunctionPass(/*CompileKernel = */ false,
@@ -342,6 +382,18 @@ static void legacyAddOptimizationPasses(legacy::PassManagerBase &mpm,
       builder.addExtension(PassManagerBuilder::EP_LoopOptimizerEnd,
                            legacyAddGarbageCollect2StackPass);
     }
+
+    if (!disableClosureToStack) {
+      builder.addExtension(PassManagerBuilder::EP_OptimizerLast,
+                           legacyAddClosure2StackPass);
+    }
+
+    // After the loop optimizations (LICM hoisting the array lengths), but
+    // before vectorization.
+    if (!disableBoundsCheckElim) {
+      builder.addExtension(PassManagerBuilder::EP_ScalarOptimizerLate,
+                           legacyAddBoundsCheckEliminationPass);
+    }
   }
 
   // EP_OptimizerLast does not exist in LLVM 3.0, add it manually below.
@@ -357,7 +409,7 @@ static void legacyAddOptimizationPasses(legacy::PassManagerBase &mpm,
 ////////////////////////////////////////////////////////////////////////////////
 // This function runs optimization passes based on command line arguments.
 // Returns true if any optimization passes were invoked.
-bool legacy_ldc_optimize_module(llvm::Module *M) {
+bool legacy_ldc_optimize_module(llvm::Module *M, TargetMachine &target) {
   // Create a PassManager to hold and optimize the collection of
   // per-module passes we are about to build.
   legacy::PassManager mpm;
@@ -383,14 +435,14 @@ bool legacy_ldc_optimize_module(llvm::Module *M) {
 
   // Add internal analysis passes from the target machine.
   mpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      target.getTargetIRAnalysis()));
 
   // Also set up a manager for the per-function passes.
   legacy::FunctionPassManager fpm(M);
 
   // Add internal analysis passes from the target machine.
   fpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      target.getTargetIRAnalysis()));
 
   // If the -strip-debug command line option was specified, add it before
   // anything else.
@@ -410,11 +462,6 @@ bool legacy_ldc_optimize_module(llvm::Module *M) {
   // Run per-module passes.
   mpm.run(*M);
 
-  // Verify the resulting module.
-  if (!noVerify) {
-    verifyModule(M);
-  }
-
   // Report that we run some passes.
   return true;
 }
@@ -538,6 +585,26 @@ static void addSimplifyDRuntimeCallsPass(ModulePassManager &mpm,
   }
 }
 
+static void addClosure2StackPass(ModulePassManager &mpm,
+                                 OptimizationLevel level) {
+  if (level == OptimizationLevel::O2 || level == OptimizationLevel::O3) {
+    mpm.addPass(Closure2StackPass(reportClosureOnStack));
+    if (verifyEach) {
+      mpm.addPass(VerifierPass());
+    }
+  }
+}
+
+static void addBoundsCheckEliminationPass(FunctionPassManager &fpm,
+                                          OptimizationLevel level) {
+  if (level == OptimizationLevel::O2 || level == OptimizationLevel::O3) {
+    fpm.addPass(BoundsCheckEliminationPass());
+    if (verifyEach) {
+      fpm.addPass(VerifierPass());
+    }
+  }
+}
+
 static void addGarbageCollect2StackPass(ModulePassManager &mpm,
                                          OptimizationLevel level ) {
   if (level == OptimizationLevel::O2  || level == OptimizationLevel::O3) {
@@ -616,7 +683,7 @@ static PipelineTuningOptions getPipelineTuningOptions(unsigned optLevelVal, unsi
  * PassManagerBuilder.
  */
 //Run optimization passes using the new pass manager
-void runOptimizationPasses(llvm::Module *M) {
+void runOptimizationPasses(llvm::Module *M, TargetMachine &target) {
   // Create a ModulePassManager to hold and optimize the collection of
   // per-module passes we are about to build.
 
@@ -658,7 +725,7 @@ void runOptimizationPasses(llvm::Module *M) {
   si.registerCallbacks(pic, &mam);
 #endif
 
-  PassBuilder pb(gTargetMachine, getPipelineTuningOptions(optLevelVal, sizeLevelVal),
+  PassBuilder pb(&target, getPipelineTuningOptions(optLevelVal, sizeLevelVal),
                  getPGOOptions(), &pic);
 
   // register the target library analysis directly because clang does :)
@@ -713,6 +780,14 @@ void runOptimizationPasses(llvm::Module *M) {
       //(had registerLoopOptimizerEndEPCallback) but that seems wrong
       pb.registerOptimizerLastEPCallback(addGarbageCollect2StackPass);
     }
+    if (!disableClosureToStack) {
+      pb.registerOptimizerLastEPCallback(addClosure2StackPass);
+    }
+    // After the loop optimizations (LICM hoisting the array lengths), but
+    // before vectorization.
+    if (!disableBoundsCheckElim) {
+      pb.registerScalarOptimizerLateEPCallback(addBoundsCheckEliminationPass);
+    }
   }
 
   pb.registerOptimizerLastEPCallback(addStripExternalsPass);
@@ -744,7 +819,7 @@ void runOptimizationPasses(llvm::Module *M) {
 ////////////////////////////////////////////////////////////////////////////////
 // This function runs optimization passes based on command line arguments.
 // Returns true if any optimization passes were invoked.
-bool new_ldc_optimize_module(llvm::Module *M) {
+bool new_ldc_optimize_module(llvm::Module *M, TargetMachine &target) {
   // Dont optimise spirv modules because turning GEPs into extracts triggers
   // asserts in the IR -> SPIR-V translation pass. SPIRV doesn't have a target
   // machine, so any optimisation passes that rely on it to provide analysis,
@@ -755,12 +830,7 @@ bool new_ldc_optimize_module(llvm::Module *M) {
   if (getComputeTargetType(M) == ComputeBackend::SPIRV)
     return false;
 
-  runOptimizationPasses(M);
-
-  // Verify the resulting module.
-  if (!noVerify) {
-    verifyModule(M);
-  }
+  runOptimizationPasses(M, target);
 
   // Report that we run some passes.
   return true;
@@ -772,17 +842,43 @@ bool new_ldc_optimize_module(llvm::Module *M) {
 // line arguments.  Calls either legacy version using legacy pass manager
 // or new version using the new pass managr
 // Returns true if any optimization passes were invoked.
-bool ldc_optimize_module(llvm::Module *M) {
+static bool runOptimizationPipeline(llvm::Module *M, TargetMachine &target) {
 #if LDC_LLVM_VER < 1400
-  return legacy_ldc_optimize_module(M);
+  return legacy_ldc_optimize_module(M, target);
 #elif LDC_LLVM_VER < 1500
-  return opts::isUsingLegacyPassManager() ? legacy_ldc_optimize_module(M)
-                                          : new_ldc_optimize_module(M);
+  return opts::isUsingLegacyPassManager()
+             ? legacy_ldc_optimize_module(M, target)
+             : new_ldc_optimize_module(M, target);
 #else
-  return new_ldc_optimize_module(M);
+  return new_ldc_optimize_module(M, target);
 #endif
 }
 
+bool ldc_optimize_module(llvm::Module *M) {
+  if (!runOptimizationPipeline(M, *gTargetMachine))
+    return false;
+
+  // Verify the resulting module.
+  if (!noVerify) {
+    verifyModule(M);
+  }
+
+  return true;
+}
+
+bool ldc_optimize_module(llvm::Module *M, llvm::TargetMachine &target,
+                         std::string &verifyErrors) {
+  if (!runOptimizationPipeline(M, target))
+    return false;
+
+  // Verify the resulting module, but leave reporting to the caller.
+  if (!noVerify) {
+    raw_string_ostream OS(verifyErrors);
+    llvm::verifyModule(*M, &OS);
+  }
+
+  return true;
+}
 
 // Verifies the module.
 void verifyModule(llvm::Module *m) {
@@ -26,10 +26,17 @@ class raw_ostream;
 namespace llvm {
 class Module;
 class TargetLibraryInfoImpl;
+class TargetMachine;
 }
 
 bool ldc_optimize_module(llvm::Module *m);
 
+// Variant of ldc_optimize_module() which doesn't depend on the global target
+// machine and doesn't report to the frontend, so that it can be run on a
+// codegen worker thread. Verification errors are appended to `verifyErrors`.
+bool ldc_optimize_module(llvm::Module *m, llvm::TargetMachine &target,
+                         std::string &verifyErrors);
+
 // Returns whether the normal, full inlining pass will be run.
 bool willInline();
 
@@ -0,0 +1,538 @@
+//===-- BoundsCheckElimination.cpp - Hoist and merge array bounds checks --===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A failing array bounds check branches to a block calling one of the druntime
+// `_d_arraybounds*` functions (directly or through its cold stub), which never
+// return. These extra loop exits keep the vectorizer from handling loops whose
+// indices LLVM can't prove to be in range.
+//
+// This pass removes the checks in innermost loops which compare an induction
+// variable {start,+,1} against a loop-invariant length. If the checks can't be
+// proven to hold in all iterations, the loop is versioned: a check of the whole
+// index range in the preheader selects between the loop without these checks
+// and an unchanged copy, which fails exactly like the original loop.
+//
+// Outside of loops (and before hoisting), a bounds check is merged into the
+// preceding one if only code without side effects lies in between. The merged
+// check branches to a block dispatching to the original failure paths, so that
+// the reported error stays the same.
+//
+//===----------------------------------------------------------------------===//
+
+#include "gen/passes/BoundsCheckElimination.h"
+#include "metadata.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+#define DEBUG_TYPE "dboundscheck"
+
+STATISTIC(NumChecksRemoved, "Number of bounds checks removed from loops");
+STATISTIC(NumLoopsVersioned, "Number of loops versioned for bounds checks");
+STATISTIC(NumChecksMerged, "Number of bounds checks merged into another one");
+
+static cl::opt<unsigned> MaxLoopSize(
+    "dboundscheck-max-loop-size", cl::ZeroOrMore, cl::Hidden, cl::init(256),
+    cl::desc("Maximum number of instructions of a loop to be versioned for "
+             "hoisting its bounds checks"));
+
+namespace {
+
+/// Returns whether BB only calls a druntime array bounds failure function.
+bool isBoundsFailureBlock(const BasicBlock *BB) {
+  if (!isa<UnreachableInst>(BB->getTerminator()))
+    return false;
+  auto Call = dyn_cast_or_null<CallInst>(BB->getTerminator()->getPrevNode());
+  const Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+  if (!Callee)
+    return false;
+  StringRef Name = Callee->getName();
+  Name.consume_front(COLD_STUB_PREFIX);
+  return Name.startswith("_d_arraybounds");
+}
+
+/// Returns whether all paths from BB end in a bounds failure, possibly via
+/// the dispatch blocks of merged checks or dedicated loop exit blocks.
+bool isFailurePath(const BasicBlock *BB, unsigned Depth = 8) {
+  if (isBoundsFailureBlock(BB))
+    return true;
+  auto Br = dyn_cast<BranchInst>(&BB->front());
+  if (!Br || Depth == 0)
+    return false;
+  for (const BasicBlock *Succ : Br->successors()) {
+    if (!isFailurePath(Succ, Depth - 1))
+      return false;
+  }
+  return true;
+}
+
+/// A conditional branch to a failure path.
+struct BoundsCheck {
+  BranchInst *Br = nullptr;
+  BasicBlock *Ok = nullptr;
+  BasicBlock *Fail = nullptr;
+  bool OkIfTrue = true;
+};
+
+bool getBoundsCheck(Instruction *Term, BoundsCheck &Check) {
+  auto Br = dyn_cast<BranchInst>(Term);
+  if (!Br || !Br->isConditional())
+    return false;
+  for (unsigned I = 0; I < 2; ++I) {
+    BasicBlock *Fail = Br->getSuccessor(I);
+    BasicBlock *Ok = Br->getSuccessor(1 - I);
+    if (Fail != Ok && isFailurePath(Fail) && !isFailurePath(Ok)) {
+      Check = {Br, Ok, Fail, I == 1};
+      return true;
+    }
+  }
+  return false;
+}
+
+/// An integer comparison `LHS Pred RHS`.
+template <typename T> struct Comparison {
+  ICmpInst::Predicate Pred;
+  T LHS;
+  T RHS;
+
+  bool operator==(const Comparison &Other) const {
+    return Pred == Other.Pred && LHS == Other.LHS && RHS == Other.RHS;
+  }
+};
+
+/// Collects the comparisons which must all hold for `Cond` to be `OkIfTrue`.
+bool collectOkConditions(Value *Cond, bool OkIfTrue,
+                         SmallVectorImpl<Comparison<Value *>> &Result) {
+  Value *A, *B;
+  if (match(Cond, m_Not(m_Value(A))))
+    return collectOkConditions(A, !OkIfTrue, Result);
+#if LDC_LLVM_VER >= 1200
+  if (OkIfTrue ? match(Cond, m_LogicalAnd(m_Value(A), m_Value(B)))
+               : match(Cond, m_LogicalOr(m_Value(A), m_Value(B)))) {
+#else
+  if (OkIfTrue ? match(Cond, m_And(m_Value(A), m_Value(B)))
+               : match(Cond, m_Or(m_Value(A), m_Value(B)))) {
+#endif
+    return collectOkConditions(A, OkIfTrue, Result) &&
+           collectOkConditions(B, OkIfTrue, Result);
+  }
+  auto Cmp = dyn_cast<ICmpInst>(Cond);
+  if (!Cmp)
+    return false;
+  Result.push_back({OkIfTrue ? Cmp->getPredicate() : Cmp->getInversePredicate(),
+                    Cmp->getOperand(0), Cmp->getOperand(1)});
+  return true;
+}
+
+class BoundsCheckOptimizer {
+  Function &F;
+  DominatorTree &DT;
+  LoopInfo &LI;
+  ScalarEvolution &SE;
+
+  using RangeCondition = Comparison<const SCEV *>;
+
+public:
+  BoundsCheckOptimizer(Function &F, DominatorTree &DT, LoopInfo &LI,
+                       ScalarEvolution &SE)
+      : F(F), DT(DT), LI(LI), SE(SE) {}
+
+  bool mergeChecks(BasicBlock *BB);
+  bool hoistLoopChecks(Loop *L);
+
+private:
+  bool getRangeConditions(const Comparison<Value *> &Cmp, Loop *L,
+                          const SCEV *MaxBackedgeTakenCount,
+                          SmallVectorImpl<RangeCondition> &Result);
+  bool isKnown(const RangeCondition &RC, Loop *L);
+  void versionLoop(Loop *L, Value *RangeOk);
+  void removeCheck(const BoundsCheck &Check);
+};
+
+/// Merges the bounds check ending BB with the ones directly following it.
+bool BoundsCheckOptimizer::mergeChecks(BasicBlock *BB) {
+  bool Changed = false;
+  while (true) {
+    BoundsCheck A, B;
+    if (!getBoundsCheck(BB->getTerminator(), A))
+      return Changed;
+    BasicBlock *Ok = A.Ok;
+    if (Ok == BB || Ok->getSinglePredecessor() != BB ||
+        isa<PHINode>(Ok->front()) || A.Fail->getSinglePredecessor() != BB ||
+        !getBoundsCheck(Ok->getTerminator(), B) || B.Ok == Ok ||
+        B.Fail->getSinglePredecessor() != Ok) {
+      return Changed;
+    }
+
+    // The code between the checks is skipped if the second one fails.
+    for (Instruction &I : *Ok) {
+      if (&I == B.Br)
+        break;
+      if (isa<DbgInfoIntrinsic>(I))
+        continue;
+      if (I.mayHaveSideEffects() ||
+          !isGuaranteedToTransferExecutionToSuccessor(&I)) {
+        return Changed;
+      }
+    }
+
+    // The second condition and its failure path need to be computed before
+    // the first check, i.e., speculatively.
+    SmallVector<Value *, 8> Worklist = {B.Br->getCondition()};
+    SmallVector<BasicBlock *, 4> FailBlocks = {B.Fail};
+    for (size_t I = 0; I < FailBlocks.size(); ++I) {
+      for (Instruction &Inst : *FailBlocks[I]) {
+        Worklist.append(Inst.op_begin(), Inst.op_end());
+      }
+      for (BasicBlock *Succ : successors(FailBlocks[I])) {
+        FailBlocks.push_back(Succ);
+      }
+    }
+    SmallPtrSet<Instruction *, 8> ToHoist;
+    bool CanHoist = true;
+    while (!Worklist.empty() && CanHoist) {
+      auto Inst = dyn_cast<Instruction>(Worklist.pop_back_val());
+      if (!Inst || Inst->getParent() != Ok || !ToHoist.insert(Inst).second)
+        continue;
+      CanHoist = isSafeToSpeculativelyExecute(Inst);
+      Worklist.append(Inst->op_begin(), Inst->op_end());
+    }
+    if (!CanHoist)
+      return Changed;
+
+    LLVM_DEBUG(errs() << "BoundsCheckElimination merging: " << *B.Br
+                      << "\n  into: " << *A.Br << '\n');
+
+    for (auto It = Ok->begin(); &*It != B.Br;) {
+      Instruction *Inst = &*It++;
+      if (ToHoist.count(Inst))
+        Inst->moveBefore(A.Br);
+    }
+
+    IRBuilder<> Builder(A.Br);
+    Value *OkA = A.Br->getCondition();
+    if (!A.OkIfTrue)
+      OkA = Builder.CreateNot(OkA);
+    Value *OkB = B.Br->getCondition();
+    if (!B.OkIfTrue)
+      OkB = Builder.CreateNot(OkB);
+    Value *Merged =
+        Builder.CreateSelect(OkA, OkB, Builder.getFalse(), "bounds.merged");
+
+    // If the merged check fails, the first one decides which failure to report.
+    BasicBlock *Dispatch = BasicBlock::Create(
+        F.getContext(), "bounds.fail.dispatch", &F, A.Fail);
+    BranchInst::Create(B.Fail, A.Fail, OkA, Dispatch);
+    A.Fail->replacePhiUsesWith(BB, Dispatch);
+    B.Fail->replacePhiUsesWith(Ok, Dispatch);
+
+    // Same weights as for the checks emitted by DtoCondBrToFailure().
+    auto MergedBr = BranchInst::Create(Ok, Dispatch, Merged, A.Br);
+    MDBuilder MDB(F.getContext());
+    MergedBr->setMetadata(LLVMContext::MD_prof,
+                          MDB.createBranchWeights(2000, 1));
+    MergedBr->setDebugLoc(A.Br->getDebugLoc());
+    A.Br->eraseFromParent();
+    BranchInst::Create(B.Ok, B.Br)->setDebugLoc(B.Br->getDebugLoc());
+    B.Br->eraseFromParent();
+
+    ++NumChecksMerged;
+    Changed = true;
+
+    // Continue with the check following the merged one.
+    if (B.Ok == BB || !MergeBlockIntoPredecessor(B.Ok, nullptr, &LI))
+      return Changed;
+  }
+}
+
+/// Determines the conditions for the comparison `Cmp` in a bounds check in L
+/// to hold in all iterations, to be checked before the loop. Fails if the
+/// comparison isn't one of an induction variable with step 1 and a loop
+/// invariant value.
+bool BoundsCheckOptimizer::getRangeConditions(
+    const Comparison<Value *> &Cmp, Loop *L, const SCEV *MaxBackedgeTakenCount,
+    SmallVectorImpl<RangeCondition> &Result) {
+  if (!Cmp.LHS->getType()->isIntegerTy())
+    return false;
+
+  const SCEV *LHS = SE.getSCEV(Cmp.LHS);
+  const SCEV *RHS = SE.getSCEV(Cmp.RHS);
+  ICmpInst::Predicate Pred = Cmp.Pred;
+  if (SE.isLoopInvariant(LHS, L)) {
+    std::swap(LHS, RHS);
+    Pred = ICmpInst::getSwappedPredicate(Pred);
+  }
+  if (Pred != ICmpInst::ICMP_ULT && Pred != ICmpInst::ICMP_ULE)
+    return false;
+
+  auto AR = dyn_cast<SCEVAddRecExpr>(LHS);
+  if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+      !AR->getStepRecurrence(SE)->isOne() || !SE.isLoopInvariant(RHS, L)) {
+    return false;
+  }
+  Type *Ty = AR->getType();
+  if (SE.getTypeSizeInBits(MaxBackedgeTakenCount->getType()) >
+      SE.getTypeSizeInBits(Ty)) {
+    return false;
+  }
+
+  // The loop runs at most MaxBackedgeTakenCount + 1 iterations, in which the
+  // index doesn't wrap around iff First <= Last.
+  const SCEV *First = AR->getStart();
+  const SCEV *Last = AR->evaluateAtIteration(
+      SE.getNoopOrZeroExtend(MaxBackedgeTakenCount, Ty), SE);
+  Result.push_back({ICmpInst::ICMP_ULE, First, Last});
+  Result.push_back({Pred, Last, RHS});
+  return true;
+}
+
+bool BoundsCheckOptimizer::isKnown(const RangeCondition &RC, Loop *L) {
+  return SE.isKnownPredicate(RC.Pred, RC.LHS, RC.RHS) ||
+         SE.isLoopEntryGuardedByCond(L, RC.Pred, RC.LHS, RC.RHS);
+}
+
+bool BoundsCheckOptimizer::hoistLoopChecks(Loop *L) {
+  BasicBlock *Preheader = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  if (!Preheader || !Latch || !L->isLoopExiting(Latch))
+    return false;
+
+  const SCEV *MaxBackedgeTakenCount = SE.getExitCount(L, Latch);
+  if (isa<SCEVCouldNotCompute>(MaxBackedgeTakenCount))
+    return false;
+
+  SmallVector<BoundsCheck, 4> Checks;
+  SmallVector<RangeCondition, 8> Conditions;
+  for (BasicBlock *BB : L->blocks()) {
+    BoundsCheck Check;
+    if (!getBoundsCheck(BB->getTerminator(), Check) || L->contains(Check.Fail))
+      continue;
+
+    SmallVector<Comparison<Value *>, 2> Cmps;
+    SmallVector<RangeCondition, 4> CheckConditions;
+    if (!collectOkConditions(Check.Br->getCondition(), Check.OkIfTrue, Cmps))
+      continue;
+    bool Hoistable = true;
+    for (const auto &Cmp : Cmps) {
+      Hoistable = Hoistable && getRangeConditions(Cmp, L, MaxBackedgeTakenCount,
+                                                  CheckConditions);
+    }
+    if (!Hoistable)
+      continue;
+
+    Checks.push_back(Check);
+    for (const auto &RC : CheckConditions) {
+      if (!isKnown(RC, L) && !is_contained(Conditions, RC))
+        Conditions.push_back(RC);
+    }
+  }
+  if (Checks.empty())
+    return false;
+
+  if (!Conditions.empty()) {
+    if (F.hasOptSize() || !L->isSafeToClone())
+      return false;
+    unsigned Size = 0;
+    for (BasicBlock *BB : L->blocks())
+      Size += BB->size();
+    if (Size > MaxLoopSize)
+      return false;
+
+    Instruction *InsertPt = Preheader->getTerminator();
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "bounds.range");
+    for (const auto &RC : Conditions) {
+#if LDC_LLVM_VER >= 1500
+      if (!Expander.isSafeToExpandAt(RC.LHS, InsertPt) ||
+          !Expander.isSafeToExpandAt(RC.RHS, InsertPt)) {
+#else
+      if (!isSafeToExpandAt(RC.LHS, InsertPt, SE) ||
+          !isSafeToExpandAt(RC.RHS, InsertPt, SE)) {
+#endif
+        return false;
+      }
+    }
+
+    LLVM_DEBUG(errs() << "BoundsCheckElimination versioning loop: " << *L);
+
+    IRBuilder<> Builder(InsertPt);
+    Value *RangeOk = nullptr;
+    for (const auto &RC : Conditions) {
+      Value *LHS = Expander.expandCodeFor(RC.LHS, RC.LHS->getType(), InsertPt);
+      Value *RHS = Expander.expandCodeFor(RC.RHS, RC.RHS->getType(), InsertPt);
+      Value *Cmp = Builder.CreateICmp(RC.Pred, LHS, RHS, "bounds.range.ok");
+      RangeOk = RangeOk ? Builder.CreateAnd(RangeOk, Cmp) : Cmp;
+    }
+    versionLoop(L, RangeOk);
+  }
+
+  SE.forgetLoop(L);
+  for (const auto &Check : Checks)
+    removeCheck(Check);
+  DT.recalculate(F);
+  return true;
+}
+
+/// Copies L. The preheader branches to the original loop if RangeOk holds and
+/// to the copy otherwise.
+void BoundsCheckOptimizer::versionLoop(Loop *L, Value *RangeOk) {
+  BasicBlock *CheckBB = L->getLoopPreheader();
+  SmallVector<BasicBlock *, 4> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+
+  BasicBlock *Preheader =
+      SplitBlock(CheckBB, CheckBB->getTerminator(), &DT, &LI, nullptr,
+                 L->getHeader()->getName() + ".ph");
+  ValueToValueMapTy VMap;
+  SmallVector<BasicBlock *, 16> ClonedBlocks;
+  Loop *Checked = cloneLoopWithPreheader(Preheader, CheckBB, L, VMap,
+                                         ".checked", &LI, &DT, ClonedBlocks);
+  remapInstructionsInBlocks(ClonedBlocks, VMap);
+
+  Instruction *Term = CheckBB->getTerminator();
+  BranchInst::Create(Preheader, Checked->getLoopPreheader(), RangeOk, Term);
+  Term->eraseFromParent();
+
+  // The loop is in LCSSA form, so only the PHIs in the exit blocks refer to
+  // values defined in the loop.
+  for (BasicBlock *Exit : ExitBlocks) {
+    for (PHINode &PN : Exit->phis()) {
+      for (unsigned I = 0, E = PN.getNumIncomingValues(); I != E; ++I) {
+        BasicBlock *Pred = PN.getIncomingBlock(I);
+        if (!L->contains(Pred))
+          continue;
+        Value *V = PN.getIncomingValue(I);
+        auto It = VMap.find(V);
+        if (It != VMap.end())
+          V = It->second;
+        PN.addIncoming(V, cast<BasicBlock>(VMap[Pred]));
+      }
+      SE.forgetValue(&PN);
+    }
+  }
+
+  ++NumLoopsVersioned;
+}
+
+void BoundsCheckOptimizer::removeCheck(const BoundsCheck &Check) {
+  BasicBlock *BB = Check.Br->getParent();
+  Value *Cond = Check.Br->getCondition();
+  Check.Fail->removePredecessor(BB);
+  BranchInst::Create(Check.Ok, Check.Br)->setDebugLoc(Check.Br->getDebugLoc());
+  Check.Br->eraseFromParent();
+  RecursivelyDeleteTriviallyDeadInstructions(Cond);
+  ++NumChecksRemoved;
+}
+
+} // anonymous namespace
+
+struct LLVM_LIBRARY_VISIBILITY BoundsCheckEliminationLegacyPass
+    : public FunctionPass {
+  BoundsCheckElimination pass;
+
+public:
+  static char ID; // Pass identification
+  BoundsCheckEliminationLegacyPass() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override {
+    if (skipFunction(F))
+      return false;
+    auto &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+    auto &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    auto &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    auto &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
+    return pass.run(F, DT, LI, SE, AC);
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<AssumptionCacheTracker>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+  }
+};
+char BoundsCheckEliminationLegacyPass::ID = 0;
+
+static RegisterPass<BoundsCheckEliminationLegacyPass>
+    X("dboundscheck", "Hoist and merge D array bounds checks");
+
+// Public interface to the pass.
+FunctionPass *createBoundsCheckElimination() {
+  return new BoundsCheckEliminationLegacyPass();
+}
+
+bool BoundsCheckElimination::run(Function &F, DominatorTree &DT, LoopInfo &LI,
+                                 ScalarEvolution &SE, AssumptionCache &AC) {
+  // Quick exit for functions without bounds checks.
+  bool HasChecks = false;
+  for (BasicBlock &BB : F) {
+    if (isBoundsFailureBlock(&BB)) {
+      HasChecks = true;
+      break;
+    }
+  }
+  if (!HasChecks)
+    return false;
+
+  BoundsCheckOptimizer Optimizer(F, DT, LI, SE);
+
+  // Merging deletes blocks.
+  SmallVector<WeakVH, 32> Blocks;
+  for (BasicBlock &BB : F)
+    Blocks.push_back(&BB);
+  bool Changed = false;
+  for (WeakVH &BB : Blocks) {
+    if (BB)
+      Changed |= Optimizer.mergeChecks(cast<BasicBlock>(BB));
+  }
+  if (Changed) {
+    DT.recalculate(F);
+    SE.forgetAllLoops();
+  }
+
+  SmallVector<Loop *, 8> Loops;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+#if LDC_LLVM_VER >= 1200
+    if (L->isInnermost())
+#else
+    if (L->empty())
+#endif
+      Loops.push_back(L);
+  }
+  for (Loop *L : Loops) {
+    bool Simplified = simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr, false);
+    Simplified |= formLCSSARecursively(*L, DT, &LI, &SE);
+    Changed |= Simplified;
+    Changed |= Optimizer.hoistLoopChecks(L);
+  }
+
+  return Changed;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include "gen/llvm.h"
+#include "gen/passes/Passes.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+
+/// This pass removes the array bounds checks of loop induction variables by
+/// checking the whole index range before the loop, and merges adjacent bounds
+/// checks.
+struct LLVM_LIBRARY_VISIBILITY BoundsCheckElimination {
+  bool run(llvm::Function &F, llvm::DominatorTree &DT, llvm::LoopInfo &LI,
+           llvm::ScalarEvolution &SE, llvm::AssumptionCache &AC);
+
+  static llvm::StringRef getPassName() { return "BoundsCheckElimination"; }
+};
+
+struct LLVM_LIBRARY_VISIBILITY BoundsCheckEliminationPass
+    : public llvm::PassInfoMixin<BoundsCheckEliminationPass> {
+
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &fam) {
+    auto &DT = fam.getResult<llvm::DominatorTreeAnalysis>(F);
+    auto &LI = fam.getResult<llvm::LoopAnalysis>(F);
+    auto &SE = fam.getResult<llvm::ScalarEvolutionAnalysis>(F);
+    auto &AC = fam.getResult<llvm::AssumptionAnalysis>(F);
+    if (pass.run(F, DT, LI, SE, AC)) {
+      return llvm::PreservedAnalyses::none();
+    }
+    return llvm::PreservedAnalyses::all();
+  }
+
+  static llvm::StringRef name() {
+    return BoundsCheckElimination::getPassName();
+  }
+
+private:
+  BoundsCheckElimination pass;
+};
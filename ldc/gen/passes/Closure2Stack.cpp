@@ -0,0 +1,394 @@
+//===-- Closure2Stack.cpp - Promote non-escaping closures to the stack ----===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The frontend allocates the frame of a function on the GC heap if a nested
+// function (e.g., a delegate literal) might outlive it. This pass performs an
+// escape analysis of these closure frames (tagged by CLOSURE_MD_KIND metadata)
+// and turns the ones which provably don't outlive the call of the creating
+// function into allocas.
+//
+// The frame pointer is tracked through casts, GEPs, PHIs, selects and
+// delegate aggregates. It escapes if it is stored, returned or passed to an
+// unknown function. Calls are followed into the (non-interposable) callees
+// defined in the module, and indirect calls through function pointers taken
+// from delegates carrying the frame into the nested functions which were
+// paired with the frame. `nocapture` and `scope` delegate parameters (see
+// SCOPE_DELEGATE_ATTR) are trusted.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "dclosure2stack"
+
+#include "gen/passes/Closure2Stack.h"
+#include "metadata.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+STATISTIC(NumClosuresToStack, "Number of closure frames promoted to allocas");
+
+static cl::opt<unsigned>
+    SizeLimit("dclosure2stack-size-limit", cl::ZeroOrMore, cl::Hidden,
+              cl::init(1024),
+              cl::desc("Require closure frames to be smaller than n bytes to "
+                       "be promoted."));
+
+static cl::opt<unsigned> MaxCallDepth(
+    "dclosure2stack-max-depth", cl::ZeroOrMore, cl::Hidden, cl::init(8),
+    cl::desc("Maximum depth of calls followed by the closure escape "
+             "analysis."));
+
+namespace {
+
+static bool hasScopeDelegateAttr(const AttributeList &Attrs, unsigned ArgNo) {
+#if LDC_LLVM_VER >= 1400
+  return Attrs.hasParamAttr(ArgNo, SCOPE_DELEGATE_ATTR);
+#else
+  return Attrs.hasAttribute(AttributeList::FirstArgIndex + ArgNo,
+                            SCOPE_DELEGATE_ATTR);
+#endif
+}
+
+/// Escape analysis for a single closure frame allocation.
+class FrameEscapeAnalysis {
+  /// Values which may carry the frame pointer, e.g., derived pointers,
+  /// delegates and the parameters they are passed to.
+  SmallPtrSet<const Value *, 32> Tainted;
+  /// Nested functions which were paired with the frame in a delegate, i.e.,
+  /// the possible targets of indirect calls through a tainted function
+  /// pointer.
+  SetVector<Function *> FrameFunctions;
+  /// Whether a delegate carrying the frame might contain unknown function
+  /// pointers.
+  bool UnknownFunctionPointers = false;
+  /// Indirect calls with tainted arguments: call, argument number and depth.
+  struct IndirectCall {
+    CallBase *CB;
+    unsigned ArgNo;
+    unsigned Depth;
+  };
+  SmallVector<IndirectCall, 4> IndirectCalls;
+  /// Parameters analyzed so far and whether they may let the frame escape.
+  /// Parameters under analysis are optimistically assumed not to, which is
+  /// fine as the whole analysis fails as soon as an escape is found.
+  DenseMap<std::pair<const Function *, unsigned>, bool> Params;
+
+public:
+  /// Tail calls in the creating function which are passed the frame.
+  SmallVector<CallInst *, 4> TailCalls;
+
+  bool mayEscape(Instruction *Alloc);
+
+private:
+  bool valueMayEscape(Value *V, unsigned Depth);
+  bool callArgMayEscape(CallBase *CB, unsigned ArgNo, unsigned Depth);
+  bool paramMayEscape(Function *F, unsigned ArgNo, unsigned Depth);
+  void collectInsertedFunctions(Value *Aggregate);
+};
+
+bool FrameEscapeAnalysis::mayEscape(Instruction *Alloc) {
+  if (valueMayEscape(Alloc, 0))
+    return true;
+
+  // Resolve the indirect calls, until no new nested functions are found.
+  size_t NumResolved = 0, NumFunctions = 0;
+  while (NumResolved != IndirectCalls.size() ||
+         NumFunctions != FrameFunctions.size()) {
+    if (NumFunctions != FrameFunctions.size()) {
+      // Recheck all calls against the new functions.
+      NumResolved = 0;
+      NumFunctions = FrameFunctions.size();
+    }
+    const IndirectCall Call = IndirectCalls[NumResolved++];
+    const Value *Callee = Call.CB->getCalledOperand()->stripPointerCasts();
+    if (UnknownFunctionPointers || !Tainted.count(Callee)) {
+      LLVM_DEBUG(errs() << "Unknown indirect callee: " << *Call.CB << '\n');
+      return true;
+    }
+    for (size_t I = 0; I < FrameFunctions.size(); ++I) {
+      if (paramMayEscape(FrameFunctions[I], Call.ArgNo, Call.Depth))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+bool FrameEscapeAnalysis::valueMayEscape(Value *V, unsigned Depth) {
+  if (!Tainted.insert(V).second)
+    return false;
+
+  SmallVector<Value *, 16> Worklist;
+  Worklist.push_back(V);
+  auto follow = [&](Value *Derived) {
+    if (Tainted.insert(Derived).second)
+      Worklist.push_back(Derived);
+  };
+
+  while (!Worklist.empty()) {
+    V = Worklist.pop_back_val();
+    for (Use &U : V->uses()) {
+      auto I = dyn_cast<Instruction>(U.getUser());
+      if (!I)
+        return true;
+
+      switch (I->getOpcode()) {
+      case Instruction::BitCast:
+      case Instruction::AddrSpaceCast:
+      case Instruction::GetElementPtr:
+      case Instruction::PHI:
+      case Instruction::Select:
+      case Instruction::PtrToInt:
+      case Instruction::IntToPtr:
+      case Instruction::Add:
+      case Instruction::Sub:
+      case Instruction::And:
+      case Instruction::Freeze:
+      case Instruction::ExtractValue:
+        follow(I);
+        break;
+      case Instruction::InsertValue:
+        collectInsertedFunctions(I);
+        follow(I);
+        break;
+      case Instruction::ICmp:
+        break;
+      case Instruction::Load:
+        // The frame pointer is never stored, so loads can't yield it.
+        break;
+      case Instruction::Store:
+        if (U.getOperandNo() == 0) {
+          LLVM_DEBUG(errs() << "Stored: " << *I << '\n');
+          return true;
+        }
+        break;
+      case Instruction::Call:
+      case Instruction::Invoke: {
+        auto CB = cast<CallBase>(I);
+        if (CB->isCallee(&U))
+          break;
+        if (!CB->isArgOperand(&U)) {
+          LLVM_DEBUG(errs() << "Operand bundle: " << *I << '\n');
+          return true;
+        }
+        if (callArgMayEscape(CB, CB->getArgOperandNo(&U), Depth))
+          return true;
+        break;
+      }
+      default:
+        LLVM_DEBUG(errs() << "Escapes via: " << *I << '\n');
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+bool FrameEscapeAnalysis::callArgMayEscape(CallBase *CB, unsigned ArgNo,
+                                           unsigned Depth) {
+  if (auto Call = dyn_cast<CallInst>(CB)) {
+    if (Call->isMustTailCall())
+      return true;
+    // Allocas must not be passed to tail calls.
+    if (Depth == 0 && Call->isTailCall())
+      TailCalls.push_back(Call);
+  }
+
+  if (auto II = dyn_cast<IntrinsicInst>(CB)) {
+    switch (II->getIntrinsicID()) {
+    case Intrinsic::memcpy:
+    case Intrinsic::memmove:
+    case Intrinsic::memset:
+    case Intrinsic::lifetime_start:
+    case Intrinsic::lifetime_end:
+    case Intrinsic::dbg_declare:
+    case Intrinsic::dbg_value:
+      return false;
+    default:
+      break;
+    }
+  }
+
+  // Not captured if the callee can't store it anywhere.
+  if (CB->doesNotCapture(ArgNo) ||
+      (CB->onlyReadsMemory() && CB->doesNotThrow() &&
+       CB->getType()->isVoidTy()) ||
+      hasScopeDelegateAttr(CB->getAttributes(), ArgNo)) {
+    return false;
+  }
+
+  if (auto Callee =
+          dyn_cast<Function>(CB->getCalledOperand()->stripPointerCasts())) {
+    return paramMayEscape(Callee, ArgNo, Depth + 1);
+  }
+
+  // Resolved once all nested functions paired with the frame are known.
+  IndirectCalls.push_back({CB, ArgNo, Depth + 1});
+  return false;
+}
+
+bool FrameEscapeAnalysis::paramMayEscape(Function *F, unsigned ArgNo,
+                                         unsigned Depth) {
+  if (hasScopeDelegateAttr(F->getAttributes(), ArgNo))
+    return false;
+  if (ArgNo >= F->arg_size()) {
+    // Variadic argument.
+    return true;
+  }
+  if (Depth > MaxCallDepth || F->isDeclaration() || F->isInterposable()) {
+    LLVM_DEBUG(errs() << "Cannot analyze callee " << F->getName() << '\n');
+    return true;
+  }
+
+  const auto Key = std::make_pair(F, ArgNo);
+  auto It = Params.find(Key);
+  if (It != Params.end())
+    return It->second;
+
+  Params[Key] = false;
+  const bool Result = valueMayEscape(F->getArg(ArgNo), Depth);
+  Params[Key] = Result;
+  return Result;
+}
+
+// Records the function pointers in a delegate (or other aggregate) which
+// carries the frame. The nested functions are the possible targets of
+// indirect calls with the frame.
+void FrameEscapeAnalysis::collectInsertedFunctions(Value *Aggregate) {
+  auto record = [&](Value *Element) {
+    if (Tainted.count(Element) || !Element->getType()->isPointerTy())
+      return;
+    Element = Element->stripPointerCasts();
+    if (auto F = dyn_cast<Function>(Element)) {
+      FrameFunctions.insert(F);
+    } else if (!isa<Constant>(Element) || isa<GlobalValue>(Element)) {
+      UnknownFunctionPointers = true;
+    }
+  };
+
+  while (auto IV = dyn_cast<InsertValueInst>(Aggregate)) {
+    record(IV->getInsertedValueOperand());
+    Aggregate = IV->getAggregateOperand();
+  }
+
+  if (Tainted.count(Aggregate)) {
+    // Its function pointers have been recorded already.
+  } else if (auto C = dyn_cast<Constant>(Aggregate)) {
+    if (C->getType()->isAggregateType()) {
+      for (unsigned I = 0, E = C->getNumOperands(); I != E; ++I)
+        record(C->getOperand(I));
+    }
+  } else {
+    UnknownFunctionPointers = true;
+  }
+}
+
+// Returns whether the instruction may be executed multiple times during a
+// single call of its function.
+bool isInCycle(Instruction *I) {
+  BasicBlock *BB = I->getParent();
+  SmallVector<BasicBlock *, 8> Worklist(succ_begin(BB), succ_end(BB));
+  return !Worklist.empty() &&
+         isPotentiallyReachableFromMany(Worklist, BB, nullptr);
+}
+
+void promote(CallBase *CB, uint64_t Size) {
+  BasicBlock &Entry = CB->getFunction()->getEntryBlock();
+  IRBuilder<> B(&Entry, Entry.begin());
+  AllocaInst *Frame =
+      B.CreateAlloca(ArrayType::get(B.getInt8Ty(), Size), nullptr,
+                     ".closure_frame");
+  // The GC guarantees an alignment of 16.
+  Frame->setAlignment(Align(16));
+  CB->replaceAllUsesWith(B.CreateBitCast(Frame, CB->getType()));
+
+  if (auto Invoke = dyn_cast<InvokeInst>(CB)) {
+    BranchInst::Create(Invoke->getNormalDest(), Invoke);
+    Invoke->getUnwindDest()->removePredecessor(CB->getParent());
+  }
+  CB->eraseFromParent();
+}
+
+} // anonymous namespace
+
+struct LLVM_LIBRARY_VISIBILITY Closure2StackLegacyPass : public ModulePass {
+  static char ID; // Pass identification, replacement for typeid
+  explicit Closure2StackLegacyPass(Closure2StackReporter report = {})
+      : ModulePass(ID) {
+    pass.report = std::move(report);
+  }
+  Closure2Stack pass;
+
+  bool runOnModule(Module &M) override { return pass.run(M); }
+};
+
+char Closure2StackLegacyPass::ID = 0;
+static RegisterPass<Closure2StackLegacyPass>
+    X("dclosure2stack", "Promote non-escaping closure frames to the stack");
+
+ModulePass *createClosure2StackPass(Closure2StackReporter report) {
+  return new Closure2StackLegacyPass(std::move(report));
+}
+
+bool Closure2Stack::run(Module &M) {
+  Function *AllocMemory = M.getFunction("_d_allocmemory");
+  if (!AllocMemory)
+    return false;
+
+  SmallVector<CallBase *, 8> Frames;
+  for (User *U : AllocMemory->users()) {
+    auto CB = dyn_cast<CallBase>(U);
+    if (CB && CB->getCalledOperand() == AllocMemory &&
+        CB->getMetadata(CLOSURE_MD_KIND)) {
+      Frames.push_back(CB);
+    }
+  }
+
+  bool Changed = false;
+  for (CallBase *CB : Frames) {
+    LLVM_DEBUG(errs() << "Closure2Stack inspecting: " << *CB << '\n');
+
+    auto Size = dyn_cast<ConstantInt>(CB->getArgOperand(0));
+    if (!Size || Size->getZExtValue() >= SizeLimit || isInCycle(CB))
+      continue;
+
+    FrameEscapeAnalysis Analysis;
+    if (Analysis.mayEscape(CB))
+      continue;
+
+    if (report) {
+      MDNode *Info = CB->getMetadata(CLOSURE_MD_KIND);
+      report(cast<MDString>(Info->getOperand(0))->getString(),
+             cast<MDString>(Info->getOperand(1))->getString());
+    }
+
+    for (CallInst *Call : Analysis.TailCalls)
+      Call->setTailCall(false);
+    promote(CB, Size->getZExtValue());
+    ++NumClosuresToStack;
+    Changed = true;
+  }
+
+  return Changed;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "gen/llvm.h"
+#include "gen/passes/Passes.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+/// This pass replaces the GC allocations of closure frames which provably
+/// don't outlive the call of the function creating them by allocas.
+struct LLVM_LIBRARY_VISIBILITY Closure2Stack {
+  Closure2StackReporter report;
+
+  bool run(llvm::Module &M);
+};
+
+struct LLVM_LIBRARY_VISIBILITY Closure2StackPass
+    : public llvm::PassInfoMixin<Closure2StackPass> {
+
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &mam) {
+    if (pass.run(M)) {
+      return llvm::PreservedAnalyses::none();
+    }
+    return llvm::PreservedAnalyses::all();
+  }
+
+  static llvm::StringRef name() { return "Closure2Stack"; }
+
+  explicit Closure2StackPass(Closure2StackReporter report = {}) {
+    pass.report = std::move(report);
+  }
+
+private:
+  Closure2Stack pass;
+};
@@ -10,6 +10,10 @@
 // This file attempts to turn allocations on the garbage-collected heap into
 // stack allocations.
 //
+// Objects of classes with destructors are finalized at the function exits
+// reachable from the allocation (via `_d_callfinalizer`), including the
+// unwinding paths.
+//
 //===----------------------------------------------------------------------===//
 
 #include "gen/attributes.h"
@@ -18,24 +22,37 @@
 #include "gen/runtime.h"
 #include "llvm/Pass.h"
 #include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Dominators.h"
+#if LDC_LLVM_VER >= 1700
+#include "llvm/IR/EHPersonalities.h"
+#else
+#include "llvm/Analysis/EHPersonalities.h"
+#endif
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Compiler.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/KnownBits.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
 #include <algorithm>
 
 #define DEBUG_TYPE "dgc2stack"
@@ -47,6 +64,8 @@ STATISTIC(NumToDynSize,
           "Number of calls promoted to dynamically-sized allocas");
 STATISTIC(NumDeleted,
           "Number of GC calls deleted because the return value was unused");
+STATISTIC(NumFinalized,
+          "Number of promoted class instances finalized at function exit");
 
 static cl::opt<unsigned>
     SizeLimit("dgc2stack-size-limit", cl::ZeroOrMore, cl::Hidden,
@@ -227,14 +246,14 @@ bool AllocClassFI::analyze(CallBase *CB, const G2StackAnalysis &A) {
     return false;
   }
 
-  // Inserting destructor calls is not implemented yet, so classes
-  // with destructors are ignored for now.
+  // Objects of classes with destructors need to be finalized, see
+  // insertFinalizerCalls().
   auto hasDestructor =
       mdconst::dyn_extract<Constant>(node->getOperand(CD_Finalize));
-  if (hasDestructor == nullptr ||
-      hasDestructor != ConstantInt::getFalse(A.M.getContext())) {
+  if (hasDestructor == nullptr) {
     return false;
   }
+  HasFinalizer = !hasDestructor->isZeroValue();
 
   Ty = mdconst::dyn_extract<Constant>(node->getOperand(CD_BodyType))
            ->getType();
@@ -316,7 +335,15 @@ class LLVM_LIBRARY_VISIBILITY GarbageCollect2StackLegacyPass : public FunctionPa
       return CGPass ? &CGPass->getCallGraph() : nullptr;
     };
 
-    return pass.run(F, getDT, getCG);
+    std::unique_ptr<OptimizationRemarkEmitter> ORE;
+    auto getORE = [&]() -> OptimizationRemarkEmitter & {
+      if (!ORE) {
+        ORE = std::make_unique<OptimizationRemarkEmitter>(&F);
+      }
+      return *ORE;
+    };
+
+    return pass.run(F, getDT, getCG, getORE);
   }
   StringRef getPassName() const override { return GarbageCollect2Stack::getPassName(); }
 
@@ -359,16 +386,221 @@ static void RemoveCall(CallBase *CB, const G2StackAnalysis &A) {
   static_cast<Instruction *>(CB)->eraseFromParent();
 }
 
+static void addCallEdge(CallBase *Call, const G2StackAnalysis &A) {
+  if (A.CGNode) {
+    Function *Callee = Call->getCalledFunction();
+    A.CGNode->addCalledFunction(Call, Callee ? A.CG->getOrInsertFunction(Callee)
+                                             : A.CG->getCallsExternalNode());
+  }
+}
+
+/// Returns whether I may be executed again after it has been executed once.
+static bool isInCycle(Instruction *I) {
+  BasicBlock *BB = I->getParent();
+  SmallVector<BasicBlock *, 8> Worklist(succ_begin(BB), succ_end(BB));
+  return !Worklist.empty() &&
+         isPotentiallyReachableFromMany(Worklist, BB, nullptr);
+}
+
+/// Returns whether Call resumes unwinding at the end of a landing pad, the way
+/// LDC emits it (see TryCatchFinallyScopes::getOrCreateResumeUnwindBlock()).
+static bool isUnwindResumeCall(const CallInst *Call) {
+  const Function *Callee = Call->getCalledFunction();
+  return Callee && Callee->isDeclaration() &&
+         StringSwitch<bool>(Callee->getName())
+             .Cases("_Unwind_Resume", "_d_eh_resume_unwind",
+                    "_Unwind_SjLj_Resume", true)
+             .Default(false);
+}
+
+/// Collects the points where the function may be left after executing Start:
+/// returns and resumed unwinding (Exits), as well as calls which may unwind
+/// without landing pad (UnwindingCalls). Returns false for funclet-based
+/// exception handling (MSVC), which isn't supported.
+static bool collectFunctionExits(Instruction *Start,
+                                 SmallVectorImpl<Instruction *> &Exits,
+                                 SmallVectorImpl<WeakVH> &UnwindingCalls) {
+  typedef std::pair<BasicBlock *, BasicBlock::iterator> StartPoint;
+  SmallVector<StartPoint, 16> Worklist;
+  SmallSet<BasicBlock *, 16> Visited;
+  Worklist.push_back(
+      StartPoint(Start->getParent(), std::next(Start->getIterator())));
+
+  while (!Worklist.empty()) {
+    StartPoint sp = Worklist.pop_back_val();
+    BasicBlock *B = sp.first;
+    for (auto I = sp.second, E = B->end(); I != E; ++I) {
+      if (I->isEHPad() && !isa<LandingPadInst>(I)) {
+        return false;
+      }
+      if (isa<ReturnInst>(I) || isa<ResumeInst>(I)) {
+        Exits.push_back(&*I);
+      } else if (auto Call = dyn_cast<CallInst>(I)) {
+        if (isUnwindResumeCall(Call)) {
+          Exits.push_back(Call);
+        } else if (Call->mayThrow() && !Call->isInlineAsm() &&
+                   !isa<IntrinsicInst>(Call)) {
+          UnwindingCalls.push_back(Call);
+        }
+      }
+    }
+    for (BasicBlock *Succ : successors(B)) {
+      if (Visited.insert(Succ).second) {
+        Worklist.push_back(StartPoint(Succ, Succ->begin()));
+      }
+    }
+  }
+  return true;
+}
+
+/// Returns the personality function for a new cleanup landing pad in F: its
+/// own one, or the one of another function in the module. Returns null if
+/// there's none, or if it is funclet-based.
+static Constant *getLandingPadPersonality(Function &F) {
+  Constant *Personality = F.hasPersonalityFn() ? F.getPersonalityFn() : nullptr;
+  for (auto I = F.getParent()->begin(), E = F.getParent()->end();
+       !Personality && I != E; ++I) {
+    if (I->hasPersonalityFn()) {
+      Personality = I->getPersonalityFn();
+    }
+  }
+  if (!Personality || isScopedEHPersonality(classifyEHPersonality(Personality))) {
+    return nullptr;
+  }
+  return Personality;
+}
+
+namespace {
+/// A promoted class instance with destructor.
+struct FinalizedObject {
+  AllocaInst *Mem;
+  /// The function exits reachable from the allocation.
+  SmallVector<Instruction *, 4> Exits;
+  /// The calls which may unwind without landing pad, reachable from the
+  /// allocation. Null if the call has been removed in the meantime.
+  SmallVector<WeakVH, 4> UnwindingCalls;
+};
+}
+
+/// Calls the finalizer of the promoted objects at the function exits
+/// reachable from their allocation. Calls which may unwind without landing
+/// pad are turned into invokes, with a new cleanup landing pad finalizing all
+/// objects.
+/// The vtable pointers of the objects are nulled in the entry block, which
+/// makes finalizing an object which hasn't been allocated (yet) a no-op; so is
+/// finalizing an object twice, e.g., after an explicit `destroy()` (see
+/// rt_finalize2() in druntime).
+static void insertFinalizerCalls(Function &F,
+                                 ArrayRef<FinalizedObject> Objects,
+                                 const G2StackAnalysis &A) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  llvm::Type *VoidPtrTy = llvm::Type::getInt8PtrTy(Ctx);
+  FunctionCallee Finalizer = M.getOrInsertFunction(
+      "_d_callfinalizer", llvm::Type::getVoidTy(Ctx), VoidPtrTy);
+
+  auto emitFinalizerCalls = [&](IRBuilder<> &B,
+                                ArrayRef<const FinalizedObject *> Objs) {
+    // In reverse order of allocation, like scope class instances.
+    for (auto Obj : llvm::reverse(Objs)) {
+      CallInst *Call =
+          B.CreateCall(Finalizer, B.CreateBitCast(Obj->Mem, VoidPtrTy));
+      addCallEdge(Call, A);
+    }
+  };
+
+  MapVector<Instruction *, SmallVector<const FinalizedObject *, 2>> ExitObjects;
+  SmallSetVector<CallInst *, 8> UnwindingCalls;
+  SmallVector<const FinalizedObject *, 4> AllObjects;
+  for (auto &Obj : Objects) {
+    IRBuilder<> B(Obj.Mem->getNextNode());
+    B.CreateStore(Constant::getNullValue(VoidPtrTy),
+                  B.CreateBitCast(Obj.Mem, VoidPtrTy->getPointerTo()));
+
+    for (Instruction *Exit : Obj.Exits) {
+      ExitObjects[Exit].push_back(&Obj);
+    }
+    for (const WeakVH &Call : Obj.UnwindingCalls) {
+      if (auto CI = dyn_cast_or_null<CallInst>(Call)) {
+        UnwindingCalls.insert(CI);
+      }
+    }
+    AllObjects.push_back(&Obj);
+    NumFinalized++;
+  }
+
+  for (auto &Exit : ExitObjects) {
+    IRBuilder<> B(Exit.first);
+    emitFinalizerCalls(B, Exit.second);
+  }
+
+  if (UnwindingCalls.empty()) {
+    return;
+  }
+
+  // Checked by the caller before promoting.
+  if (!F.hasPersonalityFn()) {
+    F.setPersonalityFn(getLandingPadPersonality(F));
+  }
+
+  llvm::Type *LandingPadTy = nullptr;
+  for (auto &I : instructions(F)) {
+    if (auto LP = dyn_cast<LandingPadInst>(&I)) {
+      LandingPadTy = LP->getType();
+      break;
+    }
+  }
+  if (!LandingPadTy) {
+    LandingPadTy = StructType::get(VoidPtrTy, llvm::Type::getInt32Ty(Ctx));
+  }
+
+  BasicBlock *Cleanup = BasicBlock::Create(Ctx, "gc2stack.cleanup", &F);
+  IRBuilder<> B(Cleanup);
+  LandingPadInst *LP = B.CreateLandingPad(LandingPadTy, 0);
+  LP->setCleanup(true);
+  emitFinalizerCalls(B, AllObjects);
+
+  // Resume unwinding the same way as the existing landing pads.
+  Function *ResumeFn = nullptr;
+  for (const char *Name :
+       {"_Unwind_Resume", "_d_eh_resume_unwind", "_Unwind_SjLj_Resume"}) {
+    ResumeFn = M.getFunction(Name);
+    if (ResumeFn && ResumeFn->arg_size() == 1) {
+      break;
+    }
+    ResumeFn = nullptr;
+  }
+  if (ResumeFn) {
+    Value *EHPtr = B.CreateBitCast(B.CreateExtractValue(LP, 0),
+                                   ResumeFn->getFunctionType()->getParamType(0));
+    addCallEdge(B.CreateCall(ResumeFn, EHPtr), A);
+    B.CreateUnreachable();
+  } else {
+    B.CreateResume(LP);
+  }
+
+  for (CallInst *Call : UnwindingCalls) {
+    if (A.CGNode) {
+      A.CGNode->removeCallEdgeFor(*Call);
+    }
+    BasicBlock *BB = Call->getParent();
+    changeToInvokeAndSplitBasicBlock(Call, Cleanup);
+    addCallEdge(cast<InvokeInst>(BB->getTerminator()), A);
+  }
+}
+
 static bool
 isSafeToStackAllocateArray(BasicBlock::iterator Alloc, DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           bool AllowLocalSlots);
 static bool
 isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &DT,
-                      SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                      SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                      bool AllowLocalSlots);
 
 /// runOnFunction - Top level algorithm.
 ///
-bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> getDT, std::function<CallGraph* ()> getCG) {
+bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> getDT, std::function<CallGraph* ()> getCG, std::function<OptimizationRemarkEmitter &()> getORE) {
   LLVM_DEBUG(errs() << "\nRunning -dgc2stack on function " << F.getName() << '\n');
   DominatorTree& DT = getDT();
   CallGraph* CG = getCG();
@@ -381,6 +613,7 @@ bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> get
   IRBuilder<> AllocaBuilder(&Entry, Entry.begin());
 
   bool Changed = false;
+  SmallVector<FinalizedObject, 2> Finalized;
   for (auto &BB : F) {
     for (auto I = BB.begin(), E = BB.end(); I != E;) {
       auto originalI = I;
@@ -427,17 +660,37 @@ bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> get
         continue;
       }
 
+      // Storing the memory in local array variables is only supported if
+      // the allocation can't be executed again while these are live.
+      const bool InCycle = isInCycle(CB);
+
       SmallVector<CallInst *, 4> RemoveTailCallInsts;
       if (info->ReturnType == ReturnType::Array) {
-        if (!isSafeToStackAllocateArray(originalI, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocateArray(originalI, DT, RemoveTailCallInsts,
+                                        !InCycle)) {
           continue;
         }
       } else {
-        if (!isSafeToStackAllocate(originalI, CB, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocate(originalI, CB, DT, RemoveTailCallInsts,
+                                   !InCycle)) {
           continue;
         }
       }
 
+      // An object with destructor must be finalized before its memory is
+      // reused. Landing pads can only be added for the Itanium-style
+      // exception handling.
+      const bool NeedsFinalizer = info == &AllocClass && AllocClass.HasFinalizer;
+      FinalizedObject FinalizedObj;
+      if (NeedsFinalizer &&
+          (InCycle ||
+           !collectFunctionExits(CB, FinalizedObj.Exits,
+                                 FinalizedObj.UnwindingCalls) ||
+           (!FinalizedObj.UnwindingCalls.empty() &&
+            !getLandingPadPersonality(F)))) {
+        continue;
+      }
+
       // Let's alloca this!
       Changed = true;
 
@@ -452,6 +705,21 @@ bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> get
 
       LLVM_DEBUG(errs() << "Promoted to: " << *newVal);
 
+      getORE().emit([&]() {
+        OptimizationRemark R(DEBUG_TYPE, "Promoted", CB);
+        R << "promoted " << ore::NV("Callee", Callee)
+          << " allocation to the stack";
+        if (NeedsFinalizer) {
+          R << ", finalized at function exit";
+        }
+        return R;
+      });
+
+      if (NeedsFinalizer) {
+        FinalizedObj.Mem = cast<AllocaInst>(newVal);
+        Finalized.push_back(std::move(FinalizedObj));
+      }
+
       // Make sure the type is the same as it was before, and replace all
       // uses of the runtime call with the alloca.
       if (newVal->getType() != CB->getType()) {
@@ -463,6 +731,11 @@ bool GarbageCollect2Stack::run(Function &F, std::function<DominatorTree& ()> get
     }
   }
 
+  // Modifies the CFG, so only done after all promotions.
+  if (!Finalized.empty()) {
+    insertFinalizerCalls(F, Finalized, A);
+  }
+
   return Changed;
 }
 
@@ -620,6 +893,133 @@ static bool mayBeUsedAfterRealloc(Instruction *Def, BasicBlock::iterator Alloc,
   return false;
 }
 
+/// Returns the index of the array parameter of druntime's functions growing
+/// arrays in place (`_d_arrayappendcTX(ti, ref byte[] px, n)` and
+/// `_d_arraysetlength{,i}T(ti, newlength, void[]* p)`), or -1 for other calls.
+static int getGrownArrayArgNr(const CallBase *CB) {
+  const Function *Callee = CB->getCalledFunction();
+  if (Callee == nullptr || !Callee->isDeclaration()) {
+    return -1;
+  }
+  return StringSwitch<int>(Callee->getName())
+      .Case("_d_arrayappendcTX", 1)
+      .Cases("_d_arraysetlengthT", "_d_arraysetlengthiT", 2)
+      .Default(-1);
+}
+
+/// Returns true if storing a pointer to the allocated memory at byte offset
+/// PtrOffset of Slot doesn't capture it. This requires Slot to be a local
+/// array variable whose address is only used to load and store its fields,
+/// and to grow it via druntime.
+/// Growing an array never extends the promoted memory in place - it isn't a
+/// GC block, so druntime doesn't know of any spare capacity - but moves the
+/// array to a new GC allocation. So the promoted memory stays bounded by the
+/// initially allocated size.
+/// The values which may point to the memory afterwards (loads of the pointer
+/// field and the arrays returned by druntime) are added to Derived.
+static bool isLocalArraySlot(AllocaInst *Slot, int64_t PtrOffset,
+                             SmallVectorImpl<Instruction *> &Derived) {
+  const DataLayout &DL = Slot->getModule()->getDataLayout();
+  const int64_t PtrSize = DL.getPointerSize();
+
+  SmallVector<Instruction *, 8> Worklist;
+  Worklist.push_back(Slot);
+  while (!Worklist.empty()) {
+    Instruction *P = Worklist.pop_back_val();
+    for (Use &U : P->uses()) {
+      Instruction *I = cast<Instruction>(U.getUser());
+      int64_t Offset = 0;
+      switch (I->getOpcode()) {
+      case Instruction::BitCast:
+      case Instruction::GetElementPtr:
+        Worklist.push_back(I);
+        break;
+      case Instruction::Load: {
+        if (GetPointerBaseWithConstantOffset(P, Offset, DL) != Slot) {
+          return false;
+        }
+        const int64_t Size = DL.getTypeStoreSize(I->getType());
+        if (Offset >= PtrOffset + PtrSize || Offset + Size <= PtrOffset) {
+          // Doesn't load (part of) the pointer.
+          break;
+        }
+        if (Offset != PtrOffset || !I->getType()->isPointerTy()) {
+          return false;
+        }
+        Derived.push_back(I);
+        break;
+      }
+      case Instruction::Store:
+        if (U.getOperandNo() == 0) {
+          // Stored the address of the array variable.
+          return false;
+        }
+        break;
+      case Instruction::Call:
+      case Instruction::Invoke: {
+        auto CB = cast<CallBase>(I);
+        if (CB->isLifetimeStartOrEnd()) {
+          break;
+        }
+        if (!CB->isArgOperand(&U) ||
+            static_cast<int>(CB->getArgOperandNo(&U)) !=
+                getGrownArrayArgNr(CB) ||
+            CB->hasStructRetAttr() ||
+            GetPointerBaseWithConstantOffset(P, Offset, DL) != Slot ||
+            Offset + PtrSize != PtrOffset) {
+          return false;
+        }
+        // The returned array may still point to the memory (e.g., after
+        // shrinking).
+        for (User *RU : CB->users()) {
+          auto EVI = dyn_cast<ExtractValueInst>(RU);
+          if (!EVI || EVI->getNumIndices() != 1) {
+            return false;
+          }
+          if (EVI->getIndices()[0] == 1) {
+            if (!EVI->getType()->isPointerTy()) {
+              return false;
+            }
+            Derived.push_back(EVI);
+          }
+        }
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/// Returns true if the store of the allocated memory SI doesn't capture it,
+/// see isLocalArraySlot().
+static bool isStoredToLocalArraySlot(StoreInst *SI,
+                                     SmallVectorImpl<Instruction *> &Derived) {
+  const DataLayout &DL = SI->getModule()->getDataLayout();
+  int64_t Offset = 0;
+  auto Slot = dyn_cast<AllocaInst>(
+      GetPointerBaseWithConstantOffset(SI->getPointerOperand(), Offset, DL));
+  if (!Slot) {
+    return false;
+  }
+
+  llvm::Type *Ty = SI->getValueOperand()->getType();
+  if (auto STy = dyn_cast<StructType>(Ty)) {
+    // A whole array (length and pointer).
+    if (STy->getNumElements() != 2 || !STy->getElementType(1)->isPointerTy()) {
+      return false;
+    }
+    Offset += DL.getStructLayout(STy)->getElementOffset(1);
+  } else if (!Ty->isPointerTy()) {
+    return false;
+  }
+
+  return isLocalArraySlot(Slot, Offset, Derived);
+}
+
 /// Returns true if the GC call passed in is safe to turn into a stack
 /// allocation.
 ///
@@ -627,7 +1027,7 @@ static bool mayBeUsedAfterRealloc(Instruction *Def, BasicBlock::iterator Alloc,
 /// see isSafeToStackAllocate() for details.
 bool isSafeToStackAllocateArray(
     BasicBlock::iterator Alloc, DominatorTree &DT,
-    SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+    SmallVector<CallInst *, 4> &RemoveTailCallInsts, bool AllowLocalSlots) {
   assert(Alloc->getType()->isStructTy() && "Allocated array is not a struct?");
   Value *V = &(*Alloc);
 
@@ -651,7 +1051,23 @@ bool isSafeToStackAllocateArray(
                "First array field not length?");
       } else {
         assert(idx == 1 && "Invalid array struct access.");
-        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts,
+                                   AllowLocalSlots)) {
+          return false;
+        }
+      }
+      break;
+    }
+    case Instruction::Store: {
+      // Storing the whole array to a local variable.
+      SmallVector<Instruction *, 4> Derived;
+      if (!AllowLocalSlots || V != User->getOperand(0) ||
+          !isStoredToLocalArraySlot(cast<StoreInst>(User), Derived)) {
+        return false;
+      }
+      for (Instruction *D : Derived) {
+        if (!isSafeToStackAllocate(Alloc, D, DT, RemoveTailCallInsts,
+                                   AllowLocalSlots)) {
           return false;
         }
       }
@@ -690,9 +1106,14 @@ bool isSafeToStackAllocateArray(
 /// the attribute has to be removed before promoting the memory to the
 /// stack. The affected instructions are added to RemoveTailCallInsts. If
 /// the function returns false, these entries are meaningless.
+///
+/// If AllowLocalSlots is set, the pointer may be stored to local array
+/// variables, see isLocalArraySlot(). The allocation must not be in a loop
+/// then.
 bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V,
                            DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           bool AllowLocalSlots) {
   assert(isa<PointerType>(V->getType()) && "Allocated value is not a pointer?");
 
   SmallVector<Use *, 16> Worklist;
@@ -753,8 +1174,21 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V,
       break;
     case Instruction::Store:
       if (V == I->getOperand(0)) {
-        // Stored the pointer - it may be captured.
-        return false;
+        // Stored the pointer - it may be captured, unless stored to a local
+        // array variable.
+        SmallVector<Instruction *, 4> Derived;
+        if (!AllowLocalSlots ||
+            !isStoredToLocalArraySlot(cast<StoreInst>(I), Derived)) {
+          return false;
+        }
+        for (Instruction *D : Derived) {
+          for (Use &DU : D->uses()) {
+            if (Visited.insert(&DU).second) {
+              Worklist.push_back(&DU);
+            }
+          }
+        }
+        break;
       }
       // Storing to the pointee does not cause the pointer to be captured.
       break;
@@ -2,6 +2,7 @@
 #include "gen/llvm.h"
 #include "gen/passes/Passes.h"
 #include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Dominators.h"
 
@@ -64,6 +65,10 @@ public:
 // FunctionInfo for _d_allocclass
 class AllocClassFI : public FunctionInfo {
 public:
+  // Set by analyze() if the class (or a base class) has a destructor, in
+  // which case the object needs to be finalized before the function returns.
+  bool HasFinalizer = false;
+
   bool analyze(llvm::CallBase *CB, const G2StackAnalysis &A) override;
 
   // The default promote() should be fine.
@@ -106,7 +111,8 @@ struct GarbageCollect2Stack {
 
   bool run(llvm::Function& function,
            std::function<llvm::DominatorTree& ()> getDT,
-           std::function<llvm::CallGraph * ()> getCG);
+           std::function<llvm::CallGraph * ()> getCG,
+           std::function<llvm::OptimizationRemarkEmitter &()> getORE);
 
   static llvm::StringRef getPassName() { return "GarbageCollect2Stack"; }
 };
@@ -127,7 +133,11 @@ struct LLVM_LIBRARY_VISIBILITY GarbageCollect2StackPass : public llvm::PassInfoM
       return nullptr;
     };
 
-    if (pass.run(F, getDT, getCG)) {
+    auto getORE = [&]() -> llvm::OptimizationRemarkEmitter & {
+      return fam.getResult<llvm::OptimizationRemarkEmitterAnalysis>(F);
+    };
+
+    if (pass.run(F, getDT, getCG, getORE)) {
       llvm::PreservedAnalyses pa;
       pa.preserve<llvm::CallGraphAnalysis>();
       return pa;
@@ -13,6 +13,9 @@
 
 #pragma once
 
+#include "llvm/ADT/StringRef.h"
+#include <functional>
+
 namespace llvm {
 class FunctionPass;
 class ModulePass;
@@ -23,6 +26,16 @@ llvm::FunctionPass *createSimplifyDRuntimeCalls();
 
 llvm::FunctionPass *createGarbageCollect2Stack();
 
+// Hoists array bounds checks out of loops and merges adjacent ones.
+llvm::FunctionPass *createBoundsCheckElimination();
+
+// Called for each closure frame promoted to the stack, with the source location
+// and the name of the function the frame belongs to.
+using Closure2StackReporter =
+    std::function<void(llvm::StringRef loc, llvm::StringRef funcName)>;
+
+llvm::ModulePass *createClosure2StackPass(Closure2StackReporter report = {});
+
 llvm::ModulePass *createStripExternalsPass();
 
 llvm::ModulePass *createDLLImportRelocationPass();
@@ -26,8 +26,10 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/Compiler.h"
@@ -228,6 +230,239 @@ Value *ArraySliceCopyOpt::CallOptimizer(Function *Callee, CallInst *CI,
   return EmitMemCpy(CI->getOperand(0), CI->getOperand(2), size, 1, B);
 }
 
+//===---------------------------------------===//
+// '_aaInX'/'_aaGetY' Optimizations
+
+namespace {
+/// Maximum number of instructions to scan backwards for an earlier lookup.
+const unsigned MaxAALookupScan = 128;
+
+bool isAALookup(const CallInst *CI, bool &IsGet) {
+  const Function *F = CI->getCalledFunction();
+  if (!F || !F->isDeclaration())
+    return false;
+  if (F->getName() == "_aaGetY" && F->arg_size() == 4) {
+    IsGet = true;
+    return true;
+  }
+  if (F->getName() == "_aaInX" && F->arg_size() == 3) {
+    IsGet = false;
+    return true;
+  }
+  return false;
+}
+
+Value *getKeyArg(const CallInst *CI, bool IsGet) {
+  return CI->getArgOperand(IsGet ? 3 : 2);
+}
+
+/// Returns the value stored to the alloca pointed to by Ptr if that is its
+/// only store, with all other uses being AA lookups or lifetime markers.
+Value *getUniqueStoredValue(Value *Ptr) {
+  auto Alloca = dyn_cast<AllocaInst>(Ptr->stripPointerCasts());
+  if (!Alloca)
+    return nullptr;
+
+  Value *Stored = nullptr;
+  SmallVector<Value *, 4> Worklist = {Alloca};
+  while (!Worklist.empty()) {
+    Value *V = Worklist.pop_back_val();
+    for (User *U : V->users()) {
+      if (isa<BitCastInst>(U)) {
+        Worklist.push_back(U);
+      } else if (auto SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getValueOperand() == V || Stored)
+          return nullptr;
+        Stored = SI->getValueOperand();
+      } else if (auto II = dyn_cast<IntrinsicInst>(U)) {
+        if (!II->isLifetimeStartOrEnd())
+          return nullptr;
+      } else if (auto CI = dyn_cast<CallInst>(U)) {
+        bool IsGet;
+        if (!isAALookup(CI, IsGet) || getKeyArg(CI, IsGet) != V)
+          return nullptr;
+      } else {
+        return nullptr;
+      }
+    }
+  }
+  return Stored;
+}
+
+/// Returns whether the load of an AA isn't clobbered before the lookup Prev
+/// in the same basic block.
+bool isUnclobberedUntil(LoadInst *Load, CallInst *Prev, AliasAnalysis &AA) {
+  if (Load->getParent() != Prev->getParent() || !Load->comesBefore(Prev))
+    return false;
+  const MemoryLocation Loc = MemoryLocation::get(Load);
+  for (auto It = std::next(Load->getIterator()); &*It != Prev; ++It) {
+    if (isModSet(AA.getModRefInfo(&*It, Loc)))
+      return false;
+  }
+  return true;
+}
+} // anonymous namespace
+
+/// AALookupOpt - Reuse the result of an earlier lookup of the same key in the
+/// same associative array, as long as nothing in between may modify the AA:
+///  - `_aaInX` or `_aaGetY` followed by `_aaInX` => the earlier result
+///  - `_aaGetY` followed by `_aaGetY` => the earlier result
+///  - `_aaInX` followed by `_aaGetY`, with the `_aaInX` result known to be
+///    non-null (e.g., after a range check) => the `_aaInX` result
+/// The earlier lookup must be in the same block or in a chain of single
+/// predecessors.
+Value *AALookupOpt::CallOptimizer(Function *Callee, CallInst *CI,
+                                  IRBuilder<> &B) {
+  bool IsGet;
+  if (!isAALookup(CI, IsGet) || !CI->getType()->isPointerTy())
+    return nullptr;
+
+  Value *Key = getKeyArg(CI, IsGet);
+  // The key is usually in a temporary, initialized right before the call.
+  const Value *KeyTemp = getUnderlyingObject(Key);
+  bool KeyTempWritten = false;
+
+  SmallPtrSet<Instruction *, 32> Between;
+  SmallPtrSet<Value *, 4> KnownNonNull;
+  SmallPtrSet<BasicBlock *, 4> Visited;
+
+  // Checks whether the earlier lookup Prev can be reused.
+  auto getReusableLookup = [&](CallInst *Prev) -> Value * {
+    bool PrevIsGet;
+    if (!isAALookup(Prev, PrevIsGet) || Prev->getType() != CI->getType())
+      return nullptr;
+
+    // same key?
+    Value *PrevKey = getKeyArg(Prev, PrevIsGet);
+    if (PrevKey->stripPointerCasts() != Key->stripPointerCasts() ||
+        KeyTempWritten) {
+      Value *Stored = getUniqueStoredValue(Key);
+      if (!Stored || Stored != getUniqueStoredValue(PrevKey))
+        return nullptr;
+      // The stored value must not have been redefined in between.
+      if (auto I = dyn_cast<Instruction>(Stored)) {
+        if (Between.count(I))
+          return nullptr;
+      }
+    }
+
+    // same AA?
+    Value *AAArg = CI->getArgOperand(0);
+    Value *PrevAAArg = Prev->getArgOperand(0);
+    if (PrevIsGet == IsGet)
+      return AAArg->stripPointerCasts() == PrevAAArg->stripPointerCasts()
+                 ? Prev
+                 : nullptr;
+
+    if (!IsGet) {
+      // The AA must have been loaded after the `_aaGetY`, which may have
+      // allocated it.
+      auto Load = dyn_cast<LoadInst>(AAArg);
+      if (Load && Between.count(Load) &&
+          Load->getPointerOperand()->stripPointerCasts() ==
+              PrevAAArg->stripPointerCasts()) {
+        return Prev;
+      }
+      return nullptr;
+    }
+
+    // `_aaInX` followed by `_aaGetY`: only if the key was found.
+    auto Load = dyn_cast<LoadInst>(PrevAAArg);
+    if (KnownNonNull.count(Prev) && Load &&
+        Load->getPointerOperand()->stripPointerCasts() ==
+            AAArg->stripPointerCasts() &&
+        isUnclobberedUntil(Load, Prev, *AA)) {
+      return Prev;
+    }
+    return nullptr;
+  };
+
+  // Checks whether an instruction in between may modify the AA or the key.
+  auto mayClobber = [&](Instruction &I) {
+    if (!I.mayWriteToMemory())
+      return false;
+    if (auto II = dyn_cast<IntrinsicInst>(&I)) {
+      if (II->isLifetimeStartOrEnd()) {
+        if (getUnderlyingObject(II->getArgOperand(1)) == KeyTemp)
+          KeyTempWritten = true;
+        return false;
+      }
+    }
+    if (auto Call = dyn_cast<CallInst>(&I)) {
+      bool CallIsGet;
+      if (isAALookup(Call, CallIsGet) && !CallIsGet)
+        return false;
+    }
+    Value *Dest = nullptr;
+    if (auto SI = dyn_cast<StoreInst>(&I)) {
+      Dest = SI->getPointerOperand();
+    } else if (auto MI = dyn_cast<AnyMemIntrinsic>(&I)) {
+      Dest = MI->getRawDest();
+    }
+    if (!Dest)
+      return true;
+    const Value *Obj = getUnderlyingObject(Dest);
+    if (isa<AllocaInst>(KeyTemp) && Obj == KeyTemp) {
+      KeyTempWritten = true;
+      return false;
+    }
+    // Stores of values found or inserted by a lookup (`aa[key] = value`)
+    // don't modify the AA's structure or keys.
+    if (auto Call = dyn_cast<CallInst>(Obj)) {
+      bool CallIsGet;
+      if (isAALookup(Call, CallIsGet))
+        return false;
+    }
+    // Neither do stores to local variables whose address doesn't escape.
+    return !(isa<AllocaInst>(Obj) &&
+             !PointerMayBeCaptured(Obj, /*ReturnCaptures=*/true,
+                                   /*StoreCaptures=*/true));
+  };
+
+  BasicBlock *BB = CI->getParent();
+  BasicBlock::iterator It = CI->getIterator();
+  Visited.insert(BB);
+  unsigned Scanned = 0;
+  while (true) {
+    while (It != BB->begin()) {
+      Instruction &I = *--It;
+      if (++Scanned > MaxAALookupScan)
+        return nullptr;
+      if (auto Prev = dyn_cast<CallInst>(&I)) {
+        if (Value *Result = getReusableLookup(Prev))
+          return Result;
+      }
+      if (mayClobber(I))
+        return nullptr;
+      Between.insert(&I);
+    }
+
+    BasicBlock *Pred = BB->getSinglePredecessor();
+    if (!Pred || !Visited.insert(Pred).second)
+      return nullptr;
+
+    // Remember pointers known to be non-null when branching to BB.
+    auto Br = dyn_cast<BranchInst>(Pred->getTerminator());
+    if (Br && Br->isConditional() &&
+        Br->getSuccessor(0) != Br->getSuccessor(1)) {
+      auto Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+      if (Cmp && Cmp->isEquality()) {
+        Value *LHS = Cmp->getOperand(0), *RHS = Cmp->getOperand(1);
+        if (isa<ConstantPointerNull>(LHS))
+          std::swap(LHS, RHS);
+        const bool NonNullIfTrue = Cmp->getPredicate() == ICmpInst::ICMP_NE;
+        if (isa<ConstantPointerNull>(RHS) &&
+            (Br->getSuccessor(0) == BB) == NonNullIfTrue) {
+          KnownNonNull.insert(LHS->stripPointerCasts());
+        }
+      }
+    }
+
+    BB = Pred;
+    It = BB->end();
+  }
+}
+
 
 // TODO: More optimizations! :)
 
@@ -293,6 +528,10 @@ void SimplifyDRuntimeCalls::InitOptimizations() {
   Optimizations["_d_newarraymvT"] = &Allocation;
   Optimizations["_d_newclass"] = &Allocation;
   Optimizations["_d_allocclass"] = &Allocation;
+
+  // Reuse results of earlier lookups of the same key
+  Optimizations["_aaInX"] = &AALookup;
+  Optimizations["_aaGetY"] = &AALookup;
 }
 
 /// runOnFunction - Top level algorithm.
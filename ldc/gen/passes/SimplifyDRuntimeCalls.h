@@ -59,6 +59,13 @@ struct LLVM_LIBRARY_VISIBILITY ArraySliceCopyOpt : public LibCallOptimization {
  
 };
 
+/// AALookupOpt - Reuse the result of an earlier lookup of the same key in the
+/// same associative array.
+struct LLVM_LIBRARY_VISIBILITY AALookupOpt : public LibCallOptimization {
+  llvm::Value *CallOptimizer(llvm::Function *Callee, llvm::CallInst *CI,
+                       llvm::IRBuilder<> &B) override;
+};
+
 /// This pass optimizes library functions from the D runtime as used by LDC.
 ///
 struct LLVM_LIBRARY_VISIBILITY SimplifyDRuntimeCalls {
@@ -71,6 +78,9 @@ struct LLVM_LIBRARY_VISIBILITY SimplifyDRuntimeCalls {
   // GC allocations
   AllocationOpt Allocation;
 
+  // Associative arrays
+  AALookupOpt AALookup;
+
   void InitOptimizations();
   bool run(llvm::Function &F, std::function<llvm::AAResults& ()>  getAA);
 
@@ -34,6 +34,23 @@ enum ClassDataFields {
   CD_NumFields /// The number of fields in ClassInfo metadata
 };
 
+// *** Metadata for closure frames ***
+// The GC allocation of a closure frame (the `_d_allocmemory` call) is tagged
+// with a metadata node of this kind. Its operands are MDStrings: the source
+// location and the name of the function the frame belongs to.
+#define CLOSURE_MD_KIND "ldc.closure"
+
+// *** Attribute for `scope` delegate parameters ***
+// String attribute of (non-`return`) `scope` delegate parameters, whose context
+// pointer is guaranteed not to escape the call.
+#define SCOPE_DELEGATE_ATTR "ldc-scope-delegate"
+
+// *** Cold stubs for runtime failure functions ***
+// Name prefix of the internal stubs calling druntime failure functions such as
+// `_d_arraybounds_index` (see DtoCallFailureFunction()), followed by the name
+// of the runtime function.
+#define COLD_STUB_PREFIX "ldc.cold."
+
 inline std::string getMetadataName(const char *prefix,
                                    llvm::GlobalVariable *forGlobal) {
   llvm::StringRef globalName = forGlobal->getName();
@@ -18,6 +18,7 @@
 #include "dmd/module.h"
 #include "dmd/mtype.h"
 #include "dmd/root/port.h"
+#include "dmd/template.h"
 #include "gen/abi/abi.h"
 #include "gen/arrays.h"
 #include "gen/classes.h"
@@ -30,6 +31,7 @@
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
 #include "gen/logger.h"
+#include "gen/optimizer.h"
 #include "gen/recursivevisitor.h"
 #include "gen/runtime.h"
 #include "gen/tollvm.h"
@@ -125,6 +127,199 @@ public:
   void visit(Expression *) override {}
 };
 
+//////////////////////////////////////////////////////////////////////////////
+
+/// Emits the case index computation of a `switch` on strings, replacing the
+/// binary search of the frontend lowering `object.__switch!(T, labels...)(c)`:
+/// The string is dispatched by its length, then repeatedly by the code unit
+/// at the position distinguishing most of the remaining labels, and finally
+/// compared to a single label via `memcmp` (with a constant size, expanded to
+/// wide loads by LLVM). The result is the index of the label in the sorted
+/// labels (like `__switch`), or -1 if there is no match.
+class StringSwitchEmitter {
+  IRState *irs;
+  FuncGenState &funcGen;
+  llvm::ArrayRef<StringExp *> labels;
+  /// Sums of the PGO counts of the case statements per label.
+  llvm::ArrayRef<uint64_t> labelCounts;
+  unsigned codeUnitSize;
+
+  LLValue *ptr = nullptr;
+  llvm::BasicBlock *notFoundBB = nullptr;
+  llvm::BasicBlock *endBB = nullptr;
+  llvm::PHINode *result = nullptr;
+
+  uint64_t getCount(llvm::ArrayRef<unsigned> group) const {
+    uint64_t count = 0;
+    for (unsigned i : group)
+      count += labelCounts[i];
+    return count;
+  }
+
+  void addBranchWeights(llvm::SwitchInst *si,
+                        llvm::ArrayRef<llvm::SmallVector<unsigned, 4>> groups,
+                        uint64_t notFoundCount = 0) {
+    if (!funcGen.pgo.haveRegionCounts())
+      return;
+    std::vector<uint64_t> weights = {notFoundCount};
+    for (const auto &group : groups)
+      weights.push_back(getCount(group));
+    funcGen.pgo.addBranchWeights(si,
+                                 funcGen.pgo.createProfileWeights(weights));
+  }
+
+  void emitCompare(unsigned labelIndex) {
+    StringExp *label = labels[labelIndex];
+    LLConstant *index = LLConstantInt::get(result->getType(), labelIndex);
+    if (label->len == 0) {
+      result->addIncoming(index, irs->scopebb());
+      irs->ir->CreateBr(endBB);
+      return;
+    }
+
+    LLValue *labelPtr = DtoBitCast(irs->getCachedStringLiteral(label),
+                                   getVoidPtrType());
+    LLValue *cmp = DtoMemCmp(ptr, labelPtr,
+                             DtoConstSize_t(label->len * codeUnitSize));
+    auto foundBB = irs->insertBBBefore(notFoundBB, "stringswitch.found");
+    irs->ir->CreateCondBr(irs->ir->CreateIsNull(cmp), foundBB, notFoundBB);
+    result->addIncoming(index, foundBB);
+    irs->ir->SetInsertPoint(foundBB);
+    irs->ir->CreateBr(endBB);
+  }
+
+  // Emits the dispatch for a group of labels of the same length.
+  void emitGroup(llvm::ArrayRef<unsigned> group, size_t length) {
+    if (group.size() == 1) {
+      emitCompare(group[0]);
+      return;
+    }
+
+    // Find the code unit position distinguishing most labels.
+    size_t bestPos = 0, bestDistinct = 0;
+    for (size_t pos = 0; pos < length; ++pos) {
+      llvm::SmallDenseSet<uint32_t, 16> units;
+      for (unsigned i : group)
+        units.insert(labels[i]->getCodeUnit(pos));
+      if (units.size() > bestDistinct) {
+        bestPos = pos;
+        bestDistinct = units.size();
+      }
+    }
+    assert(bestDistinct > 1 && "duplicate string switch labels");
+
+    // Split the group by the code unit at that position.
+    llvm::SmallVector<char32_t, 16> units;
+    llvm::SmallVector<llvm::SmallVector<unsigned, 4>, 16> subgroups;
+    for (unsigned i : group) {
+      const char32_t unit = labels[i]->getCodeUnit(bestPos);
+      auto it = llvm::find(units, unit);
+      if (it == units.end()) {
+        units.push_back(unit);
+        subgroups.emplace_back();
+        subgroups.back().push_back(i);
+      } else {
+        subgroups[it - units.begin()].push_back(i);
+      }
+    }
+
+    LLType *unitType = LLType::getIntNTy(irs->context(), codeUnitSize * 8);
+    LLValue *unitPtr = DtoGEP1(unitType, DtoBitCast(ptr, getPtrToType(unitType)),
+                               DtoConstSize_t(bestPos));
+    LLValue *unit = DtoLoad(unitType, unitPtr, "stringswitch.unit");
+    auto si = irs->ir->CreateSwitch(unit, notFoundBB, units.size());
+    for (size_t i = 0; i < units.size(); ++i) {
+      auto bb = irs->insertBBBefore(notFoundBB, "stringswitch.unit");
+      si->addCase(llvm::ConstantInt::get(
+                      static_cast<llvm::IntegerType *>(unitType), units[i]),
+                  bb);
+      irs->ir->SetInsertPoint(bb);
+      emitGroup(subgroups[i], length);
+    }
+    addBranchWeights(si, subgroups);
+  }
+
+public:
+  StringSwitchEmitter(IRState *irs, llvm::ArrayRef<StringExp *> labels,
+                      llvm::ArrayRef<uint64_t> labelCounts,
+                      unsigned codeUnitSize)
+      : irs(irs), funcGen(irs->funcGen()), labels(labels),
+        labelCounts(labelCounts), codeUnitSize(codeUnitSize) {}
+
+  /// Returns the case index for the string slice `str`. `notFoundCount` is the
+  /// PGO count of the default case.
+  LLValue *emit(DValue *str, LLType *indexType, uint64_t notFoundCount) {
+    LLValue *length = DtoArrayLen(str);
+    ptr = DtoBitCast(DtoArrayPtr(str), getVoidPtrType());
+
+    llvm::BasicBlock *switchBB = irs->scopebb();
+    notFoundBB = irs->insertBB("stringswitch.notfound");
+    endBB = irs->insertBBAfter(notFoundBB, "stringswitch.end");
+    irs->ir->SetInsertPoint(endBB);
+    result = irs->ir->CreatePHI(indexType, labels.size() + 1,
+                                "stringswitch.index");
+    result->addIncoming(LLConstantInt::get(indexType, -1, true), notFoundBB);
+    irs->ir->SetInsertPoint(notFoundBB);
+    irs->ir->CreateBr(endBB);
+
+    // Group the labels by length.
+    llvm::SmallVector<size_t, 16> lengths;
+    llvm::SmallVector<llvm::SmallVector<unsigned, 4>, 16> groups;
+    for (unsigned i = 0; i < labels.size(); ++i) {
+      const size_t len = labels[i]->len;
+      auto it = llvm::find(lengths, len);
+      if (it == lengths.end()) {
+        lengths.push_back(len);
+        groups.emplace_back();
+        groups.back().push_back(i);
+      } else {
+        groups[it - lengths.begin()].push_back(i);
+      }
+    }
+
+    irs->ir->SetInsertPoint(switchBB);
+    auto si = irs->ir->CreateSwitch(length, notFoundBB, lengths.size());
+    for (size_t i = 0; i < lengths.size(); ++i) {
+      auto bb = irs->insertBBBefore(notFoundBB, "stringswitch.length");
+      si->addCase(DtoConstSize_t(lengths[i]), bb);
+      irs->ir->SetInsertPoint(bb);
+      emitGroup(groups[i], lengths[i]);
+    }
+    addBranchWeights(si, groups, notFoundCount);
+
+    irs->ir->SetInsertPoint(endBB);
+    return result;
+  }
+};
+
+/// Returns the string argument and the sorted case labels if `condition` is
+/// the frontend lowering of a `switch` on strings to `object.__switch`.
+static Expression *
+getStringSwitchLabels(Expression *condition,
+                      llvm::SmallVectorImpl<StringExp *> &labels) {
+  auto ce = condition->isCallExp();
+  if (!ce || !ce->f || ce->f->ident != Id::__switch || !ce->arguments ||
+      ce->arguments->length != 1) {
+    return nullptr;
+  }
+  auto ti = ce->f->parent ? ce->f->parent->isTemplateInstance() : nullptr;
+  if (!ti || !ti->tiargs || ti->tiargs->length < 2)
+    return nullptr;
+
+  Expression *str = (*ce->arguments)[0];
+  const auto codeUnitSize = str->type->toBasetype()->nextOf()->size();
+  for (size_t i = 1; i < ti->tiargs->length; ++i) {
+    auto e = isExpression((*ti->tiargs)[i]);
+    auto se = e ? e->isStringExp() : nullptr;
+    if (!se || se->sz != codeUnitSize)
+      return nullptr;
+    labels.push_back(se);
+  }
+  return str;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 class ToIRVisitor : public Visitor {
   IRState *irs;
 
@@ -1015,7 +1210,28 @@ public:
     irs->ir->SetInsertPoint(oldbb);
     if (useSwitchInst) {
       // The case index value.
-      LLValue *condVal = DtoRVal(toElemDtor(stmt->condition));
+      LLValue *condVal;
+      llvm::SmallVector<StringExp *, 16> labels;
+      Expression *str = nullptr;
+      if (isOptimizationEnabled())
+        str = getStringSwitchLabels(stmt->condition, labels);
+      if (str) {
+        Logger::println("dispatching string switch inline");
+        // The case statements' indices are the indices of the sorted labels.
+        std::vector<uint64_t> labelCounts(labels.size(), 0);
+        for (size_t i = 0; i < caseCount; ++i) {
+          const auto index = isaConstantInt(indices[i])->getZExtValue();
+          if (index < labelCounts.size())
+            labelCounts[index] += PGO.getRegionCount((*cases)[i]);
+        }
+        StringSwitchEmitter emitter(irs, labels, labelCounts,
+                                    str->type->toBasetype()->nextOf()->size());
+        condVal = emitter.emit(
+            toElemDtor(str), DtoType(stmt->condition->type),
+            stmt->sdefault ? PGO.getRegionCount(stmt->sdefault) : 0);
+      } else {
+        condVal = DtoRVal(toElemDtor(stmt->condition));
+      }
 
       // Create switch and add the cases.
       // For PGO instrumentation, we need to add counters /before/ the case
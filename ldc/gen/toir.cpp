@@ -1229,7 +1229,7 @@ public:
           }
         }
 
-        p->ir->CreateCondBr(okCond, okbb, failbb);
+        DtoCondBrToFailure(okCond, okbb, failbb);
 
         p->ir->SetInsertPoint(failbb);
         emitArraySliceError(p, e->loc, vlo, vup,
@@ -1746,10 +1746,9 @@ public:
     LLValue *condval = DtoRVal(DtoCast(e->loc, cond, Type::tbool));
 
     // branch
-    llvm::BranchInst::Create(passedbb, failedbb, condval, p->scopebb());
     // The branch does not need instrumentation for PGO because failedbb
-    // terminates in unreachable, which means that LLVM will automatically
-    // assign branch weights to this branch instruction.
+    // terminates in unreachable; it is weighted as never taken.
+    DtoCondBrToFailure(condval, passedbb, failedbb);
 
     // failed: call assert runtime function
     p->ir->SetInsertPoint(failedbb);
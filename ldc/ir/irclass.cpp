@@ -15,8 +15,10 @@
 #include "dmd/mangle.h"
 #include "dmd/mtype.h"
 #include "dmd/target.h"
+#include "driver/cl_options.h"
 #include "gen/abi/abi.h"
 #include "gen/arrays.h"
+#include "gen/classes.h"
 #include "gen/funcgenstate.h"
 #include "gen/functions.h"
 #include "gen/irstate.h"
@@ -32,6 +34,7 @@
 #include "ir/irdsymbol.h"
 #include "ir/irfunction.h"
 #include "ir/irtypeclass.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -42,6 +45,46 @@
 
 //////////////////////////////////////////////////////////////////////////////
 
+namespace {
+// Adds LLVM type metadata to a vtbl of class `cd` for whole-program
+// devirtualization (`-fwhole-program-vtables`), for all types whose references
+// may point to it: the class and its base classes for the class vtbl, or the
+// interface and its base interfaces for an interface vtbl.
+void addVtblTypeMetadata(llvm::GlobalVariable *vtbl, ClassDeclaration *cd,
+                         ClassDeclaration *iface = nullptr) {
+  if (!opts::wholeProgramVTables)
+    return;
+
+  // The vtbl pointer points to the start of the vtbl.
+  llvm::SmallPtrSet<ClassDeclaration *, 8> types;
+  if (!iface) {
+    for (auto c = cd; c; c = c->baseClass) {
+      if (types.insert(c).second)
+        vtbl->addTypeMetadata(0, getVtblTypeId(c));
+    }
+  } else {
+    llvm::SmallVector<ClassDeclaration *, 8> worklist = {iface};
+    while (!worklist.empty()) {
+      auto i = worklist.pop_back_val();
+      if (!types.insert(i).second)
+        continue;
+      vtbl->addTypeMetadata(0, getVtblTypeId(i));
+      for (auto bc : *i->baseclasses)
+        worklist.push_back(bc->sym);
+    }
+  }
+
+  vtbl->setVCallVisibilityMetadata(
+      vtbl->hasLocalLinkage()
+          ? llvm::GlobalObject::VCallVisibilityTranslationUnit
+          : hasHiddenLTOVisibility(cd)
+                ? llvm::GlobalObject::VCallVisibilityLinkageUnit
+                : llvm::GlobalObject::VCallVisibilityPublic);
+}
+} // anonymous namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
 IrClass::IrClass(ClassDeclaration *cd) : IrAggr(cd) {
   addInterfaceVtbls(cd);
 
@@ -79,8 +122,10 @@ LLGlobalVariable *IrClass::getVtblSymbol(bool define) {
 
   if (define) {
     auto init = getVtblInit(); // might define vtbl
-    if (!vtbl->hasInitializer())
+    if (!vtbl->hasInitializer()) {
       defineGlobal(vtbl, init, aggrdecl);
+      addVtblTypeMetadata(vtbl, aggrdecl->isClassDeclaration());
+    }
   }
 
   return vtbl;
@@ -479,6 +524,7 @@ llvm::GlobalVariable *IrClass::getInterfaceVtblSymbol(BaseClass *b,
   if (define && !gvar->hasInitializer()) {
     auto init = getInterfaceVtblInit(b, interfaces_index);
     defineGlobal(gvar, init, aggrdecl);
+    addVtblTypeMetadata(gvar, aggrdecl->isClassDeclaration(), b->sym);
   }
 
   return gvar;
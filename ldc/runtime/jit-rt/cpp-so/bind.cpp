@@ -82,7 +82,7 @@ allocParam(llvm::IRBuilder<> &builder, llvm::Type &srcType,
   auto init =
       parseInitializer(layout, srcType, param.data, errHandler, override);
   builder.CreateStore(init, stackArg);
-  return builder.CreateLoad(stackArg);
+  return builder.CreateLoad(&srcType, stackArg);
 }
 
 void doBind(llvm::Module &module, llvm::Function &dstFunc,
@@ -115,8 +115,12 @@ void doBind(llvm::Module &module, llvm::Function &dstFunc,
 
   auto ret = builder.CreateCall(&srcFunc, args);
   if (!srcFunc.isDeclaration()) {
+#if LDC_LLVM_VER >= 1400
+    ret->addFnAttr(llvm::Attribute::AlwaysInline);
+#else
     ret->addAttribute(llvm::AttributeList::FunctionIndex,
                       llvm::Attribute::AlwaysInline);
+#endif
   }
   ret->setCallingConv(srcFunc.getCallingConv());
   ret->setAttributes(srcFunc.getAttributes());
@@ -12,29 +12,35 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <atomic>
 #include <cassert>
+#include <cstring>
 #include <map>
 #include <memory>
 #include <sstream>
 #include <stdexcept>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "bind.h"
 #include "callback_ostream.h"
 #include "context.h"
 #include "jit_context.h"
+#include "object_cache.h"
 #include "optimizer.h"
 #include "options.h"
 #include "utils.h"
 
 #include "llvm/Bitcode/BitcodeReader.h"
-#include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 
 namespace {
@@ -92,6 +98,15 @@ void enumModules(const RtCompileModuleList *modlist_head,
   }
 }
 
+// Thunks and bind handles may be called concurrently while being updated
+// (see `compileDynamicCodeAsync`), so they are switched atomically.
+void publishAddress(void **var, void *addr) {
+  static_assert(sizeof(std::atomic<void *>) == sizeof(void *),
+                "Unexpected atomic pointer size");
+  reinterpret_cast<std::atomic<void *> *>(var)->store(
+      addr, std::memory_order_release);
+}
+
 std::string decorate(llvm::StringRef name, const llvm::DataLayout &datalayout) {
   assert(!name.empty());
   llvm::SmallVector<char, 64> ret;
@@ -113,6 +128,10 @@ private:
   struct BindHandle final {
     std::string name;
     void *handle = nullptr;
+    // Empty if the bind function must not be reused by later compiles.
+    std::string key;
+    // The address of an equal bind function compiled before, if any.
+    void *addr = nullptr;
   };
   std::vector<BindHandle> bindHandles;
 
@@ -150,28 +169,84 @@ public:
 
   const std::vector<BindHandle> &getBindHandles() const { return bindHandles; }
 
-  void addBindHandle(llvm::StringRef name, void *handle) {
+  void addBindHandle(llvm::StringRef name, void *handle, std::string key) {
     assert(!name.empty());
     assert(handle != nullptr);
     BindHandle h;
     h.name = name.str();
     h.handle = handle;
+    h.key = std::move(key);
+    bindHandles.emplace_back(std::move(h));
+  }
+
+  void addCompiledBindHandle(void *addr, void *handle) {
+    assert(addr != nullptr);
+    assert(handle != nullptr);
+    BindHandle h;
+    h.handle = handle;
+    h.addr = addr;
     bindHandles.emplace_back(std::move(h));
   }
 };
 
-void *resolveSymbol(llvm::JITSymbol &symbol) {
-  auto addr = symbol.getAddress();
-  if (!addr) {
-    consumeError(addr.takeError());
-    return nullptr;
-  } else {
-    return reinterpret_cast<void *>(addr.get());
+std::string getBindParamsKey(llvm::ArrayRef<ParamSlice> params) {
+  std::string key;
+  auto append = [&](const void *data, size_t size) {
+    key.append(static_cast<const char *>(data), size);
+  };
+  for (auto &&param : params) {
+    append(&param.type, sizeof(param.type));
+    append(&param.size, sizeof(param.size));
+    if (param.data != nullptr) {
+      append(param.data, param.size);
+    }
   }
+  return key;
 }
 
-void generateBind(const Context &context, DynamicCompilerContext &jitContext,
-                  JitModuleInfo &moduleInfo, llvm::Module &module) {
+// Binds of the same functions with equal bound values share the generated
+// function.
+std::string getBindKey(const void *originalFunc, const void *exampleFunc,
+                       llvm::StringRef paramsKey) {
+  std::string key(reinterpret_cast<const char *>(&originalFunc),
+                  sizeof(originalFunc));
+  key.append(reinterpret_cast<const char *>(&exampleFunc),
+             sizeof(exampleFunc));
+  key.append(paramsKey.data(), paramsKey.size());
+  return key;
+}
+
+// Whether the bound values contain handles of other binds. The bind keys only
+// contain the handle addresses, which may be reused by new binds once the
+// nested binds are destroyed, so such bind functions can't be reused by later
+// compiles.
+bool hasNestedBinds(const DynamicCompilerContext &jitContext,
+                    llvm::ArrayRef<ParamSlice> params) {
+  for (auto &&param : params) {
+    if (param.data == nullptr) {
+      continue;
+    }
+    // Handles are stored in pointer-sized slots, e.g. delegate contexts.
+    for (size_t offset = 0; offset + sizeof(void *) <= param.size;
+         offset += sizeof(void *)) {
+      void *handle = nullptr;
+      std::memcpy(&handle, static_cast<const char *>(param.data) + offset,
+                  sizeof(handle));
+      if (handle != nullptr && jitContext.hasBindFunction(handle)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/// Generates the bind functions, only for the binds not compiled yet if
+/// `extend` is set, and adds them to the key. Returns the generated
+/// functions.
+std::vector<llvm::Function *>
+generateBind(const Context &context, DynamicCompilerContext &jitContext,
+             JitModuleInfo &moduleInfo, llvm::Module &module, bool extend,
+             ModuleKey &moduleKey) {
   auto getIrFunc = [&](const void *ptr) -> llvm::Function * {
     assert(ptr != nullptr);
     auto funcDesc = moduleInfo.getFunc(ptr);
@@ -183,21 +258,52 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
 
   std::unordered_map<const void *, llvm::Function *> bindFuncs;
   bindFuncs.reserve(jitContext.getBindInstances().size() * 2);
+  std::unordered_map<std::string, llvm::Function *> bindFuncsByKey;
+  std::vector<llvm::Function *> newFuncs;
+
+  // The bind functions of module extensions must not clash with the ones
+  // already compiled.
+  const std::string bindName =
+      extend ? "\1.jit_bind_" +
+                   std::to_string(jitContext.getModuleExtensions() + 1)
+             : "\1.jit_bind";
 
   auto genBind = [&](void *bindPtr, void *originalFunc, void *exampleFunc,
                      const llvm::ArrayRef<ParamSlice> &params) {
     assert(bindPtr != nullptr);
     assert(bindFuncs.end() == bindFuncs.find(bindPtr));
+    const auto paramsKey = getBindParamsKey(params);
+    auto key = getBindKey(originalFunc, exampleFunc, paramsKey);
+    const bool reusable = !hasNestedBinds(jitContext, params);
+    if (extend && reusable) {
+      if (auto addr = jitContext.getBindFunction(key)) {
+        moduleInfo.addCompiledBindHandle(addr, bindPtr);
+        return;
+      }
+    }
+    // All handles are alive during this compile, so equal keys can share the
+    // bind function.
+    auto keyIt = bindFuncsByKey.find(key);
+    if (bindFuncsByKey.end() != keyIt) {
+      moduleInfo.addBindHandle(keyIt->second->getName(), bindPtr,
+                               reusable ? key : std::string());
+      bindFuncs.insert({bindPtr, keyIt->second});
+      return;
+    }
     auto funcToInline = getIrFunc(originalFunc);
     if (funcToInline == nullptr) {
         fatal(context, "Bind: function body not available");
     }
     auto exampleIrFunc = getIrFunc(exampleFunc);
     assert(exampleIrFunc != nullptr);
+    moduleKey.add(funcToInline->getName());
+    moduleKey.add(exampleIrFunc->getName());
+    moduleKey.add(paramsKey);
     auto errhandler = [&](const std::string &str) { fatal(context, str); };
     auto overrideHandler = [&](llvm::Type &type, const void *data,
                                size_t size) -> llvm::Constant * {
       if (type.isPointerTy()) {
+        moduleKey.setHasPointers();
         auto getBindFunc = [&]() {
           auto handle = *static_cast<void *const *>(data);
           return handle != nullptr && jitContext.hasBindFunction(handle)
@@ -219,7 +325,11 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
           }
         } else if (auto handle = getBindFunc()) {
           auto it = bindFuncs.find(handle);
-          assert(bindFuncs.end() != it);
+          if (bindFuncs.end() == it) {
+            // Compiled before, call through the handle.
+            assert(extend);
+            return nullptr;
+          }
           auto bindIrFunc = it->second;
           auto funcPtrType = bindIrFunc->getType();
           auto globalVar1 = new llvm::GlobalVariable(
@@ -233,34 +343,62 @@ void generateBind(const Context &context, DynamicCompilerContext &jitContext,
     auto func =
         bindParamsToFunc(module, *funcToInline, *exampleIrFunc, params,
                          errhandler, BindOverride(overrideHandler));
-    moduleInfo.addBindHandle(func->getName(), bindPtr);
+    func->setName(bindName);
+    moduleInfo.addBindHandle(func->getName(), bindPtr,
+                             reusable ? key : std::string());
     bindFuncs.insert({bindPtr, func});
+    bindFuncsByKey.insert({std::move(key), func});
+    newFuncs.push_back(func);
   };
   for (auto &&bind : jitContext.getBindInstances()) {
     auto bindPtr = bind.first;
     auto &bindDesc = bind.second;
     assert(bindDesc.originalFunc != nullptr);
+    if (extend && bindDesc.compiled) {
+      continue;
+    }
     genBind(bindPtr, bindDesc.originalFunc, bindDesc.exampleFunc,
             bindDesc.params);
   }
+  return newFuncs;
+}
+
+/// Strips the module to the new bind functions for extending the last
+/// compiled module.
+void internalizeForExtension(llvm::Module &module,
+                             llvm::ArrayRef<llvm::Function *> bindFuncs) {
+  std::unordered_set<const llvm::GlobalValue *> keep(bindFuncs.begin(),
+                                                     bindFuncs.end());
+  llvm::internalizeModule(module, [&](const llvm::GlobalValue &val) {
+    return keep.count(&val) != 0;
+  });
+  llvm::legacy::PassManager pm;
+  pm.add(llvm::createGlobalDCEPass());
+  pm.run(module);
 }
 
 void applyBind(const Context &context, DynamicCompilerContext &jitContext,
                const JitModuleInfo &moduleInfo) {
   auto &layout = jitContext.getDataLayout();
   for (auto &elem : moduleInfo.getBindHandles()) {
+    if (nullptr != elem.addr) {
+      publishAddress(static_cast<void **>(elem.handle), elem.addr);
+      continue;
+    }
     auto decorated = decorate(elem.name, layout);
-    auto symbol = jitContext.findSymbol(decorated);
-    auto addr = resolveSymbol(symbol);
+    auto addr = jitContext.getSymbolAddress(decorated);
     if (nullptr == addr) {
       std::string desc = std::string("Symbol not found in jitted code: \"") +
                          elem.name + "\" (\"" + decorated + "\")";
       fatal(context, desc);
     } else {
-      auto handle = static_cast<void **>(elem.handle);
-      *handle = addr;
+      publishAddress(static_cast<void **>(elem.handle), addr);
+      if (!elem.key.empty()) {
+        jitContext.addBindFunction(elem.key, addr);
+      }
     }
   }
+  jitContext.markBindsCompiled();
 }
 
 DynamicCompilerContext &getJit(DynamicCompilerContext *context) {
@@ -271,10 +409,30 @@ DynamicCompilerContext &getJit(DynamicCompilerContext *context) {
   return jit;
 }
 
+bool containsPointers(const llvm::Type &type) {
+  if (type.isPointerTy()) {
+    return true;
+  }
+  return llvm::any_of(type.subtypes(), [](const llvm::Type *subtype) {
+    return containsPointers(*subtype);
+  });
+}
+
 void setRtCompileVars(const Context &context, llvm::Module &module,
-                      llvm::ArrayRef<RtCompileVarList> vals) {
+                      llvm::ArrayRef<RtCompileVarList> vals,
+                      ModuleKey &moduleKey) {
   for (auto &&val : vals) {
     setRtCompileVar(context, module, val.name, val.init);
+    if (auto var = module.getGlobalVariable(val.name, true)) {
+      const auto size =
+          module.getDataLayout().getTypeAllocSize(var->getValueType());
+      moduleKey.add(val.name);
+      moduleKey.add(llvm::StringRef(static_cast<const char *>(val.init),
+                                    static_cast<std::size_t>(size)));
+      if (containsPointers(*var->getValueType())) {
+        moduleKey.setHasPointers();
+      }
+    }
   }
 }
 
@@ -335,62 +493,148 @@ void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
   OptimizerSettings settings;
   settings.optLevel = context.optLevel;
   settings.sizeLevel = context.sizeLevel;
-  enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
-    interruptPoint(context, "load IR");
-    auto buff = llvm::MemoryBuffer::getMemBuffer(
-        llvm::StringRef(current.irData,
-                        static_cast<std::size_t>(current.irDataSize)),
-        "", false);
-    interruptPoint(context, "parse IR");
-    auto mod = llvm::parseBitcodeFile(*buff, myJit.getContext());
-    if (!mod) {
-      fatal(context, "Unable to parse IR: " + llvm::toString(mod.takeError()));
-    } else {
-      llvm::Module &module = **mod;
-      const auto name = module.getName();
-      interruptPoint(context, "Verify module", name.data());
-      verifyModule(context, module);
-
-      dumpModule(context, module, DumpStage::OriginalModule);
-      setFunctionsTarget(module, myJit.getTargetMachine());
+  // The dump handler expects the module to be optimized and compiled.
+  bool useCache = isObjectCacheEnabled() && nullptr == context.dumpHandler;
+  std::string cacheKey;
+  std::unique_ptr<llvm::MemoryBuffer> cachedObject;
+  ModuleKey key(myJit.getTargetMachine(), settings);
+  std::string moduleKey;
+  bool extend = false;
+  {
+    // Functions of previously compiled modules may be compiled concurrently
+    // in the same context.
+    auto contextLock = myJit.lockContext();
+    std::vector<llvm::StringRef> irData;
+    enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+      irData.emplace_back(current.irData,
+                          static_cast<std::size_t>(current.irDataSize));
+      key.add(irData.back());
+      for (auto &&sym : toArray(current.symList, static_cast<std::size_t>(
+                                                     current.symListSize))) {
+        myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+      }
+    });
 
-      module.setDataLayout(myJit.getTargetMachine().createDataLayout());
+    // The IR doesn't change between compiles, so the merged module is only
+    // parsed once and cloned afterwards. The original modules are only
+    // available for dumping when parsing.
+    auto pristineModule = myJit.getPristineModule(irData);
+    if (nullptr != pristineModule && nullptr == context.dumpHandler) {
+      interruptPoint(context, "Clone IR");
+      finalModule = llvm::CloneModule(*pristineModule);
+    } else {
+      for (auto &&data : irData) {
+        interruptPoint(context, "load IR");
+        auto buff = llvm::MemoryBuffer::getMemBuffer(data, "", false);
+        interruptPoint(context, "parse IR");
+        auto mod = llvm::parseBitcodeFile(*buff, myJit.getContext());
+        if (!mod) {
+          fatal(context,
+                "Unable to parse IR: " + llvm::toString(mod.takeError()));
+        } else {
+          llvm::Module &module = **mod;
+          const auto name = module.getName();
+          interruptPoint(context, "Verify module", name.data());
+          verifyModule(context, module);
+
+          dumpModule(context, module, DumpStage::OriginalModule);
+          setFunctionsTarget(module, myJit.getTargetMachine());
+
+          module.setDataLayout(myJit.getTargetMachine().createDataLayout());
+
+          if (nullptr == finalModule) {
+            finalModule = std::move(*mod);
+          } else {
+            if (llvm::Linker::linkModules(*finalModule, std::move(*mod))) {
+              fatal(context, "Can't merge module");
+            }
+          }
+        }
+      }
+      assert(nullptr != finalModule);
+      myJit.setPristineModule(llvm::CloneModule(*finalModule),
+                              std::move(irData));
+    }
 
-      interruptPoint(context, "setRtCompileVars", name.data());
-      setRtCompileVars(context, module,
+    enumModules(modlist_head, context, [&](const RtCompileModuleList &current) {
+      interruptPoint(context, "setRtCompileVars");
+      setRtCompileVars(context, *finalModule,
                        toArray(current.varList,
-                               static_cast<std::size_t>(current.varListSize)));
+                               static_cast<std::size_t>(current.varListSize)),
+                       key);
+    });
 
-      if (nullptr == finalModule) {
-        finalModule = std::move(*mod);
+    assert(nullptr != finalModule);
+
+    // If the merged module is unchanged, only the binds registered since are
+    // compiled, extending the last compiled module.
+    moduleKey = key.get();
+    extend = nullptr == context.dumpHandler &&
+             !myJit.getBindInstances().empty() &&
+             moduleKey == myJit.getModuleKey();
+
+    interruptPoint(context, "Generate bind functions");
+    const auto bindFuncs =
+        generateBind(context, myJit, moduleInfo, *finalModule, extend, key);
+    if (extend) {
+      if (bindFuncs.empty()) {
+        finalModule = nullptr;
       } else {
-        if (llvm::Linker::linkModules(*finalModule, std::move(*mod))) {
-          fatal(context, "Can't merge module");
-        }
-      }
-
-      for (auto &&sym : toArray(current.symList, static_cast<std::size_t>(
-                                                     current.symListSize))) {
-        myJit.addSymbol(decorate(sym.name, layout), sym.sym);
+        interruptPoint(context, "Strip module extension");
+        internalizeForExtension(*finalModule, bindFuncs);
       }
+    } else {
+      dumpModule(context, *finalModule, DumpStage::MergedModule);
     }
-  });
 
-  assert(nullptr != finalModule);
+    // Module extensions aren't cached, and code embedding pointer values is
+    // only valid in this process.
+    useCache = useCache && !extend && !key.hasPointers();
+    if (useCache) {
+      interruptPoint(context, "Lookup cached object");
+      cacheKey = key.get();
+      cachedObject = loadCachedObject(cacheKey);
+    }
 
-  interruptPoint(context, "Generate bind functions");
-  generateBind(context, myJit, moduleInfo, *finalModule);
-  dumpModule(context, *finalModule, DumpStage::MergedModule);
-  interruptPoint(context, "Optimize final module");
-  optimizeModule(context, myJit.getTargetMachine(), settings, *finalModule);
+    if (nullptr != finalModule && nullptr == cachedObject) {
+      interruptPoint(context, "Optimize final module");
+      optimizeModule(context, myJit.getTargetMachine(), settings,
+                     *finalModule);
 
-  interruptPoint(context, "Verify final module");
-  verifyModule(context, *finalModule);
+      interruptPoint(context, "Verify final module");
+      verifyModule(context, *finalModule);
 
-  dumpModule(context, *finalModule, DumpStage::OptimizedModule);
+      dumpModule(context, *finalModule, DumpStage::OptimizedModule);
+    }
+  }
 
-  interruptPoint(context, "Codegen final module");
-  if (nullptr != context.dumpHandler) {
+  if (extend) {
+    if (nullptr != finalModule) {
+      interruptPoint(context, "Codegen module extension");
+      if (auto err = myJit.extendModule(std::move(finalModule))) {
+        fatal(context,
+              "Can't codegen module: " + llvm::toString(std::move(err)));
+      }
+    }
+  } else if (nullptr != cachedObject) {
+    interruptPoint(context, "Load cached object", cacheKey.c_str());
+    finalModule = nullptr;
+    if (auto err = myJit.addObject(std::move(cachedObject))) {
+      fatal(context,
+            "Can't load cached object: " + llvm::toString(std::move(err)));
+    }
+  } else if (useCache) {
+    interruptPoint(context, "Codegen final module");
+    std::unique_ptr<llvm::MemoryBuffer> object;
+    if (auto err = myJit.addModule(std::move(finalModule), nullptr, &object)) {
+      fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
+    }
+    if (nullptr != object) {
+      interruptPoint(context, "Store cached object", cacheKey.c_str());
+      storeCachedObject(cacheKey, object->getMemBufferRef());
+    }
+  } else if (nullptr != context.dumpHandler) {
+    interruptPoint(context, "Codegen final module");
     auto callback = [&](const char *str, size_t len) {
       context.dumpHandler(context.dumpHandlerData, DumpStage::FinalAsm, str,
                           len);
@@ -401,27 +645,32 @@ void rtCompileProcessImplSoInternal(const RtCompileModuleList *modlist_head,
       fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
     }
   } else {
+    interruptPoint(context, "Codegen final module");
     if (auto err = myJit.addModule(std::move(finalModule), nullptr)) {
       fatal(context, "Can't codegen module: " + llvm::toString(std::move(err)));
     }
   }
 
+  if (!extend) {
+    myJit.setModuleKey(std::move(moduleKey));
+  }
+
   JitFinaliser jitFinalizer(myJit);
-  if (myJit.isMainContext()) {
+  // The functions of module extensions are internal.
+  if (myJit.isMainContext() && !extend) {
     interruptPoint(context, "Resolve functions");
     for (auto &&fun : moduleInfo.functions()) {
       if (fun.thunkVar == nullptr) {
         continue;
       }
       auto decorated = decorate(fun.name, layout);
-      auto symbol = myJit.findSymbol(decorated);
-      auto addr = resolveSymbol(symbol);
+      auto addr = myJit.getSymbolAddress(decorated);
       if (nullptr == addr) {
         std::string desc = std::string("Symbol not found in jitted code: \"") +
                            fun.name.data() + "\" (\"" + decorated + "\")";
         fatal(context, desc);
       } else {
-        *fun.thunkVar = addr;
+        publishAddress(fun.thunkVar, addr);
       }
 
       if (nullptr != context.interruptPointHandler) {
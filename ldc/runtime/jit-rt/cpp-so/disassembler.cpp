@@ -253,9 +253,16 @@ void disassemble(const llvm::TargetMachine &tm,
   }
 
   llvm::MCObjectFileInfo mofi;
+#if LDC_LLVM_VER >= 1300
+  llvm::MCContext ctx(tm.getTargetTriple(), mai, mri, sti);
+  mofi.initMCObjectFileInfo(ctx, tm.isPositionIndependent(),
+                            tm.getCodeModel() == llvm::CodeModel::Large);
+  ctx.setObjectFileInfo(&mofi);
+#else
   llvm::MCContext ctx(mai, mri, &mofi);
   mofi.InitMCObjectFileInfo(tm.getTargetTriple(), tm.isPositionIndependent(),
                             ctx, tm.getCodeModel() == llvm::CodeModel::Large);
+#endif
 
   auto disasm = unique(target.createMCDisassembler(*sti, ctx));
   if (nullptr == disasm) {
@@ -291,7 +298,11 @@ void disassemble(const llvm::TargetMachine &tm,
     return;
   }
 
+#if LDC_LLVM_VER >= 1400
+  asmStreamer->initSections(false, *sti);
+#else
   asmStreamer->InitSections(false);
+#endif
 
   std::unordered_map<uint64_t, std::vector<uint64_t>> sectionsToProcess;
   for (const auto &symbol : object.symbols()) {
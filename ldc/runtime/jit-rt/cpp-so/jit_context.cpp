@@ -14,19 +14,42 @@
 
 #include "jit_context.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 
+#include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
-#include "llvm/ExecutionEngine/RuntimeDyld.h"
-#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/Module.h"
-#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
+#if LDC_LLVM_VER >= 1400
+#include "llvm/MC/TargetRegistry.h"
+#else
 #include "llvm/Support/TargetRegistry.h"
+#endif
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 
 namespace {
+namespace cl = llvm::cl;
+
+cl::opt<bool> lazyCompilation(
+    "jit-lazy", cl::ZeroOrMore, cl::init(true),
+    cl::desc("Compile functions on their first call instead of upfront "
+             "(ignored if the generated assembly is dumped or if the code "
+             "is cached with -jit-cache-dir)"));
+
+cl::opt<unsigned> compileThreads(
+    "jit-compile-threads", cl::ZeroOrMore, cl::init(0),
+    cl::desc("Number of threads compiling functions; by default, functions "
+             "are compiled in the thread requiring them"));
 
 llvm::SmallVector<std::string, 4> getHostAttrs() {
   llvm::SmallVector<std::string, 4> features;
@@ -70,75 +93,184 @@ std::unique_ptr<llvm::TargetMachine> createTargetMachine() {
   return ret;
 }
 
-auto getSymbolInProcess(const std::string &name)
-    -> decltype(llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name)) {
-  assert(!name.empty());
-#if defined(_WIN32)
-  if ('_' == name[0]) {
-    return llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name.substr(1));
-  }
-  return llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name);
-#else
-  return llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name);
-#endif
+void lazyCompilationFailure() {
+  // The error has been reported by the execution session.
+  fprintf(stderr, "Dynamic compiler fatal: lazy compilation failed\n");
+  fflush(stderr);
+  abort();
 }
 
 } // anon namespace
 
 DynamicCompilerContext::ListenerCleaner::ListenerCleaner(
-    DynamicCompilerContext &o, llvm::raw_ostream *stream)
+    DynamicCompilerContext &o, llvm::raw_ostream *stream,
+    std::unique_ptr<llvm::MemoryBuffer> *object)
     : owner(o) {
-  owner.listenerlayer.getTransform().stream = stream;
+  std::lock_guard<std::mutex> lock(owner.listenerMutex);
+  owner.listenerStream = stream;
+  owner.listenerObject = object;
 }
 
 DynamicCompilerContext::ListenerCleaner::~ListenerCleaner() {
-  owner.listenerlayer.getTransform().stream = nullptr;
+  std::lock_guard<std::mutex> lock(owner.listenerMutex);
+  owner.listenerStream = nullptr;
+  owner.listenerObject = nullptr;
 }
 
 DynamicCompilerContext::DynamicCompilerContext(bool isMainContext)
     : targetmachine(createTargetMachine()),
       dataLayout(targetmachine->createDataLayout()),
-      stringPool(std::make_shared<llvm::orc::SymbolStringPool>()),
-      execSession(stringPool), resolver(createResolver()),
-      objectLayer(execSession,
-                  [this](llvm::orc::VModuleKey) {
-                    return ObjectLayerT::Resources{
-                        std::make_shared<llvm::SectionMemoryManager>(),
-                        resolver};
-                  }),
-      listenerlayer(objectLayer, ModuleListener(*targetmachine)),
-      compileLayer(listenerlayer, llvm::orc::SimpleCompiler(*targetmachine)),
-      mainContext(isMainContext) {
-  llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
-}
+      context(std::make_unique<llvm::LLVMContext>()),
+      mainContext(isMainContext) {}
 
 DynamicCompilerContext::~DynamicCompilerContext() {}
 
+llvm::Error DynamicCompilerContext::prepareJit() {
+  if (!jit || jitCompileThreads != compileThreads) {
+    // The thunks and bind handles still point to the code of the current JIT
+    // until the new module is published, and it may still be running then.
+    // Like the second to last module, it is only released when adding the
+    // next module.
+    retiredJit = std::move(jit);
+    if (auto err = createJit()) {
+      return err;
+    }
+  } else {
+    retiredJit = nullptr;
+  }
+
+  currentDylib ^= 1;
+  reset();
+  for (auto &&bind : bindInstances) {
+    bind.second.compiled = false;
+  }
+
+  auto &session = jit->getExecutionSession();
+  auto &dylib = *dylibs[currentDylib];
+  dylibUsed[currentDylib] = true;
+
+  llvm::orc::SymbolMap symbols;
+  for (auto &&sym : symMap) {
+#if LDC_LLVM_VER >= 1700
+    symbols[session.intern(sym.first)] = {
+        llvm::orc::ExecutorAddr::fromPtr(sym.second),
+        llvm::JITSymbolFlags::Exported};
+#else
+    symbols[session.intern(sym.first)] =
+        llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(sym.second),
+                                 llvm::JITSymbolFlags::Exported);
+#endif
+  }
+  if (!symbols.empty()) {
+    return dylib.define(llvm::orc::absoluteSymbols(std::move(symbols)));
+  }
+  return llvm::Error::success();
+}
+
 llvm::Error
 DynamicCompilerContext::addModule(std::unique_ptr<llvm::Module> module,
-                                  llvm::raw_ostream *asmListener) {
+                                  llvm::raw_ostream *asmListener,
+                                  std::unique_ptr<llvm::MemoryBuffer> *object) {
   assert(nullptr != module);
-  reset();
+  if (auto err = prepareJit()) {
+    return err;
+  }
+  return addModuleToDylib(std::move(module), asmListener, object);
+}
 
-  ListenerCleaner cleaner(*this, asmListener);
-  // Add the set to the JIT with the resolver we created above
-  auto handle = execSession.allocateVModule();
-  auto result = compileLayer.addModule(handle, std::move(module));
-  if (result) {
-    execSession.releaseVModule(handle);
-    return result;
+llvm::Error
+DynamicCompilerContext::extendModule(std::unique_ptr<llvm::Module> module) {
+  assert(nullptr != module);
+  assert(dylibUsed[currentDylib]);
+  ++moduleExtensions;
+  return addModuleToDylib(std::move(module), nullptr, nullptr);
+}
+
+llvm::Error DynamicCompilerContext::addModuleToDylib(
+    std::unique_ptr<llvm::Module> module, llvm::raw_ostream *asmListener,
+    std::unique_ptr<llvm::MemoryBuffer> *object) {
+  auto &session = jit->getExecutionSession();
+  auto &dylib = *dylibs[currentDylib];
+
+  // The assembly can only be dumped and the whole module only be emitted as
+  // a single object file (for the object cache) while compiling here, so
+  // -jit-lazy is ignored then.
+  const bool lazy =
+      lazyCompilation && nullptr == asmListener && nullptr == object;
+  llvm::orc::SymbolLookupSet definitions;
+  if (!lazy) {
+    for (auto &&func : module->functions()) {
+      if (!func.isDeclaration() && !func.hasLocalLinkage()) {
+        llvm::SmallString<64> name;
+        llvm::Mangler::getNameWithPrefix(name, func.getName(), dataLayout);
+        definitions.add(session.intern(name));
+      }
+    }
+  }
+
+  ListenerCleaner cleaner(*this, asmListener, object);
+  llvm::orc::ThreadSafeModule threadSafeModule(std::move(module), context);
+  if (lazy) {
+    return jit->addLazyIRModule(dylib, std::move(threadSafeModule));
   }
-  if (auto err = compileLayer.emitAndFinalize(handle)) {
-    execSession.releaseVModule(handle);
+  if (auto err = jit->addIRModule(dylib, std::move(threadSafeModule))) {
     return err;
   }
-  moduleHandle = handle;
-  compiled = true;
+  if (!definitions.empty()) {
+    auto materialized =
+        session.lookup(llvm::orc::makeJITDylibSearchOrder(&dylib),
+                       std::move(definitions));
+    if (!materialized) {
+      return materialized.takeError();
+    }
+  }
   return llvm::Error::success();
 }
 
-llvm::JITSymbol DynamicCompilerContext::findSymbol(const std::string &name) {
-  return compileLayer.findSymbol(name, false);
+llvm::Error
+DynamicCompilerContext::addObject(std::unique_ptr<llvm::MemoryBuffer> object) {
+  assert(nullptr != object);
+  if (auto err = prepareJit()) {
+    return err;
+  }
+  // The object is linked on the first symbol lookup.
+  return jit->addObjectFile(*dylibs[currentDylib], std::move(object));
+}
+
+void *DynamicCompilerContext::getSymbolAddress(const std::string &name) {
+  if (!jit) {
+    return nullptr;
+  }
+  auto symbol = jit->lookupLinkerMangled(*dylibs[currentDylib], name);
+  if (!symbol) {
+    consumeError(symbol.takeError());
+    return nullptr;
+  }
+#if LDC_LLVM_VER >= 1500
+  return symbol->toPtr<void *>();
+#else
+  return llvm::jitTargetAddressToPointer<void *>(symbol->getAddress());
+#endif
+}
+
+const llvm::Module *DynamicCompilerContext::getPristineModule(
+    llvm::ArrayRef<llvm::StringRef> sources) const {
+  if (sources.size() != pristineModuleSources.size() ||
+      !std::equal(sources.begin(), sources.end(),
+                  pristineModuleSources.begin(),
+                  [](llvm::StringRef a, llvm::StringRef b) {
+                    return a.data() == b.data() && a.size() == b.size();
+                  })) {
+    return nullptr;
+  }
+  return pristineModule.get();
+}
+
+void DynamicCompilerContext::setPristineModule(
+    std::unique_ptr<llvm::Module> module,
+    std::vector<llvm::StringRef> sources) {
+  pristineModule = std::move(module);
+  pristineModuleSources = std::move(sources);
 }
 
 void DynamicCompilerContext::clearSymMap() { symMap.clear(); }
@@ -148,11 +280,13 @@ void DynamicCompilerContext::addSymbol(std::string &&name, void *value) {
 }
 
 void DynamicCompilerContext::reset() {
-  if (compiled) {
-    removeModule(moduleHandle);
-    moduleHandle = {};
-    compiled = false;
+  if (dylibUsed[currentDylib]) {
+    cantFail(dylibs[currentDylib]->getDefaultResourceTracker()->remove());
+    dylibUsed[currentDylib] = false;
   }
+  moduleKey.clear();
+  moduleExtensions = 0;
+  bindFunctions.clear();
 }
 
 void DynamicCompilerContext::registerBind(
@@ -174,36 +308,92 @@ bool DynamicCompilerContext::hasBindFunction(const void *handle) const {
   return it != bindInstances.end();
 }
 
+void DynamicCompilerContext::markBindsCompiled() {
+  for (auto &&bind : bindInstances) {
+    bind.second.compiled = true;
+  }
+}
+
+void *DynamicCompilerContext::getBindFunction(llvm::StringRef key) const {
+  auto it = bindFunctions.find(key);
+  return it != bindFunctions.end() ? it->second : nullptr;
+}
+
+void DynamicCompilerContext::addBindFunction(llvm::StringRef key, void *addr) {
+  assert(nullptr != addr);
+  bindFunctions[key] = addr;
+}
+
 bool DynamicCompilerContext::isMainContext() const { return mainContext; }
 
-void DynamicCompilerContext::removeModule(const ModuleHandleT &handle) {
-  cantFail(compileLayer.removeModule(handle));
-  execSession.releaseVModule(handle);
-}
-
-std::shared_ptr<llvm::orc::SymbolResolver>
-DynamicCompilerContext::createResolver() {
-  return llvm::orc::createLegacyLookupResolver(
-      execSession,
-      [this](llvm::StringRef name_) -> llvm::JITSymbol {
-        const std::string name = name_.str();
-        if (auto Sym = compileLayer.findSymbol(name, false)) {
-          return Sym;
-        } else if (auto Err = Sym.takeError()) {
-          return std::move(Err);
-        }
-        auto it = symMap.find(name);
-        if (symMap.end() != it) {
-          return llvm::JITSymbol(
-              reinterpret_cast<llvm::JITTargetAddress>(it->second),
-              llvm::JITSymbolFlags::Exported);
+llvm::Error DynamicCompilerContext::createJit() {
+  assert(nullptr == jit);
+  dylibUsed[0] = dylibUsed[1] = false;
+
+  const auto hostAttrs = getHostAttrs();
+  llvm::orc::JITTargetMachineBuilder targetMachineBuilder(
+      targetmachine->getTargetTriple());
+  targetMachineBuilder.setCPU(targetmachine->getTargetCPU().str())
+      .addFeatures({hostAttrs.begin(), hostAttrs.end()})
+      .setCodeGenOptLevel(llvm::CodeGenOpt::Default);
+
+#if LDC_LLVM_VER >= 1500
+  const auto failureAddr =
+      llvm::orc::ExecutorAddr::fromPtr(&lazyCompilationFailure);
+#else
+  const auto failureAddr =
+      llvm::pointerToJITTargetAddress(&lazyCompilationFailure);
+#endif
+  auto newJit =
+      llvm::orc::LLLazyJITBuilder()
+          .setJITTargetMachineBuilder(std::move(targetMachineBuilder))
+          .setNumCompileThreads(compileThreads)
+          .setLazyCompileFailureAddr(failureAddr)
+          .create();
+  if (!newJit) {
+    return newJit.takeError();
+  }
+  jit = std::move(*newJit);
+  jitCompileThreads = compileThreads;
+
+  dylibs[0] = &jit->getMainJITDylib();
+  auto secondDylib = jit->createJITDylib("ldc.jit.1");
+  if (!secondDylib) {
+    return secondDylib.takeError();
+  }
+  dylibs[1] = &*secondDylib;
+
+  jit->getObjTransformLayer().setTransform(
+      [this](std::unique_ptr<llvm::MemoryBuffer> object)
+          -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> {
+        std::lock_guard<std::mutex> lock(listenerMutex);
+        if (nullptr != listenerStream) {
+          auto objFile = llvm::object::ObjectFile::createObjectFile(
+              object->getMemBufferRef());
+          if (!objFile) {
+            return objFile.takeError();
+          }
+          disassemble(*targetmachine, **objFile, *listenerStream);
         }
-        if (auto SymAddr = getSymbolInProcess(name)) {
-          return llvm::JITSymbol(SymAddr, llvm::JITSymbolFlags::Exported);
+        if (nullptr != listenerObject) {
+          assert(nullptr == *listenerObject &&
+                 "the module should be emitted as a single object file");
+          *listenerObject = llvm::MemoryBuffer::getMemBufferCopy(
+              object->getBuffer(), object->getBufferIdentifier());
         }
-        return nullptr;
-      },
-      [](llvm::Error Err) {
-        llvm::cantFail(std::move(Err), "lookupFlags failed");
+        return object;
       });
+
+  // Resolve the remaining symbols in the process, like the host symbols
+  // referenced by the module.
+  for (auto dylib : dylibs) {
+    auto processSymbols =
+        llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            dataLayout.getGlobalPrefix());
+    if (!processSymbols) {
+      return processSymbols.takeError();
+    }
+    dylib->addGenerator(std::move(*processSymbols));
+  }
+  return llvm::Error::success();
 }
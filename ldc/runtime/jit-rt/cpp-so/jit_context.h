@@ -16,23 +16,22 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <utility>
+#include <vector>
 
 #include "llvm/ADT/MapVector.h"
-#include "llvm/ExecutionEngine/JITSymbol.h"
-#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
-#include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
-#include "llvm/ExecutionEngine/Orc/Legacy.h"
-#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
-#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/Support/ManagedStatic.h"
 
 #include "context.h"
 #include "disassembler.h"
 
 namespace llvm {
+class MemoryBuffer;
 class raw_ostream;
 class TargetMachine;
 } // namespace llvm
@@ -41,54 +40,56 @@ using SymMap = std::map<std::string, void *>;
 
 class DynamicCompilerContext final {
 private:
-  struct ModuleListener {
-    llvm::TargetMachine &targetmachine;
-    llvm::raw_ostream *stream = nullptr;
-
-    ModuleListener(llvm::TargetMachine &tm) : targetmachine(tm) {}
-
-    template <typename T> auto operator()(T &&object) -> T {
-      if (nullptr != stream) {
-        auto objFile =
-            llvm::cantFail(llvm::object::ObjectFile::createObjectFile(
-                object->getMemBufferRef()));
-        disassemble(targetmachine, *objFile, *stream);
-      }
-      return std::move(object);
-    }
-  };
   std::unique_ptr<llvm::TargetMachine> targetmachine;
   const llvm::DataLayout dataLayout;
-  using ObjectLayerT = llvm::orc::LegacyRTDyldObjectLinkingLayer;
-  using ListenerLayerT =
-      llvm::orc::LegacyObjectTransformLayer<ObjectLayerT, ModuleListener>;
-  using CompileLayerT =
-      llvm::orc::LegacyIRCompileLayer<ListenerLayerT,
-                                      llvm::orc::SimpleCompiler>;
-  using ModuleHandleT = llvm::orc::VModuleKey;
-  std::shared_ptr<llvm::orc::SymbolStringPool> stringPool;
-  llvm::orc::ExecutionSession execSession;
-  std::shared_ptr<llvm::orc::SymbolResolver> resolver;
-  ObjectLayerT objectLayer;
-  ListenerLayerT listenerlayer;
-  CompileLayerT compileLayer;
-  llvm::LLVMContext context;
-  bool compiled = false;
-  ModuleHandleT moduleHandle;
+  llvm::orc::ThreadSafeContext context;
+  // The merged modules as parsed from the bitcode, cloned for each compile.
+  std::unique_ptr<llvm::Module> pristineModule;
+  std::vector<llvm::StringRef> pristineModuleSources;
+  std::unique_ptr<llvm::orc::LLLazyJIT> jit;
+  // The number of compile threads `jit` has been created with.
+  unsigned jitCompileThreads = 0;
+  // The previous JIT after changing the number of compile threads, kept alive
+  // until the next module is added.
+  std::unique_ptr<llvm::orc::LLLazyJIT> retiredJit;
+  // The code of the last two modules is kept in alternating JITDylibs, so
+  // that the previous code remains valid while the next module is compiled
+  // (possibly asynchronously) and the thunks are switched.
+  llvm::orc::JITDylib *dylibs[2] = {};
+  // Whether the JITDylib contains a module, removed on reset.
+  bool dylibUsed[2] = {};
+  unsigned currentDylib = 0;
   SymMap symMap;
 
+  // Object files are disassembled to this stream and copied to this buffer
+  // if set. Guarded by `listenerMutex`, as objects may be emitted by compile
+  // threads.
+  std::mutex listenerMutex;
+  llvm::raw_ostream *listenerStream = nullptr;
+  std::unique_ptr<llvm::MemoryBuffer> *listenerObject = nullptr;
+
   struct BindDesc final {
     void *originalFunc;
     void *exampleFunc;
     using ParamsVec = llvm::SmallVector<ParamSlice, 5>;
     ParamsVec params;
+    // Whether the bind has been compiled into the current module.
+    bool compiled = false;
   };
   llvm::MapVector<void *, BindDesc> bindInstances;
+
+  // The key of the merged module compiled into the current JITDylib (empty if
+  // none), the number of modules extending it with new bind functions and the
+  // addresses of its bind functions by bind key.
+  std::string moduleKey;
+  unsigned moduleExtensions = 0;
+  llvm::StringMap<void *> bindFunctions;
   const bool mainContext = false;
 
   struct ListenerCleaner final {
     DynamicCompilerContext &owner;
-    ListenerCleaner(DynamicCompilerContext &o, llvm::raw_ostream *stream);
+    ListenerCleaner(DynamicCompilerContext &o, llvm::raw_ostream *stream,
+                    std::unique_ptr<llvm::MemoryBuffer> *object);
     ~ListenerCleaner();
   };
 
@@ -99,17 +100,49 @@ public:
   llvm::TargetMachine &getTargetMachine() { return *targetmachine; }
   const llvm::DataLayout &getDataLayout() const { return dataLayout; }
 
+  /// Adds the module to the JIT, replacing the second to last one. Functions
+  /// are compiled lazily on their first call (see `-jit-lazy`), unless the
+  /// generated code is to be dumped to `asmListener` or the object file is to
+  /// be returned in `object`.
   llvm::Error addModule(std::unique_ptr<llvm::Module> module,
-                        llvm::raw_ostream *asmListener);
-
-  llvm::JITSymbol findSymbol(const std::string &name);
-
-  llvm::LLVMContext &getContext() { return context; }
+                        llvm::raw_ostream *asmListener,
+                        std::unique_ptr<llvm::MemoryBuffer> *object = nullptr);
+
+  /// Adds an object file compiled by `addModule` before, replacing the
+  /// second to last module.
+  llvm::Error addObject(std::unique_ptr<llvm::MemoryBuffer> object);
+
+  /// Adds a module with new bind functions to the last added module. Its other
+  /// definitions must be internal.
+  llvm::Error extendModule(std::unique_ptr<llvm::Module> module);
+  unsigned getModuleExtensions() const { return moduleExtensions; }
+
+  /// Returns the merged module parsed before from the same (embedded) bitcode
+  /// buffers, or null. Requires the context lock.
+  const llvm::Module *
+  getPristineModule(llvm::ArrayRef<llvm::StringRef> sources) const;
+  void setPristineModule(std::unique_ptr<llvm::Module> module,
+                         std::vector<llvm::StringRef> sources);
+
+  /// The key of the merged module last added (see `getModuleKey`), or empty.
+  const std::string &getModuleKey() const { return moduleKey; }
+  void setModuleKey(std::string key) { moduleKey = std::move(key); }
+
+  /// Returns the address of the (mangled) symbol of the last added module, or
+  /// null if not found. For lazily compiled functions, this is the address of
+  /// a stub compiling the function on the first call.
+  void *getSymbolAddress(const std::string &name);
+
+  /// The context for modules added to the JIT. It must be locked while
+  /// working on these, as functions may be compiled concurrently.
+  llvm::LLVMContext &getContext() { return *context.getContext(); }
+  llvm::orc::ThreadSafeContext::Lock lockContext() { return context.getLock(); }
 
   void clearSymMap();
 
   void addSymbol(std::string &&name, void *value);
 
+  /// Removes the last added module.
   void reset();
 
   void registerBind(void *handle, void *originalFunc, void *exampleFunc,
@@ -123,10 +156,24 @@ public:
     return bindInstances;
   }
 
+  /// Marks all registered binds as compiled into the last added module.
+  void markBindsCompiled();
+
+  /// Returns the address of a bind function of the last added module by bind
+  /// key, or null if not found.
+  void *getBindFunction(llvm::StringRef key) const;
+  void addBindFunction(llvm::StringRef key, void *addr);
+
   bool isMainContext() const;
 
 private:
-  void removeModule(const ModuleHandleT &handle);
+  llvm::Error createJit();
+
+  /// Switches to the JITDylib of the second to last module, resets it and
+  /// defines the host symbols for the next module.
+  llvm::Error prepareJit();
 
-  std::shared_ptr<llvm::orc::SymbolResolver> createResolver();
+  llvm::Error addModuleToDylib(std::unique_ptr<llvm::Module> module,
+                               llvm::raw_ostream *asmListener,
+                               std::unique_ptr<llvm::MemoryBuffer> *object);
 };
@@ -0,0 +1,133 @@
+//===-- object_cache.cpp --------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "object_cache.h"
+
+#include "optimizer.h"
+#include "options.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace {
+namespace cl = llvm::cl;
+
+cl::opt<std::string> cacheDir(
+    "jit-cache-dir", cl::ZeroOrMore, cl::value_desc("directory"),
+    cl::desc("Cache the compiled code in this directory across process runs "
+             "(ignored if a dump handler is set; functions are compiled "
+             "upfront on cache misses)"));
+
+cl::opt<unsigned long long> cacheSizeLimit(
+    "jit-cache-maxbytes", cl::ZeroOrMore, cl::value_desc("size"),
+    cl::desc("Prune the least recently used files of the -jit-cache-dir "
+             "cache when it exceeds <size> bytes (default: 256 MiB, 0 = no "
+             "limit besides 75% of the available space)"),
+    cl::init(256 * 1024 * 1024));
+
+// llvm::pruneCache only removes files named `llvmcache-*`, as a safeguard
+// against pointing the cache to the wrong directory.
+std::string getCachePath(const std::string &key) {
+  llvm::SmallString<128> path(cacheDir);
+  llvm::sys::path::append(path, "llvmcache-ldc-jit-" + key + ".o");
+  return std::string(path.str());
+}
+
+void pruneCache() {
+  llvm::CachePruningPolicy policy;
+  policy.MaxSizeBytes = cacheSizeLimit;
+  llvm::pruneCache(cacheDir, policy);
+}
+
+} // anon namespace
+
+bool isObjectCacheEnabled() { return !cacheDir.empty(); }
+
+ModuleKey::ModuleKey(const llvm::TargetMachine &targetMachine,
+                     const OptimizerSettings &settings) {
+  add(LLVM_VERSION_STRING);
+  add(targetMachine.getTargetTriple().str());
+  add(targetMachine.getTargetCPU());
+  add(targetMachine.getTargetFeatureString());
+  add(std::to_string(settings.optLevel));
+  add(std::to_string(settings.sizeLevel));
+  // The options may change the optimization pipeline.
+  for (auto &&opt : getParsedOptions()) {
+    add(opt);
+  }
+}
+
+void ModuleKey::add(llvm::StringRef data) {
+  const uint64_t size = data.size();
+  hash.update(llvm::ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(&size), sizeof(size)));
+  hash.update(data);
+}
+
+std::string ModuleKey::get() const {
+  auto copy = hash;
+  llvm::MD5::MD5Result result;
+  copy.final(result);
+  return std::string(result.digest().str());
+}
+
+std::unique_ptr<llvm::MemoryBuffer> loadCachedObject(const std::string &key) {
+  auto buffer = llvm::MemoryBuffer::getFile(getCachePath(key));
+  if (!buffer) {
+    return nullptr;
+  }
+  // Don't hand truncated or foreign files to the JIT linker.
+  auto objFile = llvm::object::ObjectFile::createObjectFile(
+      (*buffer)->getMemBufferRef());
+  if (!objFile) {
+    consumeError(objFile.takeError());
+    return nullptr;
+  }
+  return std::move(*buffer);
+}
+
+void storeCachedObject(const std::string &key, llvm::MemoryBufferRef object) {
+  if (llvm::sys::fs::create_directories(cacheDir)) {
+    return;
+  }
+
+  // Write to a temporary file first, so that concurrently running processes
+  // never see partially written objects.
+  llvm::SmallString<128> model(cacheDir);
+  llvm::sys::path::append(model, "llvmcache-ldc-jit-%%%%%%%%.tmp");
+  int fd = -1;
+  llvm::SmallString<128> tempPath;
+  if (llvm::sys::fs::createUniqueFile(model, fd, tempPath)) {
+    return;
+  }
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose*/ true);
+    os << object.getBuffer();
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(tempPath);
+      return;
+    }
+  }
+  if (llvm::sys::fs::rename(tempPath, getCachePath(key))) {
+    llvm::sys::fs::remove(tempPath);
+    return;
+  }
+  // Only scans the directory if the pruning interval has passed.
+  pruneCache();
+}
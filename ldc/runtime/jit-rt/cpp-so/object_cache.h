@@ -0,0 +1,63 @@
+//===-- object_cache.h - jit support ----------------------------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the Boost Software License. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Jit runtime - persistent cache of the compiled object files, allowing
+// subsequent process runs to skip optimization and codegen (`-jit-cache-dir`).
+//
+//===----------------------------------------------------------------------===//
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MD5.h"
+
+namespace llvm {
+class MemoryBuffer;
+class MemoryBufferRef;
+class TargetMachine;
+} // namespace llvm
+
+struct OptimizerSettings;
+
+/// Returns whether a cache directory has been set with `-jit-cache-dir`.
+bool isObjectCacheEnabled();
+
+/// Computes the key of the compiled code from its inputs, for the cache and
+/// for detecting unchanged modules. The parsed modules can't be hashed, as
+/// named types are renamed when parsing them again into the same context.
+class ModuleKey final {
+  llvm::MD5 hash;
+  bool pointers = false;
+
+public:
+  /// Starts with the LLVM version, target, optimization settings and options.
+  ModuleKey(const llvm::TargetMachine &targetMachine,
+            const OptimizerSettings &settings);
+
+  void add(llvm::StringRef data);
+
+  /// Returns the key of the data added so far.
+  std::string get() const;
+
+  /// Marks the added data as containing pointers, e.g. values of runtime
+  /// constants or bound parameters. Addresses differ across process runs, so
+  /// such code must not be stored in the cache.
+  void setHasPointers() { pointers = true; }
+  bool hasPointers() const { return pointers; }
+};
+
+/// Returns the cached object file for the key, or null if not found.
+std::unique_ptr<llvm::MemoryBuffer> loadCachedObject(const std::string &key);
+
+/// Stores the object file in the cache. Failures are ignored, the cache is
+/// only an optimization.
+void storeCachedObject(const std::string &key, llvm::MemoryBufferRef object);
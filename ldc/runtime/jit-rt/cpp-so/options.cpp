@@ -14,6 +14,10 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Support/CommandLine.h"
 
+namespace {
+std::vector<std::string> parsedOptions;
+}
+
 bool parseOptions(Slice<Slice<const char>> args,
                   void (*errs)(void *, const char *, size_t),
                   void *errsContext) {
@@ -43,5 +47,8 @@ bool parseOptions(Slice<Slice<const char>> args,
   auto res = llvm::cl::ParseCommandLineOptions(
       static_cast<int>(tempOpts.size()), tempOpts.data(), "", &os);
   os.flush();
+  parsedOptions.assign(tempStrs.begin(), tempStrs.end());
   return res;
 }
+
+const std::vector<std::string> &getParsedOptions() { return parsedOptions; }
@@ -14,10 +14,16 @@
 #ifndef OPTIONS_HPP
 #define OPTIONS_HPP
 
+#include <string>
+#include <vector>
+
 #include "slice.h"
 
 bool parseOptions(Slice<Slice<const char>> args,
                   void (*errs)(void *, const char *, size_t),
                   void *errsContext);
 
+/// Returns the options last set with `parseOptions`.
+const std::vector<std::string> &getParsedOptions();
+
 #endif // OPTIONS_HPP